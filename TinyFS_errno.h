@@ -18,3 +18,7 @@
 #define ERR_OUTOFBOUNDS -18
 #define ERR_TIMING -19
 #define ERR_READONLY -20
+#define ERR_NOMEMORY -21
+#define ERR_CHECKSUM -22
+#define ERR_FILEEXISTS -23
+#define ERR_JOURNALLIMIT -24
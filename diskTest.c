@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include "libDisk.h"
+#include "TinyFS_errno.h"
 
 
 #define NUM_TEST_DISKS 4 /* number of disks to test with */
@@ -13,6 +14,124 @@
 // out of 50 choose only 10 - when we test change numbers
 // blocks we want to read and write to 
 
+#define BACKENDS {DISK_STDIO, DISK_FD, DISK_MMAP, DISK_URING}
+#define NUM_BACKENDS 4
+#define BAD_BLOCK 30    /* block the checksum test damages */
+
+
+/* the byte block bNum of the backend test disk should hold at offset */
+char expected(int bNum, int offset) {
+    return 'a' + (bNum * 7 + offset) % 26;
+}
+
+/* Every backend reads the same file the same way, one block at a time or a run at once, and sees what
+ * the others wrote to it */
+int backendTest() {
+    char *diskName = "diskBackend.dsk";
+    char buffer[BLOCKSIZE], many[NUM_BLOCKS * BLOCKSIZE];
+    int backends[NUM_BACKENDS] = BACKENDS;
+    int nums[NUM_BLOCKS];
+    int index, index2, index3, failed = 0;
+
+    remove(diskName);
+    int disk = openDiskBackend(diskName, BLOCKSIZE * NUM_BLOCKS, DISK_STDIO);
+    for (index = 0; index < NUM_BLOCKS; index++) {
+        for (index2 = 0; index2 < BLOCKSIZE; index2++)
+            buffer[index2] = expected(index, index2);
+        if (writeBlock(disk, index, buffer) < 0)
+            failed = 1;
+        nums[index] = NUM_BLOCKS - 1 - index;   /* backwards, so a run isn't just the file in order */
+    }
+    if (disk < 0 || closeDisk(disk) < 0)
+        failed = 1;
+
+    for (index = 0; index < NUM_BACKENDS && !failed; index++) {
+        disk = openDiskBackend(diskName, BLOCKSIZE * NUM_BLOCKS, backends[index]);
+        if (disk < 0 || readBlocks(disk, nums, NUM_BLOCKS, many) < 0) {
+            printf("] backend %d failed to open or read\n", backends[index]);
+            failed = 1;
+            break;
+        }
+        for (index2 = 0; index2 < NUM_BLOCKS; index2++) {
+            if (readBlock(disk, index2, buffer) < 0)
+                failed = 1;
+            for (index3 = 0; index3 < BLOCKSIZE; index3++) {
+                if (buffer[index3] != expected(index2, index3) || many[(NUM_BLOCKS - 1 - index2) * BLOCKSIZE + index3] != expected(index2, index3))
+                    failed = 1;
+            }
+        }
+
+        /* leave a block for the next backend to find */
+        memset(buffer, '0' + index, BLOCKSIZE);
+        if (writeBlock(disk, index, buffer) < 0 || closeDisk(disk) < 0)
+            failed = 1;
+        if (index > 0) {
+            disk = openDiskBackend(diskName, BLOCKSIZE * NUM_BLOCKS, backends[index - 1]);
+            if (readBlock(disk, index, buffer) < 0 || buffer[0] != '0' + index || buffer[BLOCKSIZE - 1] != '0' + index)
+                failed = 1;
+            closeDisk(disk);
+        }
+        if (failed)
+            printf("] backend %d read something else\n", backends[index]);
+
+        /* put it back for the next backend */
+        disk = openDiskBackend(diskName, BLOCKSIZE * NUM_BLOCKS, DISK_STDIO);
+        for (index2 = 0; index2 < BLOCKSIZE; index2++)
+            buffer[index2] = expected(index, index2);
+        writeBlock(disk, index, buffer);
+        closeDisk(disk);
+    }
+    remove(diskName);
+
+    printf(failed ? "] backend test failed\n" : "] backend test passed\n");
+    return failed;
+}
+
+/* A block changed in the file behind the disk's back fails its checksum when it's read, and the blocks
+ * around it still read */
+int checksumTest() {
+    char *diskName = "diskChecksum.dsk";
+    char buffer[BLOCKSIZE], many[NUM_BLOCKS * BLOCKSIZE];
+    int nums[NUM_BLOCKS];
+    int index, failed = 0;
+
+    remove(diskName);
+    int disk = openDisk(diskName, BLOCKSIZE * NUM_BLOCKS);
+    if (disk < 0 || setChecksums(disk, CRC_ZEROED) < 0)
+        failed = 1;
+    memset(buffer, '$', BLOCKSIZE);
+    for (index = 0; index < NUM_BLOCKS; index++) {
+        nums[index] = index;
+        if (writeBlock(disk, index, buffer) < 0)
+            failed = 1;
+    }
+    closeDisk(disk);
+
+    /* flip a bit of one block in the file */
+    FILE *file = fopen(diskName, "r+");
+    if (file == NULL || fseek(file, BAD_BLOCK * BLOCKSIZE + 7, SEEK_SET) != 0 || fputc('$' ^ 0x10, file) == EOF)
+        failed = 1;
+    if (file != NULL)
+        fclose(file);
+
+    disk = openDisk(diskName, 0);
+    if (setChecksums(disk, CRC_ON) < 0 || readBlock(disk, BAD_BLOCK, buffer) != ERR_CHECKSUM ||
+        readBlocks(disk, nums, NUM_BLOCKS, many) != ERR_CHECKSUM)
+        failed = 1;
+    if (readBlock(disk, BAD_BLOCK - 1, buffer) < 0 || readBlock(disk, BAD_BLOCK + 1, buffer) < 0 ||
+        readBlocks(disk, nums, BAD_BLOCK, many) < 0)
+        failed = 1;
+
+    /* rebuilding the table takes the block as it is now */
+    if (setChecksums(disk, CRC_REBUILD) < 0 || readBlock(disk, BAD_BLOCK, buffer) < 0 || buffer[7] != ('$' ^ 0x10))
+        failed = 1;
+    closeDisk(disk);
+    remove(diskName);
+
+    printf(failed ? "] checksum test failed\n" : "] checksum test passed\n");
+    return failed;
+}
+
 
 int main() {
     int index = 0; 
@@ -75,5 +194,5 @@ int main() {
             printf("] Previous writes were varified. Now, delete the .dsk files if you want to run this test again.\n");
        } 
     }
-    return 0;
+    return backendTest() | checksumTest();
 }
@@ -1,37 +1,972 @@
+#define _GNU_SOURCE                 /* fallocate */
 #include "libDisk.h"
 #include "tinyFS.h"
 #include "TinyFS_errno.h"
 
-Disk *head = NULL;
+Disk **disks = NULL;        /* registry of every disk opened so far, indexed by disk number. It's only ever
+                                replaced whole, so looking up a disk by number doesn't need a lock */
+int diskCapacity = 0;
+Disk **retiredDisks[MAX_REGISTRY_GROWTH];   /* outgrown registries, kept since a lookup may still be reading one */
+int numRetired = 0;
+Disk **nameBuckets = NULL;  /* the same disks hashed by filename */
+int numNameBuckets = 0;
 int diskCount = 0;
+int defaultCacheSize = DEFAULT_CACHE_BLOCKS;
+pthread_mutex_t registryLock;   /* guards opening, closing and adding disks. Recursive, since those call each other */
+pthread_once_t registryOnce = PTHREAD_ONCE_INIT;
+int flushHooked = 0;        /* flushOpenDisks is registered to run at exit */
 
-/* opens regular UNIX File */
+static void initRegistryLock(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&registryLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void lockRegistry(void) {
+    pthread_once(&registryOnce, initRegistryLock);
+    pthread_mutex_lock(&registryLock);
+}
+
+static void unlockRegistry(void) {
+    pthread_mutex_unlock(&registryLock);
+}
+
+pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+uint32_t crcTable[8][256];  /* slicing-by-8 tables for the portable CRC32C */
+uint32_t crcShift[4][256];  /* what each byte of a CRC32C turns into after CRC_LANE more zero bytes */
+uint32_t crcZeroBlock;      /* CRC32C of an all-zero block. Stored checksums are xored with it, so 0 matches a block never written */
+static uint32_t (*crcUpdate)(uint32_t crc, const unsigned char *data, size_t len);
+
+/* Portable CRC32C (Castagnoli, reflected), eight bytes per table lookup round */
+static uint32_t crcUpdateTable(uint32_t crc, const unsigned char *data, size_t len) {
+    while (len >= 8) {
+        uint32_t low = crc ^ ((uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+        crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF] ^ crcTable[5][(low >> 16) & 0xFF] ^
+              crcTable[4][low >> 24] ^ crcTable[3][data[4]] ^ crcTable[2][data[5]] ^ crcTable[1][data[6]] ^
+              crcTable[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crcTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/* Move a CRC32C CRC_LANE bytes further along, as if that many zero bytes came after what it covers */
+static uint32_t crcShiftLane(uint32_t crc) {
+    return crcShift[0][crc & 0xFF] ^ crcShift[1][(crc >> 8) & 0xFF] ^ crcShift[2][(crc >> 16) & 0xFF] ^ crcShift[3][crc >> 24];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* CRC32C with the SSE4.2 crc32 instruction. Each one waits on the last, so three lanes of CRC_LANE bytes are worked on at
+    once and shifted together after, then the rest goes eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crcUpdateSse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t crc64 = crc;
+    uint64_t word, word1, word2;
+    int i;
+    while (len >= 3 * CRC_LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (i = 0; i < CRC_LANE; i += 8) {
+            memcpy(&word, data + i, 8);
+            memcpy(&word1, data + CRC_LANE + i, 8);
+            memcpy(&word2, data + 2 * CRC_LANE + i, 8);
+            crc64 = __builtin_ia32_crc32di(crc64, word);
+            crc1 = __builtin_ia32_crc32di(crc1, word1);
+            crc2 = __builtin_ia32_crc32di(crc2, word2);
+        }
+        crc64 = crcShiftLane(crcShiftLane((uint32_t) crc64) ^ (uint32_t) crc1) ^ (uint32_t) crc2;
+        data += 3 * CRC_LANE;
+        len -= 3 * CRC_LANE;
+    }
+    while (len >= 8) {
+        memcpy(&word, data, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) crc64;
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+/* Build the tables and pick the fastest CRC32C the CPU has */
+static void initCrc(void) {
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+        }
+        crcTable[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crcTable[j][i] = (crcTable[j - 1][i] >> 8) ^ crcTable[0][crcTable[j - 1][i] & 0xFF];
+        }
+    }
+
+    char zeros[BLOCKSIZE] = {0};
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 4; j++) {
+            crcShift[j][i] = crcUpdateTable((uint32_t) i << (8 * j), (const unsigned char *) zeros, CRC_LANE);
+        }
+    }
+
+    crcUpdate = crcUpdateTable;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crcUpdate = crcUpdateSse42;
+    }
+#endif
+    crcZeroBlock = ~crcUpdate(~0u, (const unsigned char *) zeros, BLOCKSIZE);
+}
+
+/* CRC32C of len bytes of data */
+uint32_t crc32c(const void *data, size_t len) {
+    pthread_once(&crcOnce, initCrc);
+    return ~crcUpdate(~0u, (const unsigned char *) data, len);
+}
+
+/* The checksum a disk's table keeps for a block holding data */
+static uint32_t blockCrc(const void *block) {
+    return ~crcUpdate(~0u, (const unsigned char *) block, BLOCKSIZE) ^ crcZeroBlock;
+}
+
+/* Record the checksum of a block that's being written to the disk's file */
+static void crcSet(Disk *disk, int bNum, const void *block) {
+    uint32_t *crcs = disk->crcs;
+    if (crcs == NULL || bNum >= disk->crcBlocks) {
+        return;
+    }
+    uint32_t crc = blockCrc(block);
+    if (__atomic_exchange_n(&crcs[bNum], crc, __ATOMIC_RELAXED) != crc) {
+        __atomic_store_n(&disk->crcDirty[bNum / CRC_CHUNK], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Check a block just read from the disk's file against its checksum. Return 0 if it matches or ERR_CHECKSUM */
+static int crcCheck(Disk *disk, int bNum, const void *block) {
+    uint32_t *crcs = disk->crcs;
+    if (crcs == NULL || bNum >= disk->crcBlocks) {
+        return 0;
+    }
+    return blockCrc(block) == __atomic_load_n(&crcs[bNum], __ATOMIC_RELAXED) ? 0 : ERR_CHECKSUM;
+}
+
+/* Record the checksums of n blocks being written to the file, or check n blocks just read from it.
+    Return 0 on success or ERR_CHECKSUM if a block read doesn't match */
+static int crcRefs(Disk *disk, BlockRef *refs, int n, int writing) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (writing) {
+            crcSet(disk, refs[i].bNum, refs[i].buf);
+        } else if (crcCheck(disk, refs[i].bNum, refs[i].buf) < 0) {
+            return ERR_CHECKSUM;
+        }
+    }
+    return 0;
+}
+
+static int closeDiskLocked(int diskNumber);
+
+/* Read a block straight from the disk's file, bypassing the cache */
+static int diskRead(Disk *disk, int bNum, void *block) {
+    if (disk->backend == DISK_MMAP) {
+        if ((size_t) (bNum + 1) * BLOCKSIZE > disk->mapSize) {
+            return ERR_READISSUE;
+        }
+        memcpy(block, disk->map + (size_t) bNum * BLOCKSIZE, BLOCKSIZE);
+        return crcCheck(disk, bNum, block);
+    }
+
+    if (disk->backend == DISK_FD || disk->backend == DISK_URING) {
+        /* positional read, no seek state to share */
+        if (pread(disk->fd, block, BLOCKSIZE, (off_t) bNum * BLOCKSIZE) != BLOCKSIZE) {
+            return ERR_READISSUE;
+        }
+        return crcCheck(disk, bNum, block);
+    }
+
+    /* The FILE* has one position shared by every thread, so seek and read together */
+    int status = 0;
+    pthread_mutex_lock(&disk->ioLock);
+
+    /* Go into file and set head of reader at the start of the block */
+    if (fseeko(disk->file, (off_t) bNum * BLOCKSIZE, SEEK_SET) != 0) {
+        status = ERR_FINDANDCHANGESTATUS;
+    }
+    /* Read the BLOCKSIZE into block */
+    else if (fread(block, 1, BLOCKSIZE, disk->file) != BLOCKSIZE) {
+        status = ERR_READISSUE;
+    }
+
+    pthread_mutex_unlock(&disk->ioLock);
+    return status < 0 ? status : crcCheck(disk, bNum, block);
+}
+
+/* Write a block straight to the disk's file, bypassing the cache */
+static int diskWrite(Disk *disk, int bNum, void *block) {
+    crcSet(disk, bNum, block);
+    if (disk->backend == DISK_MMAP) {
+        if (disk->readOnly || (size_t) (bNum + 1) * BLOCKSIZE > disk->mapSize) {
+            return ERR_WRITEISSUE;
+        }
+        memcpy(disk->map + (size_t) bNum * BLOCKSIZE, block, BLOCKSIZE);
+        return 0;
+    }
+
+    if (disk->backend == DISK_FD || disk->backend == DISK_URING) {
+        if (pwrite(disk->fd, block, BLOCKSIZE, (off_t) bNum * BLOCKSIZE) != BLOCKSIZE) {
+            return ERR_WRITEISSUE;
+        }
+        return 0;
+    }
+
+    int status = 0;
+    pthread_mutex_lock(&disk->ioLock);
+
+    /* moves head of file to the start of the block */
+    if (fseeko(disk->file, (off_t) bNum * BLOCKSIZE, SEEK_SET) != 0) {
+        status = ERR_WSEEKISSUE;
+    }
+    else if (fwrite(block, 1, BLOCKSIZE, disk->file) != BLOCKSIZE) {
+        status = ERR_WRITEISSUE;
+    }
+
+    pthread_mutex_unlock(&disk->ioLock);
+    return status;
+}
+
+/* Make an empty cache that holds nBlocks blocks. Return NULL if nBlocks is 0 or memory runs out */
+static BlockCache *createCache(int nBlocks) {
+    if (nBlocks <= 0) {
+        return NULL;
+    }
+
+    BlockCache *cache = (BlockCache *) malloc(sizeof(BlockCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->capacity = nBlocks;
+    cache->count = 0;
+    cache->numBuckets = nBlocks * 2;    /* keep the hash chains short */
+    cache->entries = (CacheEntry *) calloc(nBlocks, sizeof(CacheEntry));
+    cache->buckets = (CacheEntry **) calloc(cache->numBuckets, sizeof(CacheEntry *));
+    cache->lruHead = NULL;
+    cache->lruTail = NULL;
+
+    if (cache->entries == NULL || cache->buckets == NULL) {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+static void destroyCache(BlockCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+}
+
+/* Give a disk a cache of nBlocks blocks, split into up to CACHE_SHARDS shards that are locked separately so
+    threads working on different blocks don't wait on each other. 0 leaves it without a cache.
+    Return 0 on success or ERR_NOMEMORY on failure */
+static int createCaches(Disk *disk, int nBlocks) {
+    int i, numShards = nBlocks < CACHE_SHARDS ? nBlocks : CACHE_SHARDS;
+
+    disk->numShards = 0;
+    for (i = 0; i < numShards; i++) {
+        disk->cache[i] = createCache(nBlocks / numShards + (i < nBlocks % numShards));
+        if (disk->cache[i] == NULL) {
+            while (i-- > 0) {
+                destroyCache(disk->cache[i]);
+            }
+            return ERR_NOMEMORY;
+        }
+    }
+    disk->numShards = numShards > 0 ? numShards : 0;
+    return 0;
+}
+
+static void destroyCaches(Disk *disk) {
+    int i;
+    for (i = 0; i < disk->numShards; i++) {
+        destroyCache(disk->cache[i]);
+    }
+    disk->numShards = 0;
+    __atomic_store_n(&disk->dirtyCount, 0, __ATOMIC_RELAXED);
+}
+
+/* Find the cache shard that holds bNum. Return NULL if the disk has no cache */
+static BlockCache *cacheShard(Disk *disk, int bNum) {
+    return disk->numShards ? disk->cache[bNum % disk->numShards] : NULL;
+}
+
+/* Find the cached copy of bNum. Return NULL if it isn't cached */
+static CacheEntry *cacheLookup(BlockCache *cache, int bNum) {
+    CacheEntry *entry = cache->buckets[bNum % cache->numBuckets];
+    while (entry && entry->bNum != bNum) {
+        entry = entry->hashNext;
+    }
+    return entry;
+}
+
+/* Unlink an entry from the LRU list */
+static void lruRemove(BlockCache *cache, CacheEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->lruHead = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->lruTail = entry->prev;
+    }
+}
+
+/* Put an entry at the front of the LRU list (most recently used) */
+static void lruPushFront(BlockCache *cache, CacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->lruHead;
+    if (cache->lruHead) {
+        cache->lruHead->prev = entry;
+    } else {
+        cache->lruTail = entry;
+    }
+    cache->lruHead = entry;
+}
+
+/* Mark an entry as just used */
+static void cacheTouch(BlockCache *cache, CacheEntry *entry) {
+    if (cache->lruHead != entry) {
+        lruRemove(cache, entry);
+        lruPushFront(cache, entry);
+    }
+}
+
+/* Unlink an entry from its hash bucket */
+static void hashRemove(BlockCache *cache, CacheEntry *entry) {
+    CacheEntry **link = &cache->buckets[entry->bNum % cache->numBuckets];
+    while (*link != entry) {
+        link = &(*link)->hashNext;
+    }
+    *link = entry->hashNext;
+}
+
+/* Add a copy of block as bNum to the disk's cache shard, evicting the least recently used block that isn't being
+    flushed if the shard is full. A dirty block that gets evicted is written back first. The caller holds the shard's lock.
+    Return the entry, or NULL with *status set on failure or left alone if every entry is being flushed */
+static CacheEntry *cacheInsert(Disk *disk, BlockCache *cache, int bNum, void *block, int *status) {
+    CacheEntry *entry;
+
+    if (cache->count < cache->capacity) {
+        /* still have unused entries */
+        entry = &cache->entries[cache->count++];
+        entry->flushing = 0;
+    } else {
+        /* reuse the least recently used entry */
+        entry = cache->lruTail;
+        while (entry && entry->flushing) {
+            entry = entry->prev;
+        }
+        if (entry == NULL) {
+            return NULL;
+        }
+        if (entry->dirty) {
+            *status = diskWrite(disk, entry->bNum, entry->data);
+            if (*status < 0) {
+                return NULL;
+            }
+            __atomic_sub_fetch(&disk->dirtyCount, 1, __ATOMIC_RELAXED);
+        }
+        lruRemove(cache, entry);
+        hashRemove(cache, entry);
+    }
+
+    entry->bNum = bNum;
+    entry->dirty = 0;
+    entry->version++;
+    memcpy(entry->data, block, BLOCKSIZE);
+
+    int bucket = bNum % cache->numBuckets;
+    entry->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lruPushFront(cache, entry);
+
+    return entry;
+}
+
+/* Order block references by block number */
+static int compareBlockRefs(const void *a, const void *b) {
+    return ((const BlockRef *) a)->bNum - ((const BlockRef *) b)->bNum;
+}
+
+/* Read or write n blocks that sit next to each other on the disk (refs[i].bNum == refs[0].bNum + i).
+    The descriptor backend does the run with one preadv/pwritev per MAX_RUN_BLOCKS blocks.
+    Return 0 on success or error on failure */
+static int diskRun(Disk *disk, BlockRef *refs, int n, int writing) {
+    int i, status;
+    struct iovec iov[MAX_RUN_BLOCKS];
+
+    if (disk->backend != DISK_FD && disk->backend != DISK_URING) {
+        for (i = 0; i < n; i++) {
+            status = writing ? diskWrite(disk, refs[i].bNum, refs[i].buf) : diskRead(disk, refs[i].bNum, refs[i].buf);
+            if (status < 0) {
+                return status;
+            }
+        }
+        return 0;
+    }
+
+    if (n <= 0) {
+        return 0;
+    }
+    if (n > MAX_RUN_BLOCKS) {
+        status = diskRun(disk, refs, MAX_RUN_BLOCKS, writing);
+        return status < 0 ? status : diskRun(disk, refs + MAX_RUN_BLOCKS, n - MAX_RUN_BLOCKS, writing);
+    }
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = refs[i].buf;
+        iov[i].iov_len = BLOCKSIZE;
+    }
+
+    off_t offset = (off_t) refs[0].bNum * BLOCKSIZE;
+    ssize_t expected = (ssize_t) n * BLOCKSIZE;
+    if (writing) {
+        crcRefs(disk, refs, n, 1);
+        return pwritev(disk->fd, iov, n, offset) == expected ? 0 : ERR_WRITEISSUE;
+    }
+    if (preadv(disk->fd, iov, n, offset) != expected) {
+        return ERR_READISSUE;
+    }
+    return crcRefs(disk, refs, n, 0);
+}
+
+/* Unmap a disk's io_uring and close it */
+static void ringDestroy(Disk *disk) {
+    DiskRing *ring = disk->ring;
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqMap != NULL && ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    if (ring->sqMap != NULL && ring->sqMap != MAP_FAILED) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    close(ring->fd);
+    free(ring);
+    disk->ring = NULL;
+}
+
+/* Set up an io_uring for a disk opened with DISK_URING.
+    Return 0 on success or error if the kernel doesn't have io_uring (or it's turned off) */
+static int ringSetup(Disk *disk) {
+#ifdef HAVE_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (fd < 0) {
+        return ERR_FILEISSUE;
+    }
+
+    DiskRing *ring = (DiskRing *) calloc(1, sizeof(DiskRing));
+    if (ring == NULL) {
+        close(fd);
+        return ERR_NOMEMORY;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Map the rings, which newer kernels let us do with one mapping */
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cqMapSize > ring->sqMapSize) {
+        ring->sqMapSize = ring->cqMapSize;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cqMap = single ? ring->sqMap : mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        disk->ring = ring;
+        ringDestroy(disk);
+        return ERR_FILEISSUE;
+    }
+
+    char *sq = (char *) ring->sqMap;
+    char *cq = (char *) ring->cqMap;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+    disk->ring = ring;
+    return 0;
+#else
+    (void) disk;
+    return ERR_FILEISSUE;
+#endif
+}
+
+#ifdef HAVE_URING
+/* Submit runs of adjacent blocks (run i is refs[starts[i]] up to refs[starts[i + 1]]) to the disk's io_uring, keeping as
+    many in flight as the ring holds, and set done[i] for every run that completed in full */
+static void ringSubmit(Disk *disk, BlockRef *refs, const int *starts, int numRuns, int writing, char *done) {
+    int i, next = 0, inFlight = 0, broken = 0;
+
+    struct iovec *iov = (struct iovec *) malloc(starts[numRuns] * sizeof(struct iovec) + 1);
+    if (iov == NULL) {
+        return;
+    }
+    for (i = 0; i < starts[numRuns]; i++) {
+        iov[i].iov_base = refs[i].buf;
+        iov[i].iov_len = BLOCKSIZE;
+    }
+
+    pthread_mutex_lock(&disk->ioLock);
+    DiskRing *ring = disk->ring;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *) (ring ? ring->sqes : NULL);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *) (ring ? ring->cqes : NULL);
+    while (ring && ((next < numRuns && !broken) || inFlight > 0)) {
+        /* Queue as many runs as the ring has room for */
+        unsigned tail = *ring->sqTail;
+        while (!broken && next < numRuns && inFlight < (int) ring->entries) {
+            unsigned idx = tail & *ring->sqMask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = disk->fd;
+            sqe->addr = (unsigned long) (iov + starts[next]);
+            sqe->len = starts[next + 1] - starts[next];
+            sqe->off = (off_t) refs[starts[next]].bNum * BLOCKSIZE;
+            sqe->user_data = next;
+            ring->sqArray[idx] = idx;
+            tail++;
+            next++;
+            inFlight++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        /* Submit whatever the kernel hasn't taken yet and wait for at least one run to finish */
+        unsigned pending = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN) {
+            /* Take back what never got submitted, those runs are done synchronously instead */
+            pending = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+            __atomic_store_n(ring->sqTail, tail - pending, __ATOMIC_RELEASE);
+            inFlight -= pending;
+            if (broken) {
+                break;  /* can't even wait, give up on the runs still in flight */
+            }
+            broken = 1;
+        }
+
+        /* Reap what finished */
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *ring->cqMask];
+            int run = (int) cqe->user_data;
+            if (cqe->res == (starts[run + 1] - starts[run]) * BLOCKSIZE) {
+                done[run] = 1;
+            }
+            head++;
+            inFlight--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&disk->ioLock);
+    free(iov);
+}
+#endif
+
+/* Read or write runs of adjacent blocks (run i is refs[starts[i]] up to refs[starts[i + 1]]). A disk with an io_uring
+    gets them all in flight at once, and anything it couldn't do is done with one preadv/pwritev per run.
+    Return 0 on success or error on failure */
+static int ringRuns(Disk *disk, BlockRef *refs, const int *starts, int numRuns, int writing) {
+    int i, status = 0;
+
+    char *done = (char *) calloc(numRuns + 1, 1);
+    if (done == NULL) {
+        return ERR_NOMEMORY;
+    }
+#ifdef HAVE_URING
+    if (numRuns > 1) {
+        if (writing) {
+            crcRefs(disk, refs, starts[numRuns], 1);
+        }
+        ringSubmit(disk, refs, starts, numRuns, writing, done);
+    }
+#endif
+    for (i = 0; i < numRuns && status == 0; i++) {
+        if (!done[i]) {
+            status = diskRun(disk, refs + starts[i], starts[i + 1] - starts[i], writing);
+        } else if (!writing) {
+            status = crcRefs(disk, refs + starts[i], starts[i + 1] - starts[i], 0);
+        }
+    }
+    free(done);
+    return status;
+}
+
+/* Sort refs by block number and read or write them with one call per run of adjacent blocks. The io_uring backend
+    submits all the runs together. Return 0 on success or error on failure */
+static int diskRuns(Disk *disk, BlockRef *refs, int n, int writing) {
+    int start = 0, end, status, numRuns = 0;
+
+    qsort(refs, n, sizeof(BlockRef), compareBlockRefs);
+    int *starts = disk->backend == DISK_URING ? (int *) malloc((n + 1) * sizeof(int)) : NULL;
+    while (start < n) {
+        end = start + 1;
+        while (end < n && end - start < MAX_RUN_BLOCKS && refs[end].bNum == refs[end - 1].bNum + 1) {
+            end++;
+        }
+        if (starts) {
+            starts[numRuns++] = start;
+        } else {
+            status = diskRun(disk, refs + start, end - start, writing);
+            if (status < 0) {
+                return status;
+            }
+        }
+        start = end;
+    }
+
+    if (starts) {
+        starts[numRuns] = n;
+        status = ringRuns(disk, refs, starts, numRuns, writing);
+        free(starts);
+        return status;
+    }
+    return 0;
+}
+
+/* Write every dirty cached block of a disk back to its file, coalescing adjacent blocks.
+    Return 0 on success or error on failure */
+static int flushCache(Disk *disk) {
+    int i, j, status = 0, count = 0, total = 0;
+    BlockCache *cache;
+
+    pthread_rwlock_wrlock(&disk->flushLock);
+
+    /* Hold every shard at once while copying the dirty blocks out, adjacent blocks live in different shards */
+    for (i = 0; i < disk->numShards; i++) {
+        pthread_mutex_lock(&disk->cache[i]->lock);
+        total += disk->cache[i]->count;
+    }
+
+    BlockRef *refs = (BlockRef *) malloc(total * sizeof(BlockRef) + 1);
+    unsigned int *versions = (unsigned int *) malloc(total * sizeof(unsigned int) + 1);
+    char *copies = (char *) malloc((size_t) total * BLOCKSIZE + 1);
+    if (refs == NULL || versions == NULL || copies == NULL) {
+        free(refs);
+        free(versions);
+        free(copies);
+        refs = NULL;
+    }
+    for (i = 0; i < disk->numShards && status == 0; i++) {
+        cache = disk->cache[i];
+        for (j = 0; j < cache->count && status == 0; j++) {
+            CacheEntry *entry = &cache->entries[j];
+            if (!entry->dirty) {
+                continue;
+            }
+            if (refs) {
+                refs[count].bNum = entry->bNum;
+                refs[count].buf = copies + (size_t) count * BLOCKSIZE;
+                memcpy(refs[count].buf, entry->data, BLOCKSIZE);
+                versions[count] = entry->version;
+                entry->flushing = 1;
+                count++;
+            } else {
+                /* no memory for copies, write them one at a time */
+                status = diskWrite(disk, entry->bNum, entry->data);
+                if (status == 0) {
+                    entry->dirty = 0;
+                    __atomic_sub_fetch(&disk->dirtyCount, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    for (i = 0; i < disk->numShards; i++) {
+        pthread_mutex_unlock(&disk->cache[i]->lock);
+    }
+
+    /* Write the copies without holding any shard, so reads carry on. A block that changed since it was copied
+        stays dirty */
+    if (refs) {
+        BlockRef *sorted = (BlockRef *) malloc(count * sizeof(BlockRef) + 1);
+        if (sorted) {
+            memcpy(sorted, refs, count * sizeof(BlockRef));
+            status = diskRuns(disk, sorted, count, 1);
+            free(sorted);
+        } else {
+            status = ERR_NOMEMORY;
+        }
+        for (i = 0; i < count; i++) {
+            cache = cacheShard(disk, refs[i].bNum);
+            pthread_mutex_lock(&cache->lock);
+            CacheEntry *entry = cacheLookup(cache, refs[i].bNum);
+            if (entry) {
+                entry->flushing = 0;
+                if (status == 0 && entry->dirty && entry->version == versions[i]) {
+                    entry->dirty = 0;
+                    __atomic_sub_fetch(&disk->dirtyCount, 1, __ATOMIC_RELAXED);
+                }
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+        free(refs);
+        free(versions);
+        free(copies);
+    }
+
+    pthread_rwlock_unlock(&disk->flushLock);
+    return status;
+}
+
+/* Write the chunks of a disk's checksum table that changed since it was last written, right after its blocks in the file.
+    Return 0 on success or error on failure */
+static int crcFlush(Disk *disk) {
+    int i, j, status = 0;
+    unsigned char buf[CRC_CHUNK * 4];
+
+    if (disk->crcs == NULL || disk->readOnly) {
+        return 0;
+    }
+    pthread_mutex_lock(&disk->crcLock);
+    int numChunks = (disk->crcBlocks + CRC_CHUNK - 1) / CRC_CHUNK;
+    for (i = 0; i < numChunks; i++) {
+        if (!__atomic_exchange_n(&disk->crcDirty[i], 0, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        /* stored little endian so images move between machines */
+        int count = disk->crcBlocks - i * CRC_CHUNK < CRC_CHUNK ? disk->crcBlocks - i * CRC_CHUNK : CRC_CHUNK;
+        for (j = 0; j < count; j++) {
+            uint32_t crc = __atomic_load_n(&disk->crcs[i * CRC_CHUNK + j], __ATOMIC_RELAXED);
+            buf[j * 4] = crc;
+            buf[j * 4 + 1] = crc >> 8;
+            buf[j * 4 + 2] = crc >> 16;
+            buf[j * 4 + 3] = crc >> 24;
+        }
+        off_t offset = (off_t) disk->crcBlocks * BLOCKSIZE + (off_t) i * CRC_CHUNK * 4;
+        if (pwrite(disk->fd, buf, count * 4, offset) != count * 4) {
+            __atomic_store_n(&disk->crcDirty[i], 1, __ATOMIC_RELAXED);
+            status = ERR_WRITEISSUE;
+        }
+    }
+    pthread_mutex_unlock(&disk->crcLock);
+    return status;
+}
+
+/* Fill in crcs for the nBlocks blocks of a disk, from the table stored after them or from the blocks themselves.
+    A table cut short by the end of the file reads as zeros. Return 0 on success or error on failure */
+static int crcLoad(Disk *disk, uint32_t *crcs, int nBlocks, int mode) {
+    int i, j;
+    off_t tableStart = (off_t) nBlocks * BLOCKSIZE;
+
+    if (mode == CRC_ON) {
+        unsigned char *buf = (unsigned char *) calloc((size_t) nBlocks, 4);
+        if (buf == NULL) {
+            return ERR_NOMEMORY;
+        }
+        ssize_t got = pread(disk->fd, buf, (size_t) nBlocks * 4, tableStart);
+        for (i = 0; got >= 0 && i < nBlocks; i++) {
+            crcs[i] = buf[i * 4] | buf[i * 4 + 1] << 8 | buf[i * 4 + 2] << 16 | (uint32_t) buf[i * 4 + 3] << 24;
+        }
+        free(buf);
+        return got < 0 ? ERR_READISSUE : 0;
+    }
+
+    /* Rebuild: read every block a run at a time */
+    BlockRef refs[MAX_RUN_BLOCKS];
+    char *blocks = (char *) malloc(MAX_RUN_BLOCKS * BLOCKSIZE);
+    if (blocks == NULL) {
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; i < nBlocks; i += MAX_RUN_BLOCKS) {
+        int count = nBlocks - i < MAX_RUN_BLOCKS ? nBlocks - i : MAX_RUN_BLOCKS;
+        for (j = 0; j < count; j++) {
+            refs[j].bNum = i + j;
+            refs[j].buf = blocks + j * BLOCKSIZE;
+        }
+        if (diskRun(disk, refs, count, 0) < 0) {
+            free(blocks);
+            return ERR_READISSUE;
+        }
+        for (j = 0; j < count; j++) {
+            crcs[i + j] = blockCrc(refs[j].buf);
+        }
+    }
+    free(blocks);
+    return 0;
+}
+
+/* Write back a disk's checksum table and stop keeping checksums. Return 0 on success or error on failure */
+static int crcDrop(Disk *disk) {
+    int status = crcFlush(disk);
+    free(disk->crcs);
+    free(disk->crcDirty);
+    disk->crcs = NULL;
+    disk->crcDirty = NULL;
+    disk->crcBlocks = 0;
+    return status;
+}
+
+/* Open the UNIX file behind a disk with the given open(2) flags. The stdio backend also gets a FILE* on top of the descriptor.
+    Return 0 on success or ERR_NOFILE on failure */
+static int openHostFile(char *filename, int flags, int backend, int *fd, FILE **file) {
+    *file = NULL;
+    *fd = open(filename, flags, 0644);
+    if (*fd < 0) {
+        return ERR_NOFILE;
+    }
+
+    if (backend == DISK_STDIO) {
+        *file = fdopen(*fd, (flags & O_ACCMODE) == O_RDONLY ? "r" : "r+");
+        if (*file == NULL) {
+            close(*fd);
+            return ERR_NOFILE;
+        }
+    }
+    return 0;
+}
+
+/* Close a file openHostFile opened */
+static void closeHostFile(int fd, FILE *file) {
+    if (file) {
+        fclose(file);   /* also closes the descriptor underneath */
+    } else {
+        close(fd);
+    }
+}
+
+/* Map the disk's file into memory, first growing it to diskSize if the disk is writable.
+    Return 0 on success or error on failure */
+static int mapDisk(Disk *disk) {
+    struct stat info;
+    if (fstat(disk->fd, &info) != 0) {
+        return ERR_FILEISSUE;
+    }
+
+    size_t size = (size_t) info.st_size;
+    if (!disk->readOnly && size < (size_t) disk->diskSize) {
+        if (ftruncate(disk->fd, disk->diskSize) != 0) {
+            return ERR_FILEISSUE;
+        }
+        size = (size_t) disk->diskSize;
+    }
+    if (size > (size_t) disk->diskSize) {
+        size = (size_t) disk->diskSize;
+    }
+
+    disk->map = NULL;
+    disk->mapSize = 0;
+    if (size == 0) {    /* nothing to map yet */
+        return 0;
+    }
+
+    int prot = disk->readOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, size, prot, MAP_SHARED, disk->fd, 0);
+    if (map == MAP_FAILED) {
+        return ERR_FILEISSUE;
+    }
+    disk->map = (char *) map;
+    disk->mapSize = size;
+    return 0;
+}
+
+/* Write a mapped disk's pages back to its file and drop the mapping */
+static int unmapDisk(Disk *disk) {
+    int status = 0;
+    if (disk->map == NULL) {
+        return 0;
+    }
+    if (!disk->readOnly && msync(disk->map, disk->mapSize, MS_SYNC) != 0) {
+        status = ERR_WRITEISSUE;
+    }
+    munmap(disk->map, disk->mapSize);
+    disk->map = NULL;
+    disk->mapSize = 0;
+    return status;
+}
+
+/* opens regular UNIX File with the default backend */
 int openDisk(char *filename, int nBytes) {
+    return openDiskBackend(filename, nBytes, DISK_URING);
+}
+
+/* Write back the cached blocks of every disk still open when the program exits, so ones that are never closed keep their writes */
+static void flushOpenDisks(void) {
+    int i;
+    lockRegistry();
+    for (i = 0; i < diskCapacity; i++) {
+        if (disks[i] && disks[i]->fd >= 0) {
+            flushDisk(i);
+        }
+    }
+    unlockRegistry();
+}
+
+/* opens regular UNIX File, doing block I/O through the given backend. The caller holds the registry lock */
+static int openDiskLocked(char *filename, off_t nBytes, int backend) {
     FILE* file;
+    int fd;
     int diskNumber = diskCount;
 
+    if (backend != DISK_STDIO && backend != DISK_FD && backend != DISK_MMAP && backend != DISK_URING) {
+        return ERR_NOFILE;
+    }
+    if (!flushHooked) {
+        flushHooked = atexit(flushOpenDisks) == 0;
+    }
+
     /* Opens file + designates first nBytes as space for emulated disk */
     if (nBytes == 0) {    
         /* Opens existing file and its contents may not be overwritten */
-        file = fopen(filename, "r"); 
-        
-        if (file == NULL) {    /* confirming that the file actually was opened */
+        if (openHostFile(filename, O_RDONLY, backend, &fd, &file) < 0) {    /* confirming that the file actually was opened */
             return ERR_NOFILE; 
         }
 
         /* Check if entry exists and if it does not we may have to make a new one */
         Disk *chosen_disk = findDiskNodeFileName(filename);
 
-        /* If filename does not have an associated disk means that we have disks set up but are not in our linked list */
+        /* If filename does not have an associated disk means that we have disks set up but are not in our registry */
         if (chosen_disk == NULL) {
 
             /* getting size of file */
-            fseek(file, 0, SEEK_END);   /* seeking to end of file*/
-            int size = (int) ftell(file);
-            int diskSize = ((size / BLOCKSIZE) + 1) * BLOCKSIZE; 
-            fseek(file, 0, SEEK_SET);   /* seek to the front */
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                closeHostFile(fd, file);
+                return ERR_FILEISSUE;
+            }
+            off_t size = info.st_size;
+            off_t diskSize = ((size / BLOCKSIZE) + 1) * BLOCKSIZE;
 
-            if(addDiskNode(diskNumber, diskSize, filename, file)) {
+            if(addDiskNode(diskNumber, diskSize, filename, backend, fd, file)) {
+                closeHostFile(fd, file);
                 return ERR_ADDDISK;
             }
             
@@ -42,11 +977,13 @@ int openDisk(char *filename, int nBytes) {
             /* Find the disk entry in list with filename and set it to open */
             diskNumber = changeDiskStatusFileName(filename, OPEN);
             if (diskNumber < 0) {   /* if error */
+                closeHostFile(fd, file);
                 return ERR_FINDANDCHANGESTATUS;
             }
 
-            /* update the FILE pointer in our node */
-            if (updateDiskFile(file, diskNumber) < 0) {
+            /* update the file handles in our node */
+            if (updateDiskFile(diskNumber, backend, fd, file) < 0) {
+                closeHostFile(fd, file);
                 return ERR_CANNOTFNDDISK;
             }  
         } 
@@ -55,19 +992,13 @@ int openDisk(char *filename, int nBytes) {
         /* Issue with nBytes, Return error code */
         return ERR_NOFILE;
     } else {
-        /* Already file given by filename, the file's content may be overwritten */
-        if (access(filename, F_OK) == -1) {
-            /* file doesn't exist we open it */
-            file = fopen(filename, "w+");
-        } else { /* if file exists let us read and write it from it and don't truncate */
-            file = fopen(filename, "r+");
-        }
-
-        if (file == NULL) {    /* confirming that the file actually was opened */
+        /* Already file given by filename, the file's content may be overwritten.
+            Create it if it doesn't exist, otherwise read and write it without truncating */
+        if (openHostFile(filename, O_RDWR | O_CREAT, backend, &fd, &file) < 0) {    /* confirming that the file actually was opened */
             return ERR_NOFILE; 
         }
 
-        int amount = nBytes;
+        off_t amount = nBytes;
         if (nBytes % BLOCKSIZE != 0) {
             /* if nbytes not multiple of blocksize then set it to the closest multiple */
             amount = (nBytes / BLOCKSIZE + 1) * BLOCKSIZE;
@@ -80,34 +1011,133 @@ int openDisk(char *filename, int nBytes) {
             /* Find the disk entry in list with filename and set it to open */
             diskNumber = changeDiskStatusFileName(filename, OPEN);
             if (diskNumber < 0) {   /* if error */
+                closeHostFile(fd, file);
                 return ERR_FINDANDCHANGESTATUS;
             }
 
             chosen_disk->diskSize = amount;
 
-            /* update the FILE pointer in our node */
-            if (updateDiskFile(file, diskNumber) < 0) {
+            /* update the file handles in our node */
+            if (updateDiskFile(diskNumber, backend, fd, file) < 0) {
+                closeHostFile(fd, file);
                 return ERR_CANNOTFNDDISK;
             }  
         } else {
-             /* Add new disk to linked list */
-            if(addDiskNode(diskNumber, amount, filename, file)) {
+             /* Add new disk to the registry */
+            if(addDiskNode(diskNumber, amount, filename, backend, fd, file)) {
+                closeHostFile(fd, file);
                 return ERR_ADDDISK;
             }
             diskCount = diskCount + 1;    /* incrementing diskCount for next disk */
         }
     }
 
+    Disk *opened_disk = findDiskNodeNumber(diskNumber);
+    opened_disk->readOnly = (nBytes == 0);
+
+    if (backend == DISK_MMAP) {
+        /* Blocks are served straight from the mapping, so it doesn't need a cache */
+        unmapDisk(opened_disk);
+        if (mapDisk(opened_disk) < 0) {
+            closeDisk(diskNumber);
+            return ERR_FILEISSUE;
+        }
+    } else if (opened_disk->numShards == 0) {
+        /* Give the disk a block cache if it doesn't have one yet */
+        createCaches(opened_disk, defaultCacheSize);
+    }
+    if (backend == DISK_URING && opened_disk->ring == NULL && ringSetup(opened_disk) < 0) {
+        /* No io_uring here, so do the same I/O one run at a time */
+        opened_disk->backend = DISK_FD;
+    }
+
     /* Return disk number of disk we just were dealing with*/
     return diskNumber;
 }
 
-/* Add new disk node to linked list at the end. Return negative value if issue else 0 if success */
-int addDiskNode(int diskNum, int diskSize, char *filename, FILE* file) {
+/* opens regular UNIX File, doing block I/O through the given backend (DISK_STDIO, DISK_FD, DISK_MMAP or DISK_URING) */
+int openDiskBackend(char *filename, off_t nBytes, int backend) {
+    lockRegistry();
+    int diskNumber = openDiskLocked(filename, nBytes, backend);
+    unlockRegistry();
+    return diskNumber;
+}
+
+/* Hash a disk's filename for the filename index */
+static unsigned long hashFileName(char *filename) {
+    unsigned long hash = 5381;
+    while (*filename) {
+        hash = hash * 33 + (unsigned char) *filename++;
+    }
+    return hash;
+}
+
+/* Make room in the registry for disk number diskNum, keeping the filename index at least as big as the number of disks.
+    The caller holds the registry lock. Return 0 on success or ERR_ADDDISK on failure */
+static int growRegistry(int diskNum) {
+    int i;
+
+    if (diskNum >= diskCapacity) {
+        int capacity = diskCapacity ? diskCapacity : 8;
+        while (capacity <= diskNum) {
+            capacity *= 2;
+        }
+        if (numRetired == MAX_REGISTRY_GROWTH) {
+            return ERR_ADDDISK;
+        }
+        /* Copy into a new registry rather than realloc, lookups running right now may still be reading the old one */
+        Disk **grown = (Disk **) calloc(capacity, sizeof(Disk *));
+        if (grown == NULL) {
+            return ERR_ADDDISK;
+        }
+        for (i = 0; i < diskCapacity; i++) {
+            grown[i] = disks[i];
+        }
+        if (disks) {
+            retiredDisks[numRetired++] = disks;
+        }
+        /* publish the registry before the capacity, so a lookup that sees the new capacity sees the new registry */
+        __atomic_store_n(&disks, grown, __ATOMIC_RELEASE);
+        __atomic_store_n(&diskCapacity, capacity, __ATOMIC_RELEASE);
+    }
+
+    if (diskNum >= numNameBuckets) {
+        /* rehash every disk into a bigger filename index */
+        int numBuckets = numNameBuckets ? numNameBuckets : 8;
+        while (numBuckets <= diskNum) {
+            numBuckets *= 2;
+        }
+        Disk **buckets = (Disk **) calloc(numBuckets, sizeof(Disk *));
+        if (buckets == NULL) {
+            return ERR_ADDDISK;
+        }
+        for (i = 0; i < diskCapacity; i++) {
+            if (disks[i]) {
+                int bucket = hashFileName(disks[i]->fileName) % numBuckets;
+                disks[i]->nameNext = buckets[bucket];
+                buckets[bucket] = disks[i];
+            }
+        }
+        free(nameBuckets);
+        nameBuckets = buckets;
+        numNameBuckets = numBuckets;
+    }
+    return 0;
+}
+
+/* Add new disk node to the registry under its disk number and filename. Return negative value if issue else 0 if success */
+int addDiskNode(int diskNum, off_t diskSize, char *filename, int backend, int fd, FILE* file) {
+    lockRegistry();
+
+    if (diskNum < 0 || growRegistry(diskNum) < 0) {
+        unlockRegistry();
+        return ERR_ADDDISK;
+    }
 
     /* make disk Node for new disk */ 
     Disk *new_disk = (Disk *) malloc(sizeof(Disk));
     if (new_disk == NULL) {
+        unlockRegistry();
         return ERR_ADDDISK;
     }
 
@@ -119,65 +1149,83 @@ int addDiskNode(int diskNum, int diskSize, char *filename, FILE* file) {
     new_disk->fileName = (char *) malloc((strlen(filename) + 1) * sizeof(char));
     if (new_disk->fileName == NULL) {
         free(new_disk); 
+        unlockRegistry();
         return ERR_ADDDISK;
     }
     strcpy(new_disk->fileName, filename);   
+    new_disk->backend = backend;
+    new_disk->fd = fd;
+    new_disk->readOnly = 0;
+    new_disk->map = NULL;
+    new_disk->mapSize = 0;
+    new_disk->ring = NULL;
+    new_disk->writeBack = 0;
+    new_disk->dirtyCount = 0;
     new_disk->file = file;
-    new_disk->next = NULL;
+    new_disk->numShards = 0;
+    new_disk->crcs = NULL;
+    new_disk->crcBlocks = 0;
+    new_disk->crcDirty = NULL;
+    pthread_mutex_init(&new_disk->ioLock, NULL);
+    pthread_mutex_init(&new_disk->crcLock, NULL);
+    pthread_rwlock_init(&new_disk->flushLock, NULL);
 
-    /* if list empty add to front */
-    if (head == NULL) {
-        head = new_disk;
-        return 0;
-    }
-    
-    Disk *temp = head;
-
-    /* loop through linked list until get to end */
-    while(temp->next != NULL) {
-        temp = temp->next;
-    }
-    temp->next = new_disk;
+    /* index it by number and by filename */
+    __atomic_store_n(&disks[diskNum], new_disk, __ATOMIC_RELEASE);
+    int bucket = hashFileName(filename) % numNameBuckets;
+    new_disk->nameNext = nameBuckets[bucket];
+    nameBuckets[bucket] = new_disk;
 
+    unlockRegistry();
     return 0;
 }
 
-/* Find the DiskNode based on the filename in our Linked List*/
+/* Find the DiskNode based on the filename in our registry */
 Disk *findDiskNodeFileName(char* filename) {
-    Disk *temp = head;
-    while(temp) {
-        if (strcmp(temp->fileName, filename) == 0) {
-            return temp;
-        }
-        else {
-            temp = temp->next;
-        }
-    }  
-    return NULL;
+    Disk *temp = NULL;
+
+    lockRegistry();
+    if (nameBuckets) {
+        temp = nameBuckets[hashFileName(filename) % numNameBuckets];
+    }
+    while (temp && strcmp(temp->fileName, filename) != 0) {
+        temp = temp->nameNext;
+    }
+    unlockRegistry();
+    return temp;
 }
 
 
-/* Find the DiskNode based on diskNumber in our Linked List*/
+/* Find the DiskNode based on diskNumber in our registry. Doesn't take any lock, so block I/O can call it freely */
 Disk *findDiskNodeNumber(int diskNumber) {
-    Disk *temp = head;
-    while(temp) {
-        if (temp->diskNumber == diskNumber) {
-            return temp;
-        }
-        else {
-            temp = temp->next;
-        }
-    }   
-    return NULL;
+    int capacity = __atomic_load_n(&diskCapacity, __ATOMIC_ACQUIRE);
+    if (diskNumber < 0 || diskNumber >= capacity) {
+        return NULL;
+    }
+    Disk **registry = __atomic_load_n(&disks, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&registry[diskNumber], __ATOMIC_ACQUIRE);
 }
 
 
-int updateDiskFile(FILE* file, int diskNumber) {
+/* Give a disk a newly opened file. A disk that's still open closes its old one first, writing back what it had cached.
+    Return 0 on success or error on failure */
+int updateDiskFile(int diskNumber, int backend, int fd, FILE* file) {
     Disk *temp = findDiskNodeNumber(diskNumber);
     if(temp == NULL) {
         return ERR_FINDANDCHANGESTATUS;
     } 
     else {
+        if (temp->fd >= 0 && temp->fd != fd) {
+            lockRegistry();
+            int status = closeDiskLocked(diskNumber);
+            changeDiskStatusNumber(diskNumber, OPEN);
+            unlockRegistry();
+            if (status < 0) {
+                return status;
+            }
+        }
+        temp->backend = backend;
+        temp->fd = fd;
         temp->file = file;
         return 0;
     }   
@@ -209,33 +1257,56 @@ int changeDiskStatusFileName(char* filename, int status) {
     }
 }
 
-int closeDisk(int diskNumber) {
+/* close a disk. The caller holds the registry lock */
+static int closeDiskLocked(int diskNumber) {
     /* Find wanted disk */
-    Disk* wanted_disk = findDiskNodeNumber(diskNumber); /* Go into our linked list structure, find diskNode matching diskNum*/
+    Disk* wanted_disk = findDiskNodeNumber(diskNumber); /* Go into our registry, find diskNode matching diskNum*/
     if(wanted_disk == NULL) {
         return ERR_CANNOTFNDDISK;
     }
 
     /* close open file */
-    FILE *file = wanted_disk->file;
-    if (file == NULL) {
+    if (wanted_disk->fd < 0) {
         return ERR_FILEISSUE;
     }
+
+    /* write back dirty blocks and their checksums before the file goes away */
+    int status = flushCache(wanted_disk);
+    if (status >= 0) {
+        status = crcDrop(wanted_disk);
+    }
+    if (status < 0) {
+        return status;
+    }
+    destroyCaches(wanted_disk);
+    ringDestroy(wanted_disk);
+    __atomic_store_n(&wanted_disk->writeBack, 0, __ATOMIC_RELAXED);
+    status = unmapDisk(wanted_disk);
+
+    /* find file and close it */
+    closeHostFile(wanted_disk->fd, wanted_disk->file);
     wanted_disk->file = NULL;
-    fclose(file);   /* find file and close it */
+    wanted_disk->fd = -1;
 
-    changeDiskStatusNumber(diskNumber, CLOSED); /* close disk in linkedlist */
-    return 0;
+    changeDiskStatusNumber(diskNumber, CLOSED); /* close disk in registry */
+    return status;
+}
+
+/* Blocks still being read or written on the disk by other threads must be finished before it's closed */
+int closeDisk(int diskNumber) {
+    lockRegistry();
+    int status = closeDiskLocked(diskNumber);
+    unlockRegistry();
+    return status;
 }
 
 int readBlock(int disk, int bNum, void *block) {
-    Disk* wanted_disk = findDiskNodeNumber(disk); /* Go into our linked list structure, find diskNode matching diskNum*/
+    Disk* wanted_disk = findDiskNodeNumber(disk); /* Go into our registry, find diskNode matching diskNum*/
     if(wanted_disk == NULL) {
         return ERR_CANNOTFNDDISK;
     }
 
-    FILE *file = wanted_disk->file;
-    if (file == NULL) {
+    if (wanted_disk->fd < 0) {
         return ERR_FILEISSUE;
     }
 
@@ -244,59 +1315,473 @@ int readBlock(int disk, int bNum, void *block) {
         return ERR_RBLOCKISSUE;
     }
 
-    int startByte = bNum * BLOCKSIZE;
+    off_t startByte = (off_t) bNum * BLOCKSIZE;
 
     /*  Check that startByte + BLOCKSIZE is not greater than the size of the file */
-    if (startByte + BLOCKSIZE > wanted_disk->diskSize) {
+    if (bNum < 0 || startByte + BLOCKSIZE > wanted_disk->diskSize) {
         return ERR_RPASTLIMIT;
     }
 
-    /* Go into file and set head of reader at the startByte */
-    if (fseek(file, startByte, SEEK_SET) != 0) {
-        return ERR_FINDANDCHANGESTATUS;
+    BlockCache *cache = cacheShard(wanted_disk, bNum);
+    if (cache == NULL) {
+        return diskRead(wanted_disk, bNum, block);
     }
 
-    /* Read the BLOCKSIZE into block */
-    size_t bytesRead = fread(block, 1, BLOCKSIZE, file);
+    /* Serve the block from the cache if we have it */
+    int status = 0;
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = cacheLookup(cache, bNum);
+    if (entry) {
+        memcpy(block, entry->data, BLOCKSIZE);
+        cacheTouch(cache, entry);
+    } else {
+        /* Miss: read it from the file and keep a copy */
+        status = diskRead(wanted_disk, bNum, block);
+        if (status == 0) {
+            cacheInsert(wanted_disk, cache, bNum, block, &status);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
 
-    if (bytesRead != BLOCKSIZE) {
-        return ERR_READISSUE;
+    return status < 0 ? status : 0;
+}
+
+/* Write-back: only update the cached copy of a block and write it to the file when it's evicted or flushed.
+    Return 0 on success or error on failure */
+static int cacheWrite(Disk *disk, BlockCache *cache, int bNum, void *block) {
+    int status = 0;
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = cacheLookup(cache, bNum);
+    if (entry) {
+        memcpy(entry->data, block, BLOCKSIZE);
+        entry->version++;
+        cacheTouch(cache, entry);
+    } else {
+        entry = cacheInsert(disk, cache, bNum, block, &status);
+        if (entry == NULL && status == 0) {
+            /* nowhere to keep it, so write it through */
+            status = diskWrite(disk, bNum, block);
+        }
     }
+    if (entry && !entry->dirty) {
+        entry->dirty = 1;
+        __atomic_add_fetch(&disk->dirtyCount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache->lock);
 
-    return 0; 
+    return status < 0 ? status : 0;
 }
 
 int writeBlock(int disk, int bNum, void *block) {
-    Disk *wanted_disk = findDiskNodeNumber(disk); /* Go into our linked list structure, find diskNode matching diskNum*/
+    Disk *wanted_disk = findDiskNodeNumber(disk); /* Go into our registry, find diskNode matching diskNum*/
     if(wanted_disk == NULL) {
         return ERR_CANNOTFNDDISK;
     }
     
-    FILE *file = wanted_disk->file;
-    if (file == NULL) {
+    if (wanted_disk->fd < 0) {
         return ERR_FILEISSUE;
     }
+    if (wanted_disk->readOnly) {
+        return ERR_WRITEISSUE;
+    }
 
     /* Check that block is the size of a BLOCKSIZE */ 
     if ((block != NULL && sizeof(block) >= 256) || block == NULL) {
         return ERR_RBLOCKISSUE;
     }
 
-    int startByte = bNum * BLOCKSIZE;
+    off_t startByte = (off_t) bNum * BLOCKSIZE;
     /*  Check that startByte + BLOCKSIZE is not greater than the size of the file */
-    if (startByte + BLOCKSIZE > wanted_disk->diskSize) {
+    if (bNum < 0 || startByte + BLOCKSIZE > wanted_disk->diskSize) {
         return ERR_RPASTLIMIT;
     }
-    
-    // writes to file 
-    if (fseek(file, startByte, SEEK_SET) != 0) {    /* moves head of file to startByte */
-        return ERR_WSEEKISSUE;
+
+    BlockCache *cache = cacheShard(wanted_disk, bNum);
+    if (cache == NULL) {
+        return diskWrite(wanted_disk, bNum, block);
+    }
+    return cacheWrite(wanted_disk, cache, bNum, block);
+}
+
+/* Read n blocks, bNums[i] into bufs + i * BLOCKSIZE. Cached blocks are copied from the cache and the rest are
+    read with one call per run of adjacent block numbers. Return 0 on success or error on failure */
+int readBlocks(int disk, const int *bNums, int n, void *bufs) {
+    int i, status, count = 0;
+
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    if (wanted_disk->fd < 0) {
+        return ERR_FILEISSUE;
+    }
+    if (bufs == NULL || bNums == NULL || n < 0) {
+        return ERR_RBLOCKISSUE;
+    }
+    for (i = 0; i < n; i++) {
+        if (bNums[i] < 0 || (off_t) (bNums[i] + 1) * BLOCKSIZE > wanted_disk->diskSize) {
+            return ERR_RPASTLIMIT;
+        }
+    }
+
+    BlockRef *refs = (BlockRef *) malloc(n * sizeof(BlockRef) + 1);
+    if (refs == NULL) {
+        return ERR_NOMEMORY;
     }
 
-    size_t bytesWritten = fwrite(block, 1, BLOCKSIZE, file);
-    if (bytesWritten != BLOCKSIZE) {
+    /* Take what we can from the cache */
+    for (i = 0; i < n; i++) {
+        char *buf = (char *) bufs + (size_t) i * BLOCKSIZE;
+        BlockCache *cache = cacheShard(wanted_disk, bNums[i]);
+        CacheEntry *entry = NULL;
+        if (cache) {
+            pthread_mutex_lock(&cache->lock);
+            entry = cacheLookup(cache, bNums[i]);
+            if (entry) {
+                memcpy(buf, entry->data, BLOCKSIZE);
+                cacheTouch(cache, entry);
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+        if (entry == NULL) {
+            refs[count].bNum = bNums[i];
+            refs[count].buf = buf;
+            count++;
+        }
+    }
+
+    /* Read the misses without holding any shard and keep copies */
+    status = diskRuns(wanted_disk, refs, count, 0);
+    for (i = 0; status == 0 && i < count; i++) {
+        BlockCache *cache = cacheShard(wanted_disk, refs[i].bNum);
+        if (cache == NULL) {
+            break;
+        }
+        pthread_mutex_lock(&cache->lock);
+        if (cacheLookup(cache, refs[i].bNum) == NULL) {
+            cacheInsert(wanted_disk, cache, refs[i].bNum, refs[i].buf, &status);
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    free(refs);
+    return status < 0 ? status : 0;
+}
+
+/* Write n blocks, bufs + i * BLOCKSIZE to bNums[i], straight through to the file with one call per run of
+    adjacent block numbers, or into the cache like writeBlock if the disk is in write-back mode.
+    bNums shouldn't repeat a block. Return 0 on success or error on failure */
+int writeBlocks(int disk, const int *bNums, int n, void *bufs) {
+    int i, status;
+
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    if (wanted_disk->fd < 0) {
+        return ERR_FILEISSUE;
+    }
+    if (wanted_disk->readOnly) {
+        return ERR_WRITEISSUE;
+    }
+    if (bufs == NULL || bNums == NULL || n < 0) {
+        return ERR_RBLOCKISSUE;
+    }
+    for (i = 0; i < n; i++) {
+        if (bNums[i] < 0 || (off_t) (bNums[i] + 1) * BLOCKSIZE > wanted_disk->diskSize) {
+            return ERR_RPASTLIMIT;
+        }
+    }
+
+    /* In write-back mode, writes that fit in half the cache are only copied into it */
+    if (__atomic_load_n(&wanted_disk->writeBack, __ATOMIC_RELAXED) && wanted_disk->numShards &&
+        n * 2 <= wanted_disk->cache[0]->capacity * wanted_disk->numShards) {
+        for (i = 0, status = 0; i < n && status == 0; i++) {
+            status = cacheWrite(wanted_disk, cacheShard(wanted_disk, bNums[i]), bNums[i], (char *) bufs + (size_t) i * BLOCKSIZE);
+        }
+        return status;
+    }
+
+    BlockRef *refs = (BlockRef *) malloc(n * sizeof(BlockRef) + 1);
+    unsigned int *versions = (unsigned int *) malloc(n * sizeof(unsigned int) + 1);
+    char *cached = (char *) calloc(n + 1, 1);
+    if (refs == NULL || versions == NULL || cached == NULL) {
+        free(refs);
+        free(versions);
+        free(cached);
+        return ERR_NOMEMORY;
+    }
+
+    /* Keep cached copies up to date, remembering which version of each one we're writing. A block that isn't cached
+        has no version, and one cached while we write is newer than what we wrote */
+    pthread_rwlock_rdlock(&wanted_disk->flushLock);
+    for (i = 0; i < n; i++) {
+        refs[i].bNum = bNums[i];
+        refs[i].buf = (char *) bufs + (size_t) i * BLOCKSIZE;
+        BlockCache *cache = cacheShard(wanted_disk, bNums[i]);
+        if (cache) {
+            pthread_mutex_lock(&cache->lock);
+            CacheEntry *entry = cacheLookup(cache, bNums[i]);
+            if (entry) {
+                memcpy(entry->data, refs[i].buf, BLOCKSIZE);
+                versions[i] = ++entry->version;
+                cached[i] = 1;
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+    }
+
+    status = diskRuns(wanted_disk, refs, n, 1);
+    free(refs);
+    if (status < 0) {
+        pthread_rwlock_unlock(&wanted_disk->flushLock);
+        free(versions);
+        free(cached);
+        return status;
+    }
+
+    /* The file has the data now, so the cached copies are clean, unless a writeBlock changed one while we were writing.
+        Its data is newer than what the file got and has to stay dirty */
+    for (i = 0; i < n; i++) {
+        BlockCache *cache = cacheShard(wanted_disk, bNums[i]);
+        if (cache && cached[i]) {
+            pthread_mutex_lock(&cache->lock);
+            CacheEntry *entry = cacheLookup(cache, bNums[i]);
+            if (entry && entry->dirty && entry->version == versions[i]) {
+                entry->dirty = 0;
+                __atomic_sub_fetch(&wanted_disk->dirtyCount, 1, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+    }
+    pthread_rwlock_unlock(&wanted_disk->flushLock);
+    free(versions);
+    free(cached);
+    return 0;
+}
+
+/* Write all of a disk's dirty cached blocks, and the checksums that changed, to its file. Return 0 on success or error on failure */
+int flushDisk(int disk) {
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    if (wanted_disk->fd < 0) {
+        return ERR_FILEISSUE;
+    }
+
+    int status = flushCache(wanted_disk);
+    if (status >= 0) {
+        status = crcFlush(wanted_disk);
+    }
+    if (status < 0) {
+        return status;
+    }
+    if (wanted_disk->file) {
+        pthread_mutex_lock(&wanted_disk->ioLock);
+        status = fflush(wanted_disk->file) != 0 ? ERR_WRITEISSUE : 0;
+        pthread_mutex_unlock(&wanted_disk->ioLock);
+        if (status < 0) {
+            return status;
+        }
+    }
+    if (wanted_disk->map && !wanted_disk->readOnly && msync(wanted_disk->map, wanted_disk->mapSize, MS_SYNC) != 0) {
+        return ERR_WRITEISSUE;
+    }
+    return 0;
+}
+
+/* Write all of a disk's dirty cached blocks to its file and wait until the file has them on stable storage, so everything
+    written before the call reaches the disk before anything written after it. Return 0 on success or error on failure */
+int syncDisk(int disk) {
+    int status = flushDisk(disk);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Mapped disks were synced by flushDisk, apart from a checksum table */
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if ((!wanted_disk->map || wanted_disk->crcs) && !wanted_disk->readOnly && fdatasync(wanted_disk->fd) != 0) {
+        return ERR_WRITEISSUE;
+    }
+    return 0;
+}
+
+/* Resize a disk's block cache to nBlocks blocks, writing back anything dirty first. 0 turns the cache off.
+    Mapped disks never get a cache. No other thread can be doing I/O on the disk while it's resized.
+    Return 0 on success or error on failure */
+int setCacheSize(int disk, int nBlocks) {
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    if (wanted_disk->backend == DISK_MMAP) {
+        return 0;
+    }
+
+    int status = flushCache(wanted_disk);
+    if (status < 0) {
+        return status;
+    }
+    destroyCaches(wanted_disk);
+    return createCaches(wanted_disk, nBlocks);
+}
+
+/* Get how many blocks a disk's cache holds, 0 if it has none */
+int cacheSize(int disk) {
+    int i, total = 0;
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return 0;
+    }
+    for (i = 0; i < wanted_disk->numShards; i++) {
+        total += wanted_disk->cache[i]->capacity;
+    }
+    return total;
+}
+
+/* Turn a disk's write-back mode on (1) or off (0). In write-back mode writeBlocks only copies blocks into the cache,
+    like writeBlock, as long as they fit in half of it. Return 0 on success or error on failure */
+int setWriteBack(int disk, int on) {
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    __atomic_store_n(&wanted_disk->writeBack, on != 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Get how many of a disk's cached blocks haven't been written to its file yet */
+int dirtyBlocks(int disk) {
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&wanted_disk->dirtyCount, __ATOMIC_RELAXED);
+}
+
+/* Set the cache size, in blocks, given to disks opened from now on */
+void setDefaultCacheSize(int nBlocks) {
+    defaultCacheSize = nBlocks;
+}
+
+/* Get a pointer straight into the memory of block bNum of a disk opened with DISK_MMAP.
+    The pointer is valid until the disk is closed. Writes through it don't update the block's checksum. Return NULL if the disk isn't mapped or bNum is out of range */
+void *blockPointer(int disk, int bNum) {
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL || wanted_disk->map == NULL) {
+        return NULL;
+    }
+    if (bNum < 0 || (size_t) (bNum + 1) * BLOCKSIZE > wanted_disk->mapSize) {
+        return NULL;
+    }
+    return wanted_disk->map + (size_t) bNum * BLOCKSIZE;
+}
+
+/* Put a disk in a checksum mode (CRC_OFF, CRC_ON, CRC_REBUILD or CRC_ZEROED). Dirty cached blocks are written back
+    first. With checksums on, a block whose checksum doesn't match when it's read from the file fails with ERR_CHECKSUM.
+    No other thread can be doing I/O on the disk while the mode changes. Return 0 on success or error on failure */
+int setChecksums(int disk, int mode) {
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    if (wanted_disk->fd < 0) {
+        return ERR_FILEISSUE;
+    }
+    if (mode < CRC_OFF || mode > CRC_ZEROED) {
+        return ERR_OUTOFBOUNDS;
+    }
+    pthread_once(&crcOnce, initCrc);
+
+    /* The old table has to match what's in the file when it's written back */
+    int status = flushCache(wanted_disk);
+    if (status >= 0) {
+        status = crcDrop(wanted_disk);
+    }
+    if (status < 0 || mode == CRC_OFF) {
+        return status;
+    }
+
+    int nBlocks = (int) (wanted_disk->diskSize / BLOCKSIZE);
+    int numChunks = (nBlocks + CRC_CHUNK - 1) / CRC_CHUNK;
+    uint32_t *crcs = (uint32_t *) calloc((size_t) nBlocks + 1, sizeof(uint32_t));
+    unsigned char *dirty = (unsigned char *) malloc(numChunks + 1);
+    if (crcs == NULL || dirty == NULL) {
+        free(crcs);
+        free(dirty);
+        return ERR_NOMEMORY;
+    }
+
+    /* A rebuilt table has to be written. A zeroed disk's table reads as zeros already */
+    memset(dirty, mode == CRC_REBUILD, numChunks + 1);
+    status = mode == CRC_ZEROED ? 0 : crcLoad(wanted_disk, crcs, nBlocks, mode);
+    if (status < 0) {
+        free(crcs);
+        free(dirty);
+        return status;
+    }
+    wanted_disk->crcBlocks = nBlocks;
+    wanted_disk->crcDirty = dirty;
+    __atomic_store_n(&wanted_disk->crcs, crcs, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Make every block of a disk zeros without writing any of them. Cached blocks are dropped, and the file is cut back to
+    nothing and sized again with fallocate, so the blocks read as zeros and their space is allocated up front without
+    writing. A filesystem without fallocate gets a sparse file of the same size instead. A checksum table is cut away with the blocks and starts over as that of zeroed blocks.
+    No other thread can be doing I/O on the disk. Return 0 on success or error on failure */
+int eraseDisk(int disk) {
+    int i;
+
+    Disk *wanted_disk = findDiskNodeNumber(disk);
+    if (wanted_disk == NULL) {
+        return ERR_CANNOTFNDDISK;
+    }
+    if (wanted_disk->fd < 0) {
+        return ERR_FILEISSUE;
+    }
+    if (wanted_disk->readOnly) {
+        return ERR_WRITEISSUE;
+    }
+
+    /* Forget cached blocks instead of writing them back */
+    for (i = 0; i < wanted_disk->numShards; i++) {
+        BlockCache *cache = wanted_disk->cache[i];
+        pthread_mutex_lock(&cache->lock);
+        cache->count = 0;
+        memset(cache->buckets, 0, cache->numBuckets * sizeof(CacheEntry *));
+        cache->lruHead = NULL;
+        cache->lruTail = NULL;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    __atomic_store_n(&wanted_disk->dirtyCount, 0, __ATOMIC_RELAXED);
+    if (wanted_disk->file && fflush(wanted_disk->file) != 0) {  /* and anything stdio is holding */
         return ERR_WRITEISSUE;
     }
+    int status = unmapDisk(wanted_disk);
+    if (status < 0) {
+        return status;
+    }
 
+    /* Unwritten extents where the filesystem has them, otherwise a sparse file of the same size */
+    if (ftruncate(wanted_disk->fd, 0) != 0) {
+        return ERR_WRITEISSUE;
+    }
+    if (fallocate(wanted_disk->fd, 0, 0, wanted_disk->diskSize) != 0) {
+        int reserveError = errno;
+        if (ftruncate(wanted_disk->fd, wanted_disk->diskSize) != 0 ||
+            (reserveError != EOPNOTSUPP && reserveError != ENOSYS)) {
+            return ERR_WRITEISSUE;
+        }
+    }
+    if (wanted_disk->backend == DISK_MMAP && mapDisk(wanted_disk) < 0) {
+        return ERR_FILEISSUE;
+    }
+
+    if (wanted_disk->crcs) {
+        memset(wanted_disk->crcs, 0, (size_t) wanted_disk->crcBlocks * sizeof(uint32_t));
+        memset(wanted_disk->crcDirty, 0, (wanted_disk->crcBlocks + CRC_CHUNK - 1) / CRC_CHUNK);
+    }
     return 0;
 }
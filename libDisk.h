@@ -4,27 +4,144 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
 
 #define OPEN 1
 #define CLOSED 0
+#define DEFAULT_CACHE_BLOCKS 64
+#define MAX_RUN_BLOCKS 1024     /* most blocks moved by a single preadv/pwritev */
+#define CACHE_SHARDS 8          /* independently locked pieces of a disk's cache, picked by block number */
+#define MAX_REGISTRY_GROWTH 32  /* times the registry can double */
+#define URING_DEPTH 64          /* most runs the io_uring backend keeps in flight at once */
+#define CRC_CHUNK 1024          /* checksum table entries written back to the file together */
+#define CRC_LANE 80             /* bytes in each of the three lanes the SSE4.2 CRC32C interleaves */
+
+/* Block I/O backends a disk can be opened with */
+#define DISK_STDIO 0    /* shared FILE*, fseek + fread/fwrite */
+#define DISK_FD 1       /* raw descriptor, positional pread/pwrite */
+#define DISK_MMAP 2     /* whole file mapped, memcpy in and out, msync on close */
+#define DISK_URING 3    /* raw descriptor, runs of blocks submitted to an io_uring together. Falls back to DISK_FD
+                            when the kernel doesn't have io_uring */
+
+/* Checksum modes a disk can be put in with setChecksums. With checksums on, every block read from the disk's file is
+    checked against the CRC32C recorded when it was last written there, and the table of them is kept in the file right
+    after the blocks. Writes made through blockPointer go straight into the mapping and bypass the table, so a block
+    changed that way fails with ERR_CHECKSUM the next time it's read unless the table is rebuilt with CRC_REBUILD */
+#define CRC_OFF 0       /* no checksums */
+#define CRC_ON 1        /* load the table the file already has */
+#define CRC_REBUILD 2   /* work the table out from the blocks in the file, for when the stored one can't be trusted */
+#define CRC_ZEROED 3    /* start a table for a file whose blocks and table are all still zeros, as eraseDisk leaves it */
+
+/* A disk's io_uring: the submission and completion rings shared with the kernel. Guarded by the disk's ioLock */
+typedef struct DiskRing {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    void *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    void *cqes;
+    void *sqMap;
+    void *cqMap;
+    size_t sqMapSize;
+    size_t cqMapSize;
+    size_t sqesSize;
+} DiskRing;
+
+/* One cached block, linked into both the LRU list and its hash bucket */
+typedef struct CacheEntry {
+    int bNum;
+    int dirty;
+    unsigned int version;   /* bumped whenever data changes, so a write can tell if it still has the newest data */
+    int flushing;           /* flushCache is writing a copy of it, so it isn't evicted until that's done */
+    char data[BLOCKSIZE];
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+    struct CacheEntry *hashNext;
+} CacheEntry;
+
+/* Write-back LRU cache of one shard of a disk's blocks. lruHead is the most recently used entry.
+    Everything in it is guarded by lock */
+typedef struct BlockCache {
+    pthread_mutex_t lock;
+    int capacity;
+    int count;
+    int numBuckets;
+    CacheEntry *entries;
+    CacheEntry **buckets;
+    CacheEntry *lruHead;
+    CacheEntry *lruTail;
+} BlockCache;
+
+/* A block number and the buffer holding its data, used to sort bulk I/O into runs */
+typedef struct BlockRef {
+    int bNum;
+    char *buf;
+} BlockRef;
 
 typedef struct Disk {
     int diskNumber;
-    int diskSize;
+    off_t diskSize;
     int status;
     char *fileName;
-    FILE *file;
-    struct Disk *next;
+    int backend;
+    int fd;         /* -1 while the disk is closed */
+    int readOnly;
+    FILE *file;     /* only used by DISK_STDIO */
+    char *map;      /* only used by DISK_MMAP */
+    size_t mapSize;
+    DiskRing *ring; /* only used by DISK_URING */
+    pthread_mutex_t ioLock;     /* serializes seek + read/write on the shared FILE*, and batches on the io_uring */
+    int numShards;              /* 0 when the disk has no cache */
+    int writeBack;              /* writeBlocks goes into the cache too */
+    int dirtyCount;             /* cached blocks not written to the file yet */
+    BlockCache *cache[CACHE_SHARDS];    /* block bNum lives in cache[bNum % numShards] */
+    uint32_t *crcs;             /* checksum of each block in the file, NULL when checksums are off */
+    int crcBlocks;              /* blocks the table covers, it's kept in the file right after them */
+    unsigned char *crcDirty;    /* one flag per CRC_CHUNK entries changed since the table was last written */
+    pthread_mutex_t crcLock;    /* serializes writing the table to the file */
+    pthread_rwlock_t flushLock; /* held by flushCache while it writes copies of dirty blocks, and shared by writeBlocks
+                                    writing through, so an older copy never lands after a newer one */
+    struct Disk *nameNext;     /* next disk in the same filename bucket */
 } Disk;
 
 extern int closeDisk(int diskNumber);
 extern int changeDiskStatusFileName(char* filename, int status);
 extern int changeDiskStatusNumber(int diskNumber, int status);
-extern int updateDiskFile(FILE* file, int diskNumber);
+extern int updateDiskFile(int diskNumber, int backend, int fd, FILE* file);
 extern Disk *findDiskNodeNumber(int diskNumber);
 extern Disk *findDiskNodeFileName(char *filename);
-extern int addDiskNode(int diskNumber, int diskSize, char *filename, FILE* file);
+extern int addDiskNode(int diskNumber, off_t diskSize, char *filename, int backend, int fd, FILE* file);
 extern int openDisk(char *filename, int nBytes);
+extern int openDiskBackend(char *filename, off_t nBytes, int backend);
 extern int closeDisk(int disk);
 extern int readBlock(int disk, int bNum, void *block);
 extern int writeBlock(int disk, int bNum, void *block);
+extern int readBlocks(int disk, const int *bNums, int n, void *bufs);
+extern int writeBlocks(int disk, const int *bNums, int n, void *bufs);
+extern int flushDisk(int disk);
+extern int syncDisk(int disk);
+extern int setCacheSize(int disk, int nBlocks);
+extern int cacheSize(int disk);
+extern void setDefaultCacheSize(int nBlocks);
+extern int setWriteBack(int disk, int on);
+extern int dirtyBlocks(int disk);
+extern void *blockPointer(int disk, int bNum);
+extern int setChecksums(int disk, int mode);
+extern int eraseDisk(int disk);
+extern uint32_t crc32c(const void *data, size_t len);
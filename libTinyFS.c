@@ -1,4 +1,3 @@
-#include <math.h>
 
 #include "libTinyFS.h"
 #include "tinyFS.h"
@@ -7,57 +6,136 @@
 
 
 
-int curDisk = -1;
-FileDetails *resourceTable[NUM_BLOCKS - 1] = {NULL};
-int resourceTablePointer = 0;
-char *typeMap[4] = {"superblock", "inode", "file extent", "free block"};
+Mount *mounts[MAX_MOUNTS];      // mount slots by handle, made when first needed
+mountHandle defaultMount = -1;  // mount used by the functions that don't take a handle
+FileDetails **rtChunks[RT_CHUNKS];  // open files, indexed by file descriptor RT_CHUNK at a time. Chunks never move
+int rtUsed = 0;                 // descriptors handed out at least once
+int *freeSlots = NULL;          // stack of closed descriptors to hand out again
+int freeCount = 0;
+FileDetails *filePool = NULL;   // unused resource table entries, linked through inodeNext
+char *typeMap[6] = {"superblock", "inode", "file extent", "free block", "bitmap", "journal"};
 
+// Global locks. mountLock comes before any mount's locks, openLock after a mount's inode locks
+pthread_mutex_t mountLock = PTHREAD_MUTEX_INITIALIZER;  // handing out and giving back mount slots
+pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;   // handing out descriptors, the entry pool, and every open file hash
 
 
-void print_disk(int diskNum, int numBlocks, int dataSize) {
-    int i, j, status;
-    char block[BLOCKSIZE] = {0};
-    printf("\nDISK %d\n-------------------------\n", diskNum);
-    for (i = 0; i < numBlocks; i++) {
-        status = readBlock(diskNum, i, block);
-        if (status < 0) {
-            perror("print_disk");
-            exit(1);
-        }
-        printf("num: %2d   |   type: %11s   |   link: %2d\n", i, typeMap[(int) block[0] - 1], block[2]);
-        if (dataSize) {
-            for (j = 0; j < dataSize; j++) {
-                printf("%d ", block[j]);
-            }
-            printf("\n\n");
-        }
+
+// Given a mount handle, get its mount without taking any lock
+// Return the mount or NULL if the handle isn't mounted
+Mount *mount_get(mountHandle mh) {
+    if (mh < 0 || mh >= MAX_MOUNTS) return NULL;
+    Mount *m = __atomic_load_n(&mounts[mh], __ATOMIC_ACQUIRE);
+    return m && __atomic_load_n(&m->disk, __ATOMIC_ACQUIRE) >= 0 ? m : NULL;
+}
+
+// Find a free mount slot, making a new one the first time a slot is used. The caller holds mountLock
+// Return the handle on success or error code on failure
+mountHandle mount_alloc() {
+    // Init variables
+    int i, mh;
+
+    for (mh = 0; mh < MAX_MOUNTS && mounts[mh] && mounts[mh]->disk >= 0; mh++);
+    if (mh == MAX_MOUNTS) return ERR_MOUNTMULTIPLE;
+    if (mounts[mh]) return mh;
+
+    // Make the slot and its locks
+    Mount *m = calloc(1, sizeof(Mount));
+    if (!m) return ERR_NOMEMORY;
+    m->disk = -1;
+    pthread_rwlock_init(&m->fsLock, NULL);
+    pthread_rwlock_init(&m->nameLock, NULL);
+    for (i = 0; i < INODE_LOCKS; i++) pthread_rwlock_init(&m->inodeLocks[i], NULL);
+    pthread_mutex_init(&m->allocLock, NULL);
+    for (i = 0; i < TIMES_BUCKETS; i++) pthread_mutex_init(&m->timesLocks[i], NULL);
+    pthread_rwlock_init(&m->txLock, NULL);
+    pthread_mutex_init(&m->wbLock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->wbCond, &attr);
+    pthread_mutex_init(&m->dfLock, NULL);
+    pthread_mutex_init(&m->dfStatsLock, NULL);
+    pthread_cond_init(&m->dfCond, &attr);
+    pthread_condattr_destroy(&attr);
+    __atomic_store_n(&mounts[mh], m, __ATOMIC_RELEASE);
+
+    return mh;
+}
+
+// Take a mount's filesystem lock, shared for operations on files or exclusive for ones that change the whole disk
+void fs_enter(Mount *m, int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&m->fsLock);
+    } else {
+        pthread_rwlock_rdlock(&m->fsLock);
     }
-    printf("-------------------------\n\n");
+}
+
+void fs_leave(Mount *m) {
+    pthread_rwlock_unlock(&m->fsLock);
+}
+
+// Given an inode block number, take its lock for reading (writing = 0) or writing (writing = 1)
+void il_lock(Mount *m, int inode, int writing) {
+    pthread_rwlock_t *lock = &m->inodeLocks[(unsigned int) inode % INODE_LOCKS];
+    if (writing) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+}
+
+void il_unlock(Mount *m, int inode) {
+    pthread_rwlock_unlock(&m->inodeLocks[(unsigned int) inode % INODE_LOCKS]);
+}
+
+// Given a file descriptor, get its open file without taking any lock
+// Return the open file or NULL if the descriptor isn't open
+FileDetails *fd_get(int fd) {
+    if (fd < 0 || fd >= RT_CHUNK * RT_CHUNKS) return NULL;
+    FileDetails **chunk = __atomic_load_n(&rtChunks[fd / RT_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk ? __atomic_load_n(&chunk[fd % RT_CHUNK], __ATOMIC_ACQUIRE) : NULL;
+}
+
+// Given a file descriptor and its open file (NULL to empty it), store it in the resource table for fd_get to find
+void fd_put(int fd, FileDetails *file) {
+    __atomic_store_n(&rtChunks[fd / RT_CHUNK][fd % RT_CHUNK], file, __ATOMIC_RELEASE);
+}
+
+// Given a block number, check if it's marked as used in the block map
+// Return 1 if used or 0 if free
+int block_used(Mount *m, int bNum) {
+    return (m->blockMap[bNum / 64] >> (bNum % 64)) & 1;
+}
+
+// Given a block, check if every byte of it is zero, as blocks are until they're first written
+// Return 1 if it's all zeros or 0 if not
+int block_zero(char *block) {
+    return block[0] == 0 && !memcmp(block, block + 1, BLOCKSIZE - 1);
 }
 
 void print_rt() {
     int i;
+    FileDetails *file;
     printf("\nRESOURCE TABLE\n-------------------------\n");
-    for (i = 0; i < NUM_BLOCKS - 1; i++) {
-        if (resourceTable[i] != NULL) {
-            printf("file descriptor: %d, name: %s, block num: %d\n", resourceTable[i]->fd, resourceTable[i]->name, resourceTable[i]->inode);
+    for (i = 0; i < rtUsed; i++) {
+        if ((file = fd_get(i)) != NULL) {
+            printf("file descriptor: %d, name: %s, block num: %d\n", file->fd, file->name, file->inode);
         }
     }
     printf("-------------------------\n\n");
 }
 
-// Given a pointer to a block, a type, magic, link_addr, data, and data size, create the block
-void create_block(char *block, int type, int link_addr, char *data, int data_size) {
-    // Init type, magic, and link_addr
+// Given a pointer to a block, a type, data, and data size, create the block
+void create_block(char *block, int type, char *data, int data_size) {
+    // Init type and magic
     int i;
     for (i = 0; i < BLOCKSIZE; i++) {
         block[i] = 0;
     }
     block[0] = type;
     block[1] = MAGIC;
-    if (link_addr) {
-        block[2] = link_addr;
-    }
     // Write the data
     if (data && data_size > 0) {
         // Copy over data
@@ -65,84 +143,129 @@ void create_block(char *block, int type, int link_addr, char *data, int data_siz
     }
 }
 
-// Given a num and buffer, add that num of free blocks to the buffer and remove them from the free block chain
-// Return 0 on success or error code on failure
-int fbc_get(int num, int* buffer) {
+// Given a block number, find its copy in the mount's open transaction. The caller holds txLock
+// Return the copy's index or -1 if the block isn't in the transaction
+int tx_find(Mount *m, int bNum) {
+    if (!m->txCount) return -1;
+
+    unsigned int h = (unsigned int) bNum * 2654435761u & (m->txHashSize - 1);
+    while (m->txHash[h]) {
+        if (m->txNums[m->txHash[h] - 1] == bNum) return m->txHash[h] - 1;
+        h = (h + 1) & (m->txHashSize - 1);
+    }
+    return -1;
+}
+
+// Rebuild the hash of the mount's open transaction. The caller holds txLock for writing
+void tx_rehash(Mount *m) {
     // Init variables
-    int status, i;
-    char curBlock[BLOCKSIZE];
+    int i;
 
-    // For every free block
-    for (i = 0; i < num; i++) {
-        // Read block
-        if (i == 0) {
-            status = readBlock(curDisk, 0, curBlock);
-        } else {
-            status = readBlock(curDisk, curBlock[2], curBlock);
+    memset(m->txHash, 0, m->txHashSize * sizeof(int));
+    for (i = 0; i < m->txCount; i++) {
+        unsigned int h = (unsigned int) m->txNums[i] * 2654435761u & (m->txHashSize - 1);
+        while (m->txHash[h]) h = (h + 1) & (m->txHashSize - 1);
+        m->txHash[h] = i + 1;
+    }
+}
+
+// Given a block number, add a spot for it to the mount's open transaction, doubling the transaction when it's full
+// The caller holds txLock for writing
+// Return the spot's index on success or error code on failure
+int tx_add(Mount *m, int bNum) {
+    // Grow and rehash
+    if (m->txCount == m->txCapacity) {
+        int capacity = m->txCapacity ? m->txCapacity * 2 : JOURNAL_ENTRIES + 1;
+        int *nums = realloc(m->txNums, capacity * sizeof(int));
+        if (nums) m->txNums = nums;
+        char *data = realloc(m->txData, (size_t) capacity * BLOCKSIZE);
+        if (data) m->txData = data;
+        int hashSize = 4;
+        while (hashSize < capacity * 2) hashSize *= 2;
+        int *hash = calloc(hashSize, sizeof(int));
+        if (!nums || !data || !hash) {
+            free(hash);
+            return ERR_NOMEMORY;
         }
-        if (status < 0) return status;
+        free(m->txHash);
+        m->txHash = hash;
+        m->txHashSize = hashSize;
+        m->txCapacity = capacity;
+        tx_rehash(m);
+    }
 
-        // Check that there's free blocks available
-        if (curBlock[2] == 0) return ERR_FULLDISK;
+    unsigned int h = (unsigned int) bNum * 2654435761u & (m->txHashSize - 1);
+    while (m->txHash[h]) h = (h + 1) & (m->txHashSize - 1);
+    m->txHash[h] = m->txCount + 1;
+    m->txNums[m->txCount] = bNum;
+    if (bNum >= BITMAPSTART && bNum < BITMAPSTART + BITMAP_BLOCKS(m->numBlocks)) m->txBitmap++;
+    __atomic_store_n(&m->txCount, m->txCount + 1, __ATOMIC_RELAXED);
 
-        // Add free block
-        buffer[i] = curBlock[2];
-    }
+    return m->txCount - 1;
+}
 
-    // Get the next next free block
-    status = readBlock(curDisk, curBlock[2], curBlock);
-    if (status < 0) return status;
-    int nextFreeBlock = curBlock[2];
+// Given a block number and a buffer, read a metadata block (the superblock, a bitmap block, or an inode block),
+// getting it from the open transaction if it's changed since the last commit
+// Return 0 on success or error code on failure
+int md_read(Mount *m, int bNum, char *block) {
+    if (!m->journalBlocks) return readBlock(m->disk, bNum, block);
 
-    // Read superblock
-    status = readBlock(curDisk, 0, curBlock);
-    if (status < 0) return status;
-    // Update pointer
-    curBlock[2] = nextFreeBlock;
+    pthread_rwlock_rdlock(&m->txLock);
+    int idx = tx_find(m, bNum);
+    if (idx >= 0) memcpy(block, m->txData + (size_t) idx * BLOCKSIZE, BLOCKSIZE);
+    pthread_rwlock_unlock(&m->txLock);
+    if (idx >= 0) return 0;
 
-    // Write superblock
-    status = writeBlock(curDisk, 0, curBlock);
-    if (status < 0) return status;
+    return readBlock(m->disk, bNum, block);
+}
+
+// Given a block number and a metadata block, write it into the open transaction, which the next commit writes to the disk
+// Disks without a journal get it written in place
+// Return 0 on success or error code on failure
+int md_write(Mount *m, int bNum, char *block) {
+    if (!m->journalBlocks) return writeBlock(m->disk, bNum, block);
+
+    pthread_rwlock_wrlock(&m->txLock);
+    int idx = tx_find(m, bNum);
+    if (idx < 0) idx = tx_add(m, bNum);
+    if (idx >= 0) memcpy(m->txData + (size_t) idx * BLOCKSIZE, block, BLOCKSIZE);
+    pthread_rwlock_unlock(&m->txLock);
+    if (idx < 0) return idx;
 
     // Finished successfully
     return 0;
 }
 
-// Given a diskNum, num, and buffer, add that num of free blocks in the buffer to the free block chain
-// Return 0 on success or error code on failure
-int fbc_set(int diskNum, int num, int* buffer) {
+// Given a block map for a disk of nBlocks blocks and the index of one of its bitmap blocks, create that bitmap block
+void bm_block(uint64_t *map, int nBlocks, int i, char *block) {
     // Init variables
-    int i, lastBlockNum = 0;
-    char curBlock[BLOCKSIZE], freeBlock[BLOCKSIZE];
-
-    // No free blocks to add
-    if (!num) return 0;
+    int j;
+    char data[DATASIZE];
 
-    // Read superblock
-    int status = readBlock(diskNum, 0, curBlock);
-    if (status < 0) return status;
-
-    // Get to the last free block
-    while (curBlock[2]) {
-        lastBlockNum = curBlock[2];
-        status = readBlock(diskNum, curBlock[2], curBlock);
-        if (status < 0) return status;
+    // Lay the map out as little endian bytes
+    for (j = 0; j < DATASIZE; j++) {
+        int byte = i * DATASIZE + j;
+        data[j] = byte / 8 < MAP_WORDS(nBlocks) ? (map[byte / 8] >> (byte % 8 * 8)) & 0xFF : 0xFF;
     }
+    create_block(block, BITMAP, data, DATASIZE);
+}
+
+// Given a range of block map words that changed, write the bitmap blocks holding those words
+// Return 0 on success or error code on failure
+int bm_write(Mount *m, int firstWord, int lastWord) {
+    // Init variables
+    int i, status;
+    char block[BLOCKSIZE];
 
-    // Update the block's link
-    curBlock[2] = buffer[0];
-    status = writeBlock(diskNum, lastBlockNum, curBlock);
+    // Bitmap blocks covering the changed bytes
+    int firstBlock = firstWord * 8 / DATASIZE;
+    int lastBlock = (lastWord * 8 + 7) / DATASIZE;
+    if (lastBlock > BITMAP_BLOCKS(m->numBlocks) - 1) lastBlock = BITMAP_BLOCKS(m->numBlocks) - 1;
 
-    // For every free block
-    for (i = 0; i < num; i++) {
-        // Create free block
-        if (i < num - 1) {
-            create_block(freeBlock, FREEBLOCK, buffer[i + 1], NULL, 0);
-        } else {
-            create_block(freeBlock, FREEBLOCK, 0, NULL, 0);
-        }
-        // Write free block to disk
-        status = writeBlock(diskNum, buffer[i], freeBlock);
+    for (i = firstBlock; i <= lastBlock; i++) {
+        // Write the bitmap block
+        bm_block(m->blockMap, m->numBlocks, i, block);
+        status = md_write(m, BITMAPSTART + i, block);
         if (status < 0) return status;
     }
 
@@ -150,310 +273,2101 @@ int fbc_set(int diskNum, int num, int* buffer) {
     return 0;
 }
 
-// Update the resource table pointer to the next empty spot
+// Given a diskNum and its number of blocks, read its bitmap blocks into the mount's block map and make its geometry the mount's
 // Return 0 on success or error code on failure
-int update_rt_pointer() {
+int bm_load(Mount *m, int diskNum, int nBlocks) {
     // Init variables
-    int i;
+    int i, status;
+    int numBitmap = BITMAP_BLOCKS(nBlocks);
+    int words = MAP_WORDS(nBlocks);
+
+    // Make room for the map, and the map of blocks freed since the last commit if the disk has a journal
+    uint64_t *map = calloc(words, sizeof(uint64_t));
+    uint64_t *pins = m->journalBlocks ? calloc(words, sizeof(uint64_t)) : NULL;
+    int *blockNums = malloc(numBitmap * sizeof(int));
+    char *blocks = malloc((size_t) numBitmap * BLOCKSIZE);
+    if (!map || (m->journalBlocks && !pins) || !blockNums || !blocks) {
+        free(map);
+        free(pins);
+        free(blockNums);
+        free(blocks);
+        return ERR_NOMEMORY;
+    }
 
-    // Find the next empty resource table spot
-    for (i = 0; i < NUM_BLOCKS - 1; i++) {
-        // Found an empty spot
-        if (!resourceTable[i]) {
-            resourceTablePointer = i;
-            return 0;
+    // Read every bitmap block
+    for (i = 0; i < numBitmap; i++) {
+        blockNums[i] = BITMAPSTART + i;
+    }
+    status = readBlocks(diskNum, blockNums, numBitmap, blocks);
+    free(blockNums);
+
+    // Rebuild the map from the little endian bytes
+    for (i = 0; status >= 0 && i < words * 8; i++) {
+        int blockIdx = i / DATASIZE;
+        if (blockIdx >= numBitmap) {
+            // Past the end of the bitmap, never hand these out
+            map[i / 8] |= (uint64_t) 0xFF << (i % 8 * 8);
+            continue;
         }
+        char *block = blocks + (size_t) blockIdx * BLOCKSIZE;
+        if (block[0] != BITMAP) status = ERR_BLOCKFORMAT;
+        map[i / 8] |= (uint64_t) (unsigned char) block[4 + i % DATASIZE] << (i % 8 * 8);
+    }
+    free(blocks);
+    if (status < 0) {
+        free(map);
+        free(pins);
+        return status;
     }
+    free(m->blockMap);
+    m->blockMap = map;
+    free(m->pinMap);
+    m->pinMap = pins;
+    m->numBlocks = nBlocks;
+    m->mapWords = words;
 
-    // Couldn't find empty spot
-    return ERR_FULLDISK;
+    // Start allocating from the front of the disk
+    m->allocHint = 0;
+
+    // Finished successfully
+    return 0;
 }
 
-// Given a file descriptor, get the index of that file in the resource table
-// Return index on success or error code on failure
-int get_file_idx(fileDescriptor fd) {
+// Given a block map word, get which of its blocks can't be handed out: the used ones, the ones a defrag copy is
+// writing to, and unless pinned is 0, the ones freed since the last commit
+uint64_t bm_taken(Mount *m, int w, int pinned) {
+    return m->blockMap[w] | (m->dfMap ? m->dfMap[w] : 0) | (pinned && m->pinMap ? m->pinMap[w] : 0);
+}
+
+// Given a num and buffer, mark that num of free blocks as used and add them to the buffer
+// Blocks freed since the last commit are never used, committing is up to the caller (see tx_retry)
+// Return 0 on success or error code on failure
+int alloc_blocks(Mount *m, int num, int *buffer) {
     // Init variables
-    int i;
+    int i, w, found = 0;
 
-    // Set i to the index of the open file in our resource table
-    for (i = 0; i < NUM_BLOCKS - 1; i++) {
-        if (resourceTable[i]) {
-            if (resourceTable[i]->fd == fd) return i;
+    pthread_mutex_lock(&m->allocLock);
+
+    // Find free blocks a map word at a time, starting where the last allocation left off
+    for (i = 0; i < m->mapWords && found < num; i++) {
+        w = (m->allocHint + i) % m->mapWords;
+        uint64_t freeBits = ~bm_taken(m, w, 1);
+        while (freeBits && found < num) {
+            buffer[found++] = w * 64 + __builtin_ctzll(freeBits);
+            freeBits &= freeBits - 1;
         }
     }
 
-    // Couldn't find the file
-    return ERR_NOFILE;
-}
-
-// Given a resource table index, get the size of the file
-// Return the size on success or error code on failure
-int get_fileSize(int idx) {
-    // Read inode block
-    char block[BLOCKSIZE];
-    int status = readBlock(curDisk, resourceTable[idx]->inode, block);
-    if (status < 0) return status;
+    // Check that there's enough free blocks available
+    if (found < num || !num) {
+        pthread_mutex_unlock(&m->allocLock);
+        return found < num ? ERR_FULLDISK : 0;
+    }
 
-    // Get the size of the data
-    char charSize[SIZELENGTH] = {0};
-    memcpy(charSize, block + 13, SIZELENGTH);
+    // Mark the blocks as used
+    int firstWord = m->mapWords, lastWord = 0;
+    for (i = 0; i < num; i++) {
+        w = buffer[i] / 64;
+        m->blockMap[w] |= (uint64_t) 1 << (buffer[i] % 64);
+        if (w < firstWord) firstWord = w;
+        if (w > lastWord) lastWord = w;
+    }
+    m->allocHint = buffer[num - 1] / 64;
 
-    // Return the size on success
-    return atol(charSize);
+    // Write the changed part of the bitmap
+    int status = bm_write(m, firstWord, lastWord);
+    pthread_mutex_unlock(&m->allocLock);
+    return status;
 }
 
-// Given a diskNum, init the disk with a superblock and free blocks
-// Return 0 on success or error code on failure
-int initDisk(int diskNum) {
+// Given a block map, a start block, and length, mark that run of blocks as used (used = 1) or free (used = 0) in the map
+// Return the index of the last map word touched
+int bm_setRun(uint64_t *map, int start, int length, int used) {
     // Init variables
-    int i;
-    int freeBlocks[NUM_BLOCKS - 1];
-    for (i = 1; i < NUM_BLOCKS; i++) {
-        freeBlocks[i - 1] = i;
+    int w = start / 64, bit = start % 64;
+
+    // Flip a word's worth of bits at a time
+    while (length > 0) {
+        int count = 64 - bit < length ? 64 - bit : length;
+        uint64_t mask = (count == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << count) - 1)) << bit;
+        if (used) {
+            map[w] |= mask;
+        } else {
+            map[w] &= ~mask;
+        }
+        length -= count;
+        bit = 0;
+        w++;
     }
 
-    // Create the superblock
-    char superblock[BLOCKSIZE];
-    create_block(superblock, SUPERBLOCK, 0, NULL, 0);
-    // Write superblock to the disk
-    int status = writeBlock(diskNum, 0, superblock);
-    if (status < 0) return status;
-    
-    // Write free blocks
-    status = fbc_set(diskNum, NUM_BLOCKS - 1, freeBlocks);
-    if (status < 0) return status;
-
-    // Finished successfully
-    return 0;
+    return w - 1;
 }
 
-// Given a block, time type, and time, set that time in the block
-// Return 0 on success or error code on failure
-int setTime(char *block, char *type, time_t curTime) {
+// Given a block number, find the next run of free blocks at or after it, leaving out blocks freed since the last commit if pinned is set
+// Return the length of the run and set *start, or 0 if there are no more free blocks
+int bm_nextRun(Mount *m, int from, int *start, int pinned) {
     // Init variables
-    char timeStr[TIMELENGTH] = {0};
-    sprintf(timeStr, "%ld", curTime);
-
-    // Update the time depending on the type
-    if (!strcmp(type, "creation")) {
-        memcpy(block + 19, timeStr, TIMELENGTH);
-    } else if (!strcmp(type, "modification")) {
-        memcpy(block + 30, timeStr, TIMELENGTH);
-    } else if (!strcmp(type, "access")) {
-        memcpy(block + 41, timeStr, TIMELENGTH);
-    } else {
-        return ERR_TIMING;
+    int w = from / 64;
+    uint64_t bits;
+
+    // Find the first free block, skipping full words
+    if (from >= m->numBlocks) return 0;
+    bits = ~bm_taken(m, w, pinned) & (~(uint64_t) 0 << (from % 64));
+    while (!bits) {
+        if (++w >= m->mapWords) return 0;
+        bits = ~bm_taken(m, w, pinned);
+    }
+    *start = w * 64 + __builtin_ctzll(bits);
+    if (*start >= m->numBlocks) return 0;
+
+    // Find the next used block, skipping empty words
+    bits = bm_taken(m, w, pinned) & (~(uint64_t) 0 << (*start % 64));
+    while (!bits) {
+        if (++w >= m->mapWords) return m->numBlocks - *start;
+        bits = bm_taken(m, w, pinned);
     }
+    int end = w * 64 + __builtin_ctzll(bits);
+    if (end > m->numBlocks) end = m->numBlocks;
 
-    // Finished successfully
-    return 0;
+    return end - *start;
 }
 
-// Given a block, time type, and time, get that time in the block
-// Return the time on success or error code on failure
-int getTime(char *block, char *type) {
+// Given a num, the most runs to use, and a block map, find that many free blocks in as few contiguous runs as possible,
+// mark them in the map, and store the runs in extents. The caller holds allocLock
+// Each round takes the smallest free run that fits what's left, or the largest free run if none does
+// Return the number of runs on success or error code on failure, leaving the map as it was
+int take_runs(Mount *m, int num, int maxRuns, uint64_t *map, Extent *extents) {
     // Init variables
-    char timeStr[TIMELENGTH] = {0};
+    int i, numExtents = 0, remaining = num;
+
+    while (remaining > 0 && numExtents < maxRuns) {
+        // Look at every free run
+        int start, length, from = 0;
+        int bestStart = -1, bestLength = 0, bigStart = -1, bigLength = 0;
+        while ((length = bm_nextRun(m, from, &start, 1)) > 0) {
+            if (length >= remaining && (bestStart < 0 || length < bestLength)) {
+                bestStart = start;
+                bestLength = length;
+            }
+            if (length > bigLength) {
+                bigStart = start;
+                bigLength = length;
+            }
+            from = start + length;
+        }
 
-    // Update the time depending on the type
-    if (!strcmp(type, "creation")) {
-        memcpy(timeStr, block + 19, TIMELENGTH);
-    } else if (!strcmp(type, "modification")) {
-        memcpy(timeStr, block + 30, TIMELENGTH);
-    } else if (!strcmp(type, "access")) {
-        memcpy(timeStr, block + 41, TIMELENGTH);
-    } else {
-        return ERR_TIMING;
+        // Out of free blocks
+        if (bigStart < 0) break;
+
+        // Take the run
+        if (bestStart >= 0) {
+            extents[numExtents].start = bestStart;
+            extents[numExtents].length = remaining;
+        } else {
+            extents[numExtents].start = bigStart;
+            extents[numExtents].length = bigLength;
+        }
+        bm_setRun(map, extents[numExtents].start, extents[numExtents].length, 1);
+        remaining -= extents[numExtents].length;
+        numExtents++;
     }
 
-    // Finished successfully
-    return atol(timeStr);
+    // Couldn't get enough blocks in that many runs, give back what we took
+    if (remaining > 0) {
+        for (i = 0; i < numExtents; i++) {
+            bm_setRun(map, extents[i].start, extents[i].length, 0);
+        }
+        return ERR_FULLDISK;
+    }
+
+    return numExtents;
 }
 
-// Given a filename and number of bytes, create a filesystem of size nBytes on the filename
-// Return the disk number on success or error code on failure
-int tfs_mkfs(char *filename, int nBytes) {
+// Given a num, allocate that many blocks in as few contiguous runs as possible and store the runs in extents
+// Blocks freed since the last commit are never used, committing is up to the caller (see tx_retry)
+// Return the number of extents on success or error code on failure
+int alloc_extents(Mount *m, int num, Extent *extents) {
     // Init variables
-    int i;
+    int i, status = 0;
 
-    // PRINT TESTING
-    // printf("tfs_mkfs\n");
-
-    // Make a disk on the file
-    int diskNum = openDisk(filename, nBytes);
-    if (diskNum < 0) return diskNum;
+    pthread_mutex_lock(&m->allocLock);
+    int numExtents = take_runs(m, num, MAXEXTENTS, m->blockMap, extents);
 
-    // Initialize the disk to all zeros
-    char emptyBlock[BLOCKSIZE] = {0};
-    for (i = 0; i < nBytes / BLOCKSIZE; i++) {
-        writeBlock(diskNum, i, emptyBlock);
+    // Write the changed parts of the bitmap
+    for (i = 0; i < numExtents && status >= 0; i++) {
+        int lastWord = (extents[i].start + extents[i].length - 1) / 64;
+        status = bm_write(m, extents[i].start / 64, lastWord);
     }
-
-    // Init the disk blocks
-    int status = initDisk(diskNum);
+    pthread_mutex_unlock(&m->allocLock);
     if (status < 0) return status;
 
-    // Set to the current disk
-    curDisk = diskNum;
+    return numExtents;
+}
+
+// Given a list of extents, mark all of their blocks as free
+// With a journal they stay pinned until the next commit, so a crash can't leave the old file pointing at reused blocks
+// Return 0 on success or error code on failure
+int free_extents(Mount *m, Extent *extents, int numExtents) {
+    // Init variables
+    int i, status = 0;
 
-    // Close the disk
-    status = closeDisk(diskNum);
+    pthread_mutex_lock(&m->allocLock);
+    for (i = 0; i < numExtents && status >= 0; i++) {
+        int lastWord = bm_setRun(m->blockMap, extents[i].start, extents[i].length, 0);
+        if (m->pinMap) bm_setRun(m->pinMap, extents[i].start, extents[i].length, 1);
+        status = bm_write(m, extents[i].start / 64, lastWord);
+    }
+    pthread_mutex_unlock(&m->allocLock);
     if (status < 0) return status;
 
-    // Return the disk number on success
-    return diskNum;
+    // Finished successfully
+    return 0;
 }
 
-// Given a disk name that contains a file system, mount it
-// Return disk number on success or error code on failure
-int tfs_mount(char *diskname) {
+// Given an inode block, read its extent list into extents
+// Return the number of extents
+int get_extents(char *inodeBlock, Extent *extents) {
     // Init variables
-    int i, status;
+    int i, numExtents = (unsigned char) inodeBlock[EXTENTCOUNT];
+    if (numExtents > MAXEXTENTS) numExtents = MAXEXTENTS;
 
-    // PRINT TESTING
-    // printf("tfs_mount\n");
+    for (i = 0; i < numExtents; i++) {
+        unsigned char *entry = (unsigned char *) inodeBlock + EXTENTSTART + i * EXTENTLENGTH;
+        extents[i].start = entry[0] | entry[1] << 8 | entry[2] << 16 | (uint32_t) entry[3] << 24;
+        extents[i].length = entry[4] | entry[5] << 8 | entry[6] << 16 | (uint32_t) entry[7] << 24;
+    }
 
-    // Open disk
-    int diskNum = openDisk(diskname, DEFAULT_DISK_SIZE);
-    if (diskNum < 0) return diskNum;
+    return numExtents;
+}
 
-    // Ensure that file system is formatted correctly
-    char block[BLOCKSIZE];
-    // Iterate through each block
-    for (i = 0; i < NUM_BLOCKS; i++) {
-        // Read block
-        status = readBlock(diskNum, i, block);
+// Given an inode block and a list of extents, store the extents in the inode block
+void set_extents(char *inodeBlock, Extent *extents, int numExtents) {
+    // Init variables
+    int i, j;
+
+    memset(inodeBlock + EXTENTCOUNT, 0, BLOCKSIZE - EXTENTCOUNT);
+    inodeBlock[EXTENTCOUNT] = numExtents;
+    for (i = 0; i < numExtents; i++) {
+        unsigned char *entry = (unsigned char *) inodeBlock + EXTENTSTART + i * EXTENTLENGTH;
+        for (j = 0; j < 4; j++) {
+            entry[j] = extents[i].start >> (j * 8);
+            entry[4 + j] = extents[i].length >> (j * 8);
+        }
+    }
+}
+
+// Given an inode block, print its extents as first-last block ranges
+void print_extents(char *inodeBlock) {
+    int i;
+    Extent extents[MAXEXTENTS];
+    int numExtents = get_extents(inodeBlock, extents);
+    for (i = 0; i < numExtents; i++) {
+        if (extents[i].length == 1) {
+            printf(" %d", extents[i].start);
+        } else {
+            printf(" %d-%d", extents[i].start, extents[i].start + extents[i].length - 1);
+        }
+    }
+}
+
+void print_disk(Mount *m, int dataSize) {
+    int i, j, status;
+    char block[BLOCKSIZE] = {0};
+    printf("\nDISK %d\n-------------------------\n", m->disk);
+    for (i = 0; i < m->numBlocks; i++) {
+        status = md_read(m, i, block);
         if (status < 0) {
-            closeDisk(diskNum);
-            return status;
+            perror("print_disk");
+            exit(1);
         }
-        // Check the superblock
-        if (i == 0) {
-            if (block[0] != SUPERBLOCK || block[2] > NUM_BLOCKS - 1 || block[2] < 0 || block[3] != 0x00) {
-                closeDisk(diskNum);
-                return ERR_BLOCKFORMAT;
-            }
+        // Freed blocks keep their old contents, the bitmap says what they are. Journal blocks may never have been written
+        if (!block_used(m, i) || block[1] != MAGIC) {
+            printf("num: %2d   |   type: %11s   |\n", i, typeMap[FREEBLOCK - 1]);
+            continue;
         }
-        // Check the magic number
-        if (block[1] != MAGIC) {
-            closeDisk(diskNum);
-            return ERR_BLOCKFORMAT;
+        printf("num: %2d   |   type: %11s   |", i, typeMap[(int) block[0] - 1]);
+        // Show where an inode's data lives
+        if (block[0] == INODE) {
+            print_extents(block);
+        }
+        printf("\n");
+        if (dataSize) {
+            for (j = 0; j < dataSize; j++) {
+                printf("%d ", block[j]);
+            }
+            printf("\n\n");
         }
     }
+    printf("-------------------------\n\n");
+}
+
+// Given a filename, hash it for the name index
+unsigned int ni_hash(char *name) {
+    unsigned int hash = 5381;
+    while (*name) {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+    return hash;
+}
 
-    // Mount disk
-    curDisk = diskNum;
+// Empty the name index
+void ni_clear(Mount *m) {
+    // Init variables
+    int i;
 
-    return curDisk;
+    for (i = 0; i < m->indexBuckets; i++) {
+        while (m->nameIndex[i]) {
+            NameEntry *next = m->nameIndex[i]->next;
+            free(m->nameIndex[i]);
+            m->nameIndex[i] = next;
+        }
+    }
+    free(m->nameIndex);
+    m->nameIndex = NULL;
+    m->indexBuckets = 0;
+    m->indexCount = 0;
 }
 
-// Unmount the current disk
-// Return 0 on success or error code on failure
-int tfs_unmount(void) {
-    // PRINT TESTING
-    // printf("tfs_unmount\n");
+// Given a filename, find its inode block in the name index
+// Return the inode block number on success or error code on failure
+int ni_find(Mount *m, char *name) {
+    // Nothing indexed yet
+    if (!m->indexBuckets) return ERR_NOFILE;
 
-    // Close disk
-    int status = closeDisk(curDisk);
-    if (status < 0) return status;
+    NameEntry *entry = m->nameIndex[ni_hash(name) % m->indexBuckets];
+    while (entry) {
+        if (!strcmp(entry->name, name)) return entry->inode;
+        entry = entry->next;
+    }
 
-    // Unmount disk
-    curDisk = -1;
-    return 0;
+    // Couldn't find the file
+    return ERR_NOFILE;
 }
 
-// Create or open a file for "rw"
-// Return a file descriptor on success or error code on failure
-fileDescriptor tfs_openFile(char *name) {
+// Given a filename and its inode block number, add it to the name index, growing the index when it gets full
+// Return 0 on success or error code on failure
+int ni_add(Mount *m, char *name, int inode) {
     // Init variables
-    int i, status, startBlock = 0, fileExists = 0;
-    int buffer[1];
-
-    // PRINT TESTING
-    // printf("tfs_openFile\n");
-
-    // Check that the length of the filename is within bounds
-    if (strlen(name) > 8) return ERR_FILENAMELIMIT;
+    int i;
 
-    // Check if file already exists
-    char curBlock[BLOCKSIZE];
-    for (i = 1; i < NUM_BLOCKS - 1; i++) {
-        // Read block
-        status = readBlock(curDisk, i, curBlock);
-        if (status < 0) return status;
-        // Check if block is an inode block and if it's the file we're looking for
-        if (curBlock[0] == INODE) {
-            // Copy file name
-            char fname[NAMELENGTH];
-            memcpy(fname, curBlock + 4, NAMELENGTH);
-
-            // If file exists
-            if (strcmp(fname, name) == 0) {
-                fileExists = 1;
-                startBlock = i;
-                break;
+    // Keep about one file per bucket
+    if (m->indexCount >= m->indexBuckets) {
+        int buckets = m->indexBuckets ? m->indexBuckets * 2 : NAME_BUCKETS;
+        NameEntry **index = calloc(buckets, sizeof(NameEntry *));
+        if (!index) return ERR_NOMEMORY;
+
+        // Move every entry to its new bucket
+        for (i = 0; i < m->indexBuckets; i++) {
+            while (m->nameIndex[i]) {
+                NameEntry *entry = m->nameIndex[i];
+                m->nameIndex[i] = entry->next;
+                entry->next = index[ni_hash(entry->name) % buckets];
+                index[ni_hash(entry->name) % buckets] = entry;
             }
         }
+        free(m->nameIndex);
+        m->nameIndex = index;
+        m->indexBuckets = buckets;
     }
 
-    // Check that there are inodes available
-    if (resourceTablePointer >= NUM_BLOCKS) return ERR_FULLDISK;
+    // Create the entry
+    NameEntry *entry = malloc(sizeof(NameEntry));
+    if (!entry) return ERR_NOMEMORY;
+    memset(entry->name, 0, NAMELENGTH);
+    strncpy(entry->name, name, NAMELENGTH - 1);
+    entry->inode = inode;
 
-    // Create resource table entry
-    FileDetails *file = malloc(sizeof(FileDetails));
-    file->inode = startBlock;
-    file->name = name;
-    file->fd = resourceTablePointer;
-    file->filePointer = 0;
-    file->rw = 1;
+    // Add it to its bucket
+    unsigned int bucket = ni_hash(entry->name) % m->indexBuckets;
+    entry->next = m->nameIndex[bucket];
+    m->nameIndex[bucket] = entry;
+    m->indexCount++;
 
-    // If the file exists, update the access time
-    if (fileExists) {
-        // Update the access time
-        time_t curTime;
-        if (time(&curTime) == -1) {
-            free(file);
-            return ERR_TIMING;
-        }
-        status = setTime(curBlock, "access", curTime);
-        if (status < 0) {
-            free(file);
-            return status;
-        }
+    // Finished successfully
+    return 0;
+}
 
-        // Write the updated inode block
-        status = writeBlock(curDisk, startBlock, curBlock);
-        if (status < 0) {
-            free(file);
-            return status;
+// Given a filename, remove it from the name index
+// Return 0 on success or error code on failure
+int ni_remove(Mount *m, char *name) {
+    // Nothing indexed yet
+    if (!m->indexBuckets) return ERR_NOFILE;
+
+    NameEntry **link = &m->nameIndex[ni_hash(name) % m->indexBuckets];
+    while (*link) {
+        if (!strcmp((*link)->name, name)) {
+            NameEntry *entry = *link;
+            *link = entry->next;
+            free(entry);
+            m->indexCount--;
+            return 0;
         }
+        link = &(*link)->next;
     }
 
-    // Add file to resource table
-    resourceTable[resourceTablePointer] = file;
+    // Couldn't find the file
+    return ERR_NOFILE;
+}
 
-    // Update resource table pointer
-    status = update_rt_pointer();
-    if (status < 0) {
-        free(file);
-        return status;
+// Take a descriptor for a new open file, reusing the most recently closed one and adding a chunk to the resource table when it's full
+// The caller holds openLock
+// Return the descriptor on success or error code on failure
+int fd_alloc() {
+    // Reuse a closed descriptor
+    if (freeCount) return freeSlots[--freeCount];
+
+    // Add a chunk, the ones already there stay put so lookups never see the table move
+    if (rtUsed % RT_CHUNK == 0) {
+        if (rtUsed == RT_CHUNK * RT_CHUNKS) return ERR_NOMEMORY;
+        int *slots = realloc(freeSlots, (rtUsed + RT_CHUNK) * sizeof(int));
+        if (!slots) return ERR_NOMEMORY;
+        freeSlots = slots;
+        FileDetails **chunk = calloc(RT_CHUNK, sizeof(FileDetails *));
+        if (!chunk) return ERR_NOMEMORY;
+        __atomic_store_n(&rtChunks[rtUsed / RT_CHUNK], chunk, __ATOMIC_RELEASE);
     }
 
-    // If the file doesn't exist, we need to create an inode block for it in the disk
-    if (!fileExists) {
-        // Update the file's time info
-        time_t curTime;
-        if (time(&curTime) == -1) {
-            free(file);
-            return ERR_TIMING;
-        }
+    return rtUsed++;
+}
 
-        // Get next free block
-        status = fbc_get(1, buffer);
-        if (status < 0) {
-            free(file);
-            return status;
+// Given a descriptor, empty its resource table spot and put it back on the free stack
+// The caller holds openLock
+void fd_release(int fd) {
+    fd_put(fd, NULL);
+    freeSlots[freeCount++] = fd;
+}
+
+// Get an unused resource table entry from the pool, carving a new slab of entries when the pool is empty
+// The caller holds openLock
+// Return the entry or NULL if out of memory
+FileDetails *fd_new() {
+    // Init variables
+    int i;
+
+    if (!filePool) {
+        FileDetails *slab = malloc(FILE_SLAB * sizeof(FileDetails));
+        if (!slab) return NULL;
+        for (i = 0; i < FILE_SLAB; i++) {
+            slab[i].inodeNext = i + 1 < FILE_SLAB ? &slab[i + 1] : NULL;
+            slab[i].raData = NULL;
+        }
+        filePool = slab;
+    }
+
+    FileDetails *file = filePool;
+    filePool = file->inodeNext;
+    return file;
+}
+
+// Given a resource table entry, give it back to the pool
+void fd_free(FileDetails *file) {
+    file->inodeNext = filePool;
+    filePool = file;
+}
+
+// Given an inode block number, get the first open file in its bucket of the mount's open file hash (the chain can hold other inodes)
+// The caller holds openLock
+FileDetails *of_bucket(Mount *m, int inode) {
+    return m->openBuckets ? m->openFiles[(unsigned int) inode & (m->openBuckets - 1)] : NULL;
+}
+
+// Given an open file, add it to its mount's open file hash, doubling the buckets when the chains get long
+// Return 0 on success or error code on failure
+int of_add(FileDetails *file) {
+    // Init variables
+    int i;
+    Mount *m = file->mount;
+
+    // Grow and rehash
+    if (m->openCount >= m->openBuckets * 2) {
+        int size = m->openBuckets ? m->openBuckets * 2 : OPEN_BUCKETS;
+        FileDetails **buckets = calloc(size, sizeof(FileDetails *));
+        if (!buckets) return ERR_NOMEMORY;
+        for (i = 0; i < m->openBuckets; i++) {
+            FileDetails *cur = m->openFiles[i], *next;
+            for (; cur; cur = next) {
+                next = cur->inodeNext;
+                cur->inodeNext = buckets[(unsigned int) cur->inode & (size - 1)];
+                buckets[(unsigned int) cur->inode & (size - 1)] = cur;
+            }
+        }
+        free(m->openFiles);
+        m->openFiles = buckets;
+        m->openBuckets = size;
+    }
+
+    FileDetails **bucket = &m->openFiles[(unsigned int) file->inode & (m->openBuckets - 1)];
+    file->inodeNext = *bucket;
+    *bucket = file;
+    m->openCount++;
+
+    // Finished successfully
+    return 0;
+}
+
+// Given an open file, take it out of the open file hash
+void of_remove(FileDetails *file) {
+    Mount *m = file->mount;
+    FileDetails **link = &m->openFiles[(unsigned int) file->inode & (m->openBuckets - 1)];
+    while (*link && *link != file) link = &(*link)->inodeNext;
+    if (*link) {
+        *link = file->inodeNext;
+        m->openCount--;
+    }
+}
+
+// Given a file descriptor, get the index of that file in the resource table
+// Return index on success or error code on failure
+int get_file_idx(fileDescriptor fd) {
+    // A file's descriptor is its index in the resource table
+    if (fd_get(fd)) return fd;
+
+    // Couldn't find the file
+    return ERR_NOFILE;
+}
+
+// Given a pointer into a block, get the little endian 64-bit integer stored there
+uint64_t get_u64(char *field) {
+    // Init variables
+    int i;
+    uint64_t value = 0;
+
+    for (i = 7; i >= 0; i--) {
+        value = value << 8 | (unsigned char) field[i];
+    }
+    return value;
+}
+
+// Given a pointer into a block and a value, store the value there as a little endian 64-bit integer
+void put_u64(char *field, uint64_t value) {
+    // Init variables
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        field[i] = value >> (i * 8);
+    }
+}
+
+// Given a pointer into a block, get the little endian 32-bit integer stored there
+uint32_t get_u32(char *field) {
+    unsigned char *bytes = (unsigned char *) field;
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+// Given a pointer into a block and a value, store the value there as a little endian 32-bit integer
+void put_u32(char *field, uint32_t value) {
+    // Init variables
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        field[i] = value >> (i * 8);
+    }
+}
+
+// Given a running FNV-1a hash and some bytes, add the bytes to the hash
+uint32_t fnv_add(uint32_t hash, char *bytes, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned char) bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Given a journal header with the blocks of block numbers after it and the index of a copy, get where its block number is kept
+char *jn_num(char *header, int i) {
+    if (i < JOURNAL_ENTRIES) return header + JOURNAL_NUMS + i * 4;
+    i -= JOURNAL_ENTRIES;
+    return header + (size_t) (1 + i / JOURNAL_MORE) * BLOCKSIZE + 4 + i % JOURNAL_MORE * 4;
+}
+
+// Given the number of blocks in a journal, get the most blocks one commit can hold
+int jn_copies(int journalBlocks) {
+    int count = journalBlocks - 1;
+    while (count > 0 && 1 + JOURNAL_NUMBLOCKS(count) + count > journalBlocks) count--;
+    return count;
+}
+
+// Given a journal header with the blocks of block numbers after it and the count block copies, get the checksum of the commit
+uint32_t jn_checksum(char *header, char *copies, int count) {
+    // Init variables
+    int i;
+
+    uint32_t hash = fnv_add(2166136261u, header + 4, 12);
+    for (i = 0; i < count; i++) {
+        hash = fnv_add(hash, jn_num(header, i), 4);
+    }
+    return fnv_add(hash, copies, (size_t) count * BLOCKSIZE);
+}
+
+// Given a diskNum, the start of its journal, and a sequence number, mark the journal as having nothing to replay
+// Return 0 on success or error code on failure
+int jn_clear(int diskNum, int journalStart, uint64_t seq) {
+    char header[BLOCKSIZE];
+    create_block(header, JOURNAL, NULL, 0);
+    put_u64(header + 4, seq);
+    put_u32(header + 16, jn_checksum(header, NULL, 0));
+    return writeBlock(diskNum, journalStart, header);
+}
+
+// Given a diskNum and where its journal is, write the blocks of the last commit to their places again if it's whole
+// Set *seq to the sequence number of the last commit
+// Return 0 on success or error code on failure
+int jn_replay(int diskNum, int journalStart, int journalBlocks, int nBlocks, uint64_t *seq) {
+    // Init variables
+    int i, status;
+    char header[BLOCKSIZE];
+
+    status = readBlock(diskNum, journalStart, header);
+    if (status < 0) return status;
+    *seq = get_u64(header + 4);
+    int count = get_u32(header + 12);
+
+    // Nothing to replay, or the commit never made it to the disk whole
+    if (header[0] != JOURNAL || header[1] != MAGIC || count <= 0 || count > jn_copies(journalBlocks)) return 0;
+    int numBlocks = 1 + JOURNAL_NUMBLOCKS(count) + count;
+    int *nums = malloc(numBlocks * sizeof(int));
+    char *run = malloc((size_t) numBlocks * BLOCKSIZE);
+    if (!nums || !run) {
+        free(nums);
+        free(run);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; i < numBlocks; i++) {
+        nums[i] = journalStart + i;
+    }
+    char *copies = run + (size_t) (numBlocks - count) * BLOCKSIZE;
+    status = readBlocks(diskNum, nums, numBlocks, run);
+    if (status < 0 || get_u32(run + 16) != jn_checksum(run, copies, count)) {
+        free(nums);
+        free(run);
+        return status;
+    }
+
+    // Put each block's type back and write it to its place
+    for (i = 0; i < count && status >= 0; i++) {
+        char *copy = copies + (size_t) i * BLOCKSIZE;
+        nums[i] = get_u32(jn_num(run, i));
+        if (nums[i] <= 0 || nums[i] >= nBlocks || (nums[i] >= journalStart && nums[i] < journalStart + journalBlocks)) status = ERR_BLOCKFORMAT;
+        copy[0] = copy[2];
+        copy[2] = 0;
+    }
+    if (status >= 0) status = writeBlocks(diskNum, nums, count, copies);
+    free(nums);
+    free(run);
+
+    // The blocks have to be in place before the commit is forgotten
+    if (status >= 0) status = syncDisk(diskNum);
+    if (status >= 0) status = jn_clear(diskNum, journalStart, *seq);
+    if (status >= 0) status = syncDisk(diskNum);
+    return status;
+}
+
+// Given a superblock, get the checksum of everything before its checksum field
+uint32_t sb_checksum(char *superblock) {
+    return fnv_add(2166136261u, superblock, SB_CHECKSUM);
+}
+
+// Given a superblock, whether the disk is clean, and the size and checksum of its name table, store them, the format
+// version, and the superblock's checksum in it
+void sb_seal(char *superblock, int clean, uint32_t names, uint32_t nameSum) {
+    put_u32(superblock + SB_VERSION, FS_VERSION);
+    superblock[SB_CLEAN] = clean;
+    put_u32(superblock + SB_NAMES, names);
+    put_u32(superblock + SB_NAMESUM, nameSum);
+    put_u32(superblock + SB_CHECKSUM, sb_checksum(superblock));
+}
+
+// Given a diskNum, its superblock, whether the disk is clean, and the size and checksum of its name table, write the
+// superblock with them and wait for it to be on the disk
+// Return 0 on success or error code on failure
+int sb_write(int diskNum, char *superblock, int clean, uint32_t names, uint32_t nameSum) {
+    sb_seal(superblock, clean, names, nameSum);
+    int status = writeBlock(diskNum, 0, superblock);
+    if (status >= 0) status = syncDisk(diskNum);
+    return status;
+}
+
+// Given a mount whose journal has nothing to replay, write its name index to the journal blocks after the header
+// Set *names to the number of files written, or NO_NAMETABLE if they don't fit, and *nameSum to the blocks' checksum
+// Return 0 on success or error code on failure
+int nt_write(Mount *m, uint32_t *names, uint32_t *nameSum) {
+    // Init variables
+    int i, status, count = 0;
+    NameEntry *entry;
+    int numBlocks = (m->indexCount + NAMETABLE_ENTRIES - 1) / NAMETABLE_ENTRIES;
+
+    *names = NO_NAMETABLE;
+    *nameSum = 0;
+    if (!m->journalBlocks || numBlocks > m->journalBlocks - 1) return 0;
+
+    // Fill the blocks an entry at a time
+    int *nums = malloc((numBlocks ? numBlocks : 1) * sizeof(int));
+    char *blocks = malloc((size_t) (numBlocks ? numBlocks : 1) * BLOCKSIZE);
+    if (!nums || !blocks) {
+        free(nums);
+        free(blocks);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; i < numBlocks; i++) {
+        create_block(blocks + (size_t) i * BLOCKSIZE, JOURNAL, NULL, 0);
+        nums[i] = m->journalStart + 1 + i;
+    }
+    for (i = 0; i < m->indexBuckets; i++) {
+        for (entry = m->nameIndex[i]; entry; entry = entry->next, count++) {
+            char *field = blocks + (size_t) (count / NAMETABLE_ENTRIES) * BLOCKSIZE + 4 + count % NAMETABLE_ENTRIES * 12;
+            put_u32(field, entry->inode);
+            memcpy(field + 4, entry->name, strnlen(entry->name, NAMELENGTH - 1));
+        }
+    }
+
+    // Write them
+    status = numBlocks ? writeBlocks(m->disk, nums, numBlocks, blocks) : 0;
+    *nameSum = fnv_add(2166136261u, blocks, (size_t) numBlocks * BLOCKSIZE);
+    free(nums);
+    free(blocks);
+    if (status < 0) return status;
+    *names = count;
+
+    // Finished successfully
+    return 0;
+}
+
+// Given a mount with its bitmap loaded, its diskNum, and the size and checksum of the name table, build the name index
+// from the table
+// Return 0 on success, ERR_BLOCKFORMAT if there's no table or it doesn't match its checksum, or error code on failure
+int nt_load(Mount *m, int diskNum, uint32_t names, uint32_t nameSum) {
+    // Init variables
+    int i, status;
+    char name[NAMELENGTH] = {0};
+
+    // Check that there's a table that fits in the journal
+    if (names == NO_NAMETABLE || !m->journalBlocks) return ERR_BLOCKFORMAT;
+    int numBlocks = (names + NAMETABLE_ENTRIES - 1) / NAMETABLE_ENTRIES;
+    if (numBlocks > m->journalBlocks - 1) return ERR_BLOCKFORMAT;
+
+    // Read it and check its checksum
+    int *nums = malloc((numBlocks ? numBlocks : 1) * sizeof(int));
+    char *blocks = malloc((size_t) (numBlocks ? numBlocks : 1) * BLOCKSIZE);
+    if (!nums || !blocks) {
+        free(nums);
+        free(blocks);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; i < numBlocks; i++) {
+        nums[i] = m->journalStart + 1 + i;
+    }
+    status = numBlocks ? readBlocks(diskNum, nums, numBlocks, blocks) : 0;
+    free(nums);
+    if (status >= 0 && fnv_add(2166136261u, blocks, (size_t) numBlocks * BLOCKSIZE) != nameSum) status = ERR_BLOCKFORMAT;
+
+    // Index every file, each has to be an inode block that's in use
+    for (i = 0; i < (int) names && status >= 0; i++) {
+        char *field = blocks + (size_t) (i / NAMETABLE_ENTRIES) * BLOCKSIZE + 4 + i % NAMETABLE_ENTRIES * 12;
+        int inode = get_u32(field);
+        memcpy(name, field + 4, NAMELENGTH - 1);
+        if (inode <= 0 || inode >= m->numBlocks || !block_used(m, inode)) status = ERR_BLOCKFORMAT;
+        if (status >= 0) status = ni_add(m, name, inode);
+    }
+    free(blocks);
+
+    return status;
+}
+
+// Write the mount's open transaction to the journal and then to its places on the disk, batching every operation since the
+// last commit into one sequential write. Operations reserve room before they start (see tx_reserve), so it always fits
+// The caller holds the filesystem lock exclusively
+// Return 0 on success or error code on failure
+int tx_commit(Mount *m) {
+    // Init variables
+    int i, status;
+    int count = m->txCount;
+    if (!m->journalBlocks || !count) return 0;
+    if (count > m->journalCopies) return ERR_JOURNALLIMIT;
+    int numBlocks = 1 + JOURNAL_NUMBLOCKS(count) + count;
+
+    // File data the new metadata points at goes to the disk first
+    status = syncDisk(m->disk);
+    int *nums = malloc(numBlocks * sizeof(int));
+    char *run = malloc((size_t) numBlocks * BLOCKSIZE);
+    if (status >= 0 && (!nums || !run)) status = ERR_NOMEMORY;
+
+    // The header, the rest of the block numbers, and a copy of every block, in one run at the front of the journal
+    if (status >= 0) {
+        char *copies = run + (size_t) (numBlocks - count) * BLOCKSIZE;
+        for (i = 0; i < numBlocks - count; i++) {
+            create_block(run + (size_t) i * BLOCKSIZE, JOURNAL, NULL, 0);
+        }
+        put_u64(run + 4, m->journalSeq + 1);
+        put_u32(run + 12, count);
+        for (i = 0; i < count; i++) {
+            char *copy = copies + (size_t) i * BLOCKSIZE;
+            memcpy(copy, m->txData + (size_t) i * BLOCKSIZE, BLOCKSIZE);
+            copy[2] = copy[0];
+            copy[0] = JOURNAL;
+            put_u32(jn_num(run, i), m->txNums[i]);
+        }
+        for (i = 0; i < numBlocks; i++) {
+            nums[i] = m->journalStart + i;
+        }
+        put_u32(run + 16, jn_checksum(run, copies, count));
+        status = writeBlocks(m->disk, nums, numBlocks, run);
+    }
+    if (status >= 0) status = syncDisk(m->disk);
+    if (status >= 0) m->journalSeq++;
+
+    // Then the blocks in their places. The next commit syncs them before it reuses the journal
+    if (status >= 0) status = writeBlocks(m->disk, m->txNums, count, m->txData);
+    free(nums);
+    free(run);
+    if (status < 0) return status;
+
+    // Start a new transaction, and let the blocks freed in this one be used again
+    pthread_rwlock_wrlock(&m->txLock);
+    __atomic_store_n(&m->txCount, 0, __ATOMIC_RELAXED);
+    m->txBitmap = 0;
+    memset(m->txHash, 0, m->txHashSize * sizeof(int));
+    pthread_rwlock_unlock(&m->txLock);
+    memset(m->pinMap, 0, m->mapWords * sizeof(uint64_t));
+
+    // Finished successfully
+    return 0;
+}
+
+// Get how many more operations the mount's open transaction has room for. Every bitmap block is counted as already in
+// it, since an operation can change any of them, and each operation changes at most one other block
+// The caller holds txLock or the filesystem lock exclusively
+int tx_room(Mount *m) {
+    return m->journalCopies - BITMAP_BLOCKS(m->numBlocks) - (m->txCount - m->txBitmap) - m->txReserved;
+}
+
+// Get the time on the monotonic clock in nanoseconds
+int64_t wb_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Get how many bytes of the mount's changes are waiting to be written back: the open transaction and the disk's dirty blocks
+int wb_dirtyBytes(Mount *m) {
+    return (__atomic_load_n(&m->txCount, __ATOMIC_RELAXED) + dirtyBlocks(m->disk)) * BLOCKSIZE;
+}
+
+// Wake the mount's writeback thread
+void wb_kick(Mount *m) {
+    pthread_mutex_lock(&m->wbLock);
+    pthread_cond_signal(&m->wbCond);
+    pthread_mutex_unlock(&m->wbLock);
+}
+
+// Get whether the mount's open transaction has used half the room the journal has for operations, so the writeback
+// thread commits it before an operation has to wait for tx_reserve to
+int wb_journalFull(Mount *m) {
+    if (!m->journalBlocks) return 0;
+
+    pthread_rwlock_rdlock(&m->txLock);
+    int full = tx_room(m) <= (m->journalCopies - BITMAP_BLOCKS(m->numBlocks)) / 2;
+    pthread_rwlock_unlock(&m->txLock);
+
+    return full;
+}
+
+// Note that the mount has changes to write back, waking the writeback thread if enough bytes are waiting or the
+// journal is filling up. The caller holds the filesystem lock
+void wb_note(Mount *m) {
+    if (!__atomic_load_n(&m->wbRunning, __ATOMIC_ACQUIRE)) return;
+
+    int64_t clean = 0;
+    if (!__atomic_load_n(&m->wbDirtySince, __ATOMIC_RELAXED)) {
+        __atomic_compare_exchange_n(&m->wbDirtySince, &clean, wb_now(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (wb_dirtyBytes(m) >= __atomic_load_n(&m->wbBytes, __ATOMIC_RELAXED) || wb_journalFull(m)) wb_kick(m);
+}
+
+// Make sure the mount's open transaction has room for the operation about to start, on top of what the operations
+// already running may add, committing it first if it hasn't, so a commit never holds part of an operation
+// The caller holds the filesystem lock shared and nothing else, it's let go of and taken again while committing.
+// Give the room back with tx_release
+// Return 0 on success or error code on failure
+int tx_reserve(Mount *m) {
+    // Init variables
+    int status = 0, taken = 0;
+    if (!m->journalBlocks) return 0;
+
+    while (!taken && status >= 0) {
+        pthread_rwlock_wrlock(&m->txLock);
+        taken = tx_room(m) >= 1;
+        if (taken) m->txReserved++;
+        pthread_rwlock_unlock(&m->txLock);
+        if (taken) break;
+
+        // Commit once the operations running are done, unless someone else already did
+        fs_leave(m);
+        fs_enter(m, 1);
+        status = m->disk < 0 ? ERR_CANNOTFNDDISK : tx_room(m) < 1 ? tx_commit(m) : 0;
+        fs_leave(m);
+        fs_enter(m, 0);
+        if (m->disk < 0) status = ERR_CANNOTFNDDISK;
+    }
+
+    return status;
+}
+
+// Give back the room tx_reserve took for an operation that's done. The caller holds the filesystem lock shared
+void tx_release(Mount *m) {
+    if (!m->journalBlocks) return;
+
+    pthread_rwlock_wrlock(&m->txLock);
+    m->txReserved--;
+    pthread_rwlock_unlock(&m->txLock);
+}
+
+// Given a mount and the status of an operation that's done, commit the open transaction if the operation ran out of
+// free blocks while blocks freed since the last commit were waiting on it, so it can be run again with them. An
+// operation that fails frees what it took, pinning it too, so it's only worth running again once
+// The caller holds none of the mount's locks
+// Return 1 if the operation should be run again, otherwise 0
+int tx_retry(Mount *m, int status) {
+    // Init variables
+    int w, pinned = 0;
+    if (status != ERR_FULLDISK || !m) return 0;
+
+    fs_enter(m, 1);
+    for (w = 0; m->disk >= 0 && m->pinMap && w < m->mapWords && !pinned; w++) {
+        pinned = m->pinMap[w] != 0;
+    }
+    if (pinned) pinned = tx_commit(m) >= 0;
+    fs_leave(m);
+
+    return pinned;
+}
+
+// Given a file descriptor, take its mount's filesystem lock, the name lock for writing if names is set, and its inode's
+// lock for reading (writing = 0) or writing (writing = 1). The filesystem lock keeps the disk from being unmounted under it
+// Return the mount and set *inode to the inode block number on success, or set *inode to an error code and return NULL
+Mount *file_enter(fileDescriptor FD, int writing, int names, int *inode) {
+    FileDetails *file = fd_get(FD);
+    Mount *m = file ? __atomic_load_n(&file->mount, __ATOMIC_ACQUIRE) : NULL;
+    if (!m) {
+        *inode = ERR_NOFILE;
+        return NULL;
+    }
+
+    fs_enter(m, 0);
+    int status = writing ? tx_reserve(m) : 0;
+    if (names) pthread_rwlock_wrlock(&m->nameLock);
+
+    // The disk may have been unmounted, and the descriptor closed with it, while we waited
+    if (status < 0 || fd_get(FD) != file || __atomic_load_n(&file->mount, __ATOMIC_ACQUIRE) != m || m->disk < 0) {
+        if (names) pthread_rwlock_unlock(&m->nameLock);
+        if (writing && status >= 0) tx_release(m);
+        fs_leave(m);
+        *inode = status < 0 ? status : ERR_NOFILE;
+        return NULL;
+    }
+
+    *inode = file->inode;
+    il_lock(m, *inode, writing);
+    return m;
+}
+
+// Given what file_enter returned and what it was passed, let go of its locks and the room it reserved
+void file_leave(Mount *m, int inode, int writing, int names) {
+    if (!m) return;
+    il_unlock(m, inode);
+    if (names) pthread_rwlock_unlock(&m->nameLock);
+    if (writing) tx_release(m);
+    wb_note(m);
+    fs_leave(m);
+}
+
+// Given an inode block, get the size of the file
+uint64_t get_inodeSize(char *inodeBlock) {
+    return get_u64(inodeBlock + INODE_SIZE);
+}
+
+// Given an inode block and a size, store the size in the inode block
+void set_inodeSize(char *inodeBlock, uint64_t size) {
+    put_u64(inodeBlock + INODE_SIZE, size);
+}
+
+// Given an inode block and which time (INODE_CTIME, INODE_MTIME, or INODE_ATIME), get that time
+struct timespec get_inodeTime(char *inodeBlock, int field) {
+    int64_t ns = (int64_t) get_u64(inodeBlock + field);
+    struct timespec t;
+    t.tv_sec = ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    if (t.tv_nsec < 0) {
+        t.tv_sec--;
+        t.tv_nsec += 1000000000;
+    }
+    return t;
+}
+
+// Given an inode block, which time (INODE_CTIME, INODE_MTIME, or INODE_ATIME), and a time, store that time
+void set_inodeTime(char *inodeBlock, int field, struct timespec t) {
+    put_u64(inodeBlock + field, (uint64_t) ((int64_t) t.tv_sec * 1000000000 + t.tv_nsec));
+}
+
+// Given a version 0 inode block, convert its ASCII size and times to the current layout in place
+void upgrade_inode(char *inodeBlock) {
+    // Init variables
+    int i;
+    char field[TIMELENGTH + 1];
+    int oldTimes[3] = {OLD_CTIME, OLD_MTIME, OLD_ATIME};
+    int newTimes[3] = {INODE_CTIME, INODE_MTIME, INODE_ATIME};
+    struct timespec times[3];
+
+    // Parse the old fields
+    memset(field, 0, sizeof(field));
+    memcpy(field, inodeBlock + OLD_SIZE, SIZELENGTH);
+    uint64_t size = strtoull(field, NULL, 10);
+    for (i = 0; i < 3; i++) {
+        memset(field, 0, sizeof(field));
+        memcpy(field, inodeBlock + oldTimes[i], TIMELENGTH);
+        times[i].tv_sec = atol(field);
+        times[i].tv_nsec = 0;
+    }
+
+    // Write them back in binary
+    memset(inodeBlock + OLD_SIZE, 0, EXTENTCOUNT - OLD_SIZE);
+    inodeBlock[3] = INODE_VERSION;
+    set_inodeSize(inodeBlock, size);
+    for (i = 0; i < 3; i++) {
+        set_inodeTime(inodeBlock, newTimes[i], times[i]);
+    }
+}
+
+// Given a diskNum of a disk from before the bitmap, whose free blocks and each file's blocks were chained through byte 2,
+// rewrite it in the layout of the first bitmap disks: the bitmap in block 1, then each file's inode followed by its data
+// in one extent. Inodes keep their ASCII fields for mounting to upgrade
+// Return 0 on success or error code on failure
+int fbc_convert(int diskNum) {
+    // Init variables
+    int i, j, count, status;
+    int next = BITMAPSTART + BITMAP_BLOCKS(OLD_NUM_BLOCKS);
+    int nums[OLD_NUM_BLOCKS], chain[OLD_NUM_BLOCKS];
+    char seen[OLD_NUM_BLOCKS] = {0};
+    uint64_t map[MAP_WORDS(OLD_NUM_BLOCKS)] = {0};
+    Extent run;
+
+    // Read the whole disk, and lay the new one out next to it
+    char *old = malloc(OLD_NUM_BLOCKS * BLOCKSIZE);
+    char *new = calloc(OLD_NUM_BLOCKS, BLOCKSIZE);
+    if (!old || !new) {
+        free(old);
+        free(new);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; i < OLD_NUM_BLOCKS; i++) {
+        nums[i] = i;
+    }
+    status = readBlocks(diskNum, nums, OLD_NUM_BLOCKS, old);
+
+    // Follow each inode's chain and copy the file to the next free spot
+    for (i = 1; i < OLD_NUM_BLOCKS && status >= 0; i++) {
+        char *inode = old + i * BLOCKSIZE;
+        if (inode[0] != INODE || inode[1] != MAGIC) continue;
+        count = 0;
+        for (j = (unsigned char) inode[2]; j && status >= 0; j = (unsigned char) old[j * BLOCKSIZE + 2]) {
+            if (j >= OLD_NUM_BLOCKS || seen[j] || old[j * BLOCKSIZE] != FILEEXTENT) status = ERR_BLOCKFORMAT;
+            else {
+                seen[j] = 1;
+                chain[count++] = j;
+            }
+        }
+        if (status >= 0 && next + 1 + count > OLD_NUM_BLOCKS) status = ERR_FULLDISK;
+        if (status < 0) break;
+
+        memcpy(new + next * BLOCKSIZE, inode, BLOCKSIZE);
+        new[next * BLOCKSIZE + 2] = 0;
+        new[next * BLOCKSIZE + 3] = 0;
+        run.start = next + 1;
+        run.length = count;
+        set_extents(new + next * BLOCKSIZE, &run, count ? 1 : 0);
+        for (j = 0; j < count; j++) {
+            memcpy(new + (next + 1 + j) * BLOCKSIZE, old + chain[j] * BLOCKSIZE, BLOCKSIZE);
+            new[(next + 1 + j) * BLOCKSIZE + 2] = 0;
+        }
+        next += 1 + count;
+    }
+    free(old);
+
+    // Everything before the next free spot is used, and the rest is left as zeros
+    for (i = 0; i < MAP_WORDS(OLD_NUM_BLOCKS) * 64; i++) {
+        if (i < next || i >= OLD_NUM_BLOCKS) map[i / 64] |= (uint64_t) 1 << (i % 64);
+    }
+    bm_block(map, OLD_NUM_BLOCKS, 0, new + BITMAPSTART * BLOCKSIZE);
+    create_block(new, SUPERBLOCK, NULL, 0);
+    new[4] = BITMAPSTART;
+    new[5] = BITMAP_BLOCKS(OLD_NUM_BLOCKS);
+
+    // Write everything but the superblock first, so the disk is only taken for converted once all of it is there
+    if (status >= 0) status = writeBlocks(diskNum, nums + 1, OLD_NUM_BLOCKS - 1, new + BLOCKSIZE);
+    if (status >= 0) status = syncDisk(diskNum);
+    if (status >= 0) status = writeBlock(diskNum, 0, new);
+    if (status >= 0) status = syncDisk(diskNum);
+    free(new);
+    return status;
+}
+
+// Given two times, check if the first is before the second
+// Return 1 if it is or 0 if it isn't
+int ts_before(struct timespec a, struct timespec b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Given a resource table index, get the size of the file
+// Return the size on success or error code on failure
+int get_fileSize(int idx) {
+    // Read inode block
+    char block[BLOCKSIZE];
+    FileDetails *file = fd_get(idx);
+    int status = md_read(file->mount, file->inode, block);
+    if (status < 0) return status;
+
+    // Return the size on success
+    return get_inodeSize(block);
+}
+
+// Given an inode block number, invalidate the cursor and readahead of every descriptor open on it (-1 for every descriptor on the mount)
+void cursor_invalidate(Mount *m, int inode) {
+    int i;
+    FileDetails *file;
+
+    pthread_mutex_lock(&openLock);
+    if (inode < 0) {
+        for (i = 0; i < rtUsed; i++) {
+            if ((file = fd_get(i)) && file->mount == m) {
+                file->curIdx = -1;
+                file->raCount = 0;
+            }
+        }
+    }
+    for (file = of_bucket(m, inode); inode >= 0 && file; file = file->inodeNext) {
+        if (file->inode == inode) {
+            file->curIdx = -1;
+            file->raCount = 0;
+        }
+    }
+    pthread_mutex_unlock(&openLock);
+}
+
+// Given an inode block number, note that the file's data changed where it is, so a defrag copy of it starts over
+// The caller holds the file's inode lock for writing
+void df_touch(Mount *m, int inode) {
+    if (__atomic_load_n(&m->dfInode, __ATOMIC_RELAXED) == inode) __atomic_store_n(&m->dfChanged, 1, __ATOMIC_RELAXED);
+}
+
+// Given an open file, its inode block, and the index of a block within the file, move the file's cursor to that block
+// Staying on the cached block is free, moving to a block read ahead is a copy, and moving within the cached extent costs one block
+// read. Moving to the block after the last one loaded reads the next raWindow blocks of the file ahead along with it
+// Return 0 on success or error code on failure
+int cursor_load(FileDetails *file, char *inodeBlock, int blockIdx) {
+    // Init variables
+    int i, k, extentIdx = 0, numExtents = 0, count = 1;
+    int nums[RA_MAX + 1];
+    Extent extents[MAXEXTENTS];
+    char blocks[(RA_MAX + 1) * BLOCKSIZE];
+
+    // Already on the block
+    if (file->curIdx >= 0 && file->curIdx == blockIdx) return 0;
+
+    // Move to a block that was read ahead
+    if (blockIdx >= file->raIdx && blockIdx < file->raIdx + file->raCount) {
+        i = blockIdx - file->raIdx;
+        memcpy(file->curData, file->raData + i * DATASIZE, DATASIZE);
+        file->curBlock = file->raNums[i];
+        file->curIdx = blockIdx;
+        file->raNext = blockIdx + 1;
+        if (file->raUsed < i + 1) file->raUsed = i + 1;
+        return 0;
+    }
+
+    // Grow the window if the reader got to the end of the last one, shrink it if it didn't get halfway, and drop it
+    if (file->raCount) {
+        if (file->raUsed == file->raCount && file->raWindow < RA_MAX) file->raWindow *= 2;
+        else if (file->raUsed * 2 < file->raCount && file->raWindow > 1) file->raWindow /= 2;
+        file->raCount = 0;
+    }
+
+    // Only read ahead for a reader going through the file in order
+    int ahead = blockIdx == file->raNext ? file->raWindow : 0;
+    if (ahead && !file->raData && !(file->raData = malloc(RA_MAX * DATASIZE))) ahead = 0;
+
+    // Find the extent holding the block, walking the inode's extents only if it's outside the cached one or reading ahead
+    if (ahead || file->curIdx < 0 || blockIdx < file->extentIdx || blockIdx >= file->extentIdx + (int) file->curExtent.length) {
+        numExtents = get_extents(inodeBlock, extents);
+        for (i = 0; i < numExtents && blockIdx >= extentIdx + (int) extents[i].length; i++) {
+            extentIdx += extents[i].length;
+        }
+        if (i == numExtents) return ERR_RPASTLIMIT;
+        file->curExtent = extents[i];
+        file->extentIdx = extentIdx;
+    }
+    int bNum = file->curExtent.start + blockIdx - file->extentIdx;
+    nums[0] = bNum;
+
+    // Number the blocks after it, following the extents up to the end of the file
+    for (k = blockIdx - extentIdx + 1; ahead && i < numExtents && count <= ahead; i++, k = 0) {
+        for (; k < (int) extents[i].length && count <= ahead; k++) {
+            nums[count++] = extents[i].start + k;
+        }
+    }
+
+    // Read the block and the ones after it together
+    file->curIdx = -1;
+    int status = count == 1 ? readBlock(file->mount->disk, bNum, blocks) : readBlocks(file->mount->disk, nums, count, blocks);
+    if (status < 0) return status;
+    for (k = 0; k < count; k++) {
+        if (blocks[k * BLOCKSIZE] != FILEEXTENT) return ERR_BLOCKFORMAT;
+    }
+
+    // Cache the block's payload and keep the rest as the readahead window
+    memcpy(file->curData, blocks + 4, DATASIZE);
+    file->curBlock = bNum;
+    file->curIdx = blockIdx;
+    file->raNext = blockIdx + 1;
+    for (k = 1; k < count; k++) {
+        memcpy(file->raData + (k - 1) * DATASIZE, blocks + k * BLOCKSIZE + 4, DATASIZE);
+        file->raNums[k - 1] = nums[k];
+    }
+    file->raIdx = blockIdx + 1;
+    file->raCount = count - 1;
+    file->raUsed = 0;
+
+    // Finished successfully
+    return 0;
+}
+
+// Given an open file, its inode block, a buffer, and size, copy up to size bytes of the file starting at its pointer into the
+// buffer, moving the cursor block by block so reading in order reads ahead
+// Return the number of bytes read on success or error code on failure
+int cursor_read(FileDetails *file, char *inodeBlock, char *buffer, int size) {
+    // Init variables
+    int status, copied = 0;
+    int offset = file->filePointer;
+
+    // Check that the pointer is within the file and trim the read to the end of the file
+    int fileSize = get_inodeSize(inodeBlock);
+    if (offset < 0 || size < 0) return ERR_OUTOFBOUNDS;
+    if (offset >= fileSize) return 0;
+    if (size > fileSize - offset) size = fileSize - offset;
+
+    // Copy each block's part
+    while (copied < size) {
+        status = cursor_load(file, inodeBlock, (offset + copied) / DATASIZE);
+        if (status < 0) return status;
+        int start = (offset + copied) % DATASIZE;
+        int length = DATASIZE - start < size - copied ? DATASIZE - start : size - copied;
+        memcpy(buffer + copied, file->curData + start, length);
+        copied += length;
+    }
+
+    return copied;
+}
+
+// Given a diskNum of an erased disk, its number of blocks, how many blocks of journal it gets, and its superblock flags,
+// init the disk with a superblock, bitmap, and journal. Every other block is left as zeros, free in the bitmap
+// Return 0 on success or error code on failure
+int initDisk(int diskNum, int nBlocks, int journalBlocks, int flags) {
+    // Init variables
+    int i, status;
+    int numBitmap = BITMAP_BLOCKS(nBlocks);
+    int words = MAP_WORDS(nBlocks);
+    int journalStart = BITMAPSTART + numBitmap;
+
+    // Check that the disk has room for at least one file
+    if (nBlocks < journalStart + journalBlocks + 2) return ERR_FULLDISK;
+
+    // Create the superblock
+    char superblock[BLOCKSIZE];
+    create_block(superblock, SUPERBLOCK, NULL, 0);
+    put_u32(superblock + 4, BITMAPSTART);
+    put_u32(superblock + 8, numBitmap);
+    put_u32(superblock + 12, nBlocks);
+    put_u32(superblock + 16, BLOCKSIZE);
+    put_u32(superblock + 20, journalBlocks ? journalStart : 0);
+    put_u32(superblock + 24, journalBlocks);
+    superblock[SB_FLAGS] = flags;
+    sb_seal(superblock, 1, journalBlocks ? 0 : NO_NAMETABLE, 2166136261u);
+    // Write superblock to the disk
+    status = writeBlock(diskNum, 0, superblock);
+    if (status < 0) return status;
+
+    // The superblock, bitmap, journal, and the bits past the last block are used
+    char block[BLOCKSIZE];
+    uint64_t *map = calloc(words, sizeof(uint64_t));
+    if (!map) return ERR_NOMEMORY;
+    for (i = 0; i < words * 64; i++) {
+        if (i < journalStart + journalBlocks || i >= nBlocks) {
+            map[i / 64] |= (uint64_t) 1 << (i % 64);
+        }
+    }
+    for (i = 0; i < numBitmap; i++) {
+        bm_block(map, nBlocks, i, block);
+        status = writeBlock(diskNum, BITMAPSTART + i, block);
+        if (status < 0) break;
+    }
+    free(map);
+    if (status < 0) return status;
+
+    // Start the journal with nothing to replay
+    if (journalBlocks) return jn_clear(diskNum, journalStart, 0);
+
+    // Finished successfully
+    return 0;
+}
+
+// Get the current time from the kernel's coarse clock, which is read without a system call where it's available
+// Return the time on success or a time with tv_sec -1 on failure
+struct timespec clock_now() {
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    if (!clock_gettime(CLOCK_REALTIME_COARSE, &ts)) return ts;
+#endif
+    if (clock_gettime(CLOCK_REALTIME, &ts)) ts.tv_sec = -1;
+    return ts;
+}
+
+// Given an inode block number, find its cached times. The caller holds its bucket's times lock
+// Return the cached times or NULL if they aren't cached
+InodeTimes *it_find(Mount *m, int inode) {
+    InodeTimes *times = m->inodeTimes[inode % TIMES_BUCKETS];
+    while (times && times->inode != inode) times = times->next;
+    return times;
+}
+
+// Given an inode block number and its inode block, get its cached times, loading them from the block the first time
+// The caller holds its bucket's times lock
+// Return the cached times or NULL if out of memory
+InodeTimes *it_get(Mount *m, int inode, char *inodeBlock) {
+    InodeTimes *times = it_find(m, inode);
+    if (!times) {
+        times = malloc(sizeof(InodeTimes));
+        if (!times) return NULL;
+        times->inode = inode;
+        times->access = get_inodeTime(inodeBlock, INODE_ATIME);
+        times->modification = get_inodeTime(inodeBlock, INODE_MTIME);
+        times->dirty = 0;
+        times->next = m->inodeTimes[inode % TIMES_BUCKETS];
+        m->inodeTimes[inode % TIMES_BUCKETS] = times;
+    }
+    return times;
+}
+
+// Given an inode block number and its inode block, record a read of the file under the atime policy
+// Return 0 on success or error code on failure
+int it_access(Mount *m, int inode, char *inodeBlock) {
+    // Reads never change the access time
+    if (m->atimePolicy == ATIME_NOATIME) return 0;
+
+    struct timespec curTime = clock_now();
+    if (curTime.tv_sec == -1) return ERR_TIMING;
+
+    pthread_mutex_lock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    InodeTimes *times = it_get(m, inode, inodeBlock);
+
+    // Relatime only updates the access time once after each modification or once every atime age
+    if (times && (m->atimePolicy != ATIME_RELATIME || !ts_before(times->modification, times->access) || curTime.tv_sec - times->access.tv_sec >= m->atimeAge) &&
+        ts_before(times->access, curTime)) {
+        times->access = curTime;
+        times->dirty = 1;
+    }
+    pthread_mutex_unlock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    if (!times) return ERR_NOMEMORY;
+
+    // Finished successfully
+    return 0;
+}
+
+// Given an inode block number and its inode block, record a change to the file
+// Return 0 on success or error code on failure
+int it_modify(Mount *m, int inode, char *inodeBlock) {
+    struct timespec curTime = clock_now();
+    if (curTime.tv_sec == -1) return ERR_TIMING;
+
+    pthread_mutex_lock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    InodeTimes *times = it_get(m, inode, inodeBlock);
+    if (times && (ts_before(times->modification, curTime) || ts_before(times->access, curTime))) {
+        times->modification = curTime;
+        times->access = curTime;
+        times->dirty = 1;
+    }
+    pthread_mutex_unlock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    if (!times) return ERR_NOMEMORY;
+
+    // Finished successfully
+    return 0;
+}
+
+// Given an inode block, copy an inode's cached times into it if they're newer than the ones it holds
+void it_apply(Mount *m, int inode, char *inodeBlock) {
+    pthread_mutex_lock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    InodeTimes *times = it_find(m, inode);
+    if (times && times->dirty) {
+        set_inodeTime(inodeBlock, INODE_ATIME, times->access);
+        set_inodeTime(inodeBlock, INODE_MTIME, times->modification);
+    }
+    pthread_mutex_unlock(&m->timesLocks[inode % TIMES_BUCKETS]);
+}
+
+// Given an inode block number, write its dirty cached times to its inode block. The caller holds the inode's write lock
+// Return 0 on success or error code on failure
+int it_flush(Mount *m, int inode) {
+    // Init variables
+    int status = 0;
+    char block[BLOCKSIZE];
+
+    // Hold the bucket so a read can't update the times between writing them and marking them clean
+    pthread_mutex_lock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    InodeTimes *times = it_find(m, inode);
+    if (times && times->dirty) {
+        // Update the inode block
+        status = md_read(m, inode, block);
+        if (status >= 0) {
+            set_inodeTime(block, INODE_ATIME, times->access);
+            set_inodeTime(block, INODE_MTIME, times->modification);
+            status = md_write(m, inode, block);
+        }
+        if (status >= 0) times->dirty = 0;
+    }
+    pthread_mutex_unlock(&m->timesLocks[inode % TIMES_BUCKETS]);
+    if (status < 0) return status;
+
+    // Finished successfully
+    return 0;
+}
+
+// Write every inode's dirty cached times, taking each inode's write lock while its times are written. Each inode is its
+// own operation, committed first if the open transaction has no room for it. The caller holds the filesystem lock exclusively
+// Return 0 on success or error code on failure
+int it_flushAll(Mount *m) {
+    // Init variables
+    int i, j, count, status = 0;
+    InodeTimes *times;
+
+    for (i = 0; i < TIMES_BUCKETS && status >= 0; i++) {
+        // Note the dirty inodes in the bucket, their inode locks come before the times lock
+        pthread_mutex_lock(&m->timesLocks[i]);
+        for (count = 0, times = m->inodeTimes[i]; times; times = times->next) count += times->dirty;
+        int *dirty = malloc(count * sizeof(int) + 1);
+        for (count = 0, times = m->inodeTimes[i]; dirty && times; times = times->next) {
+            if (times->dirty) dirty[count++] = times->inode;
+        }
+        pthread_mutex_unlock(&m->timesLocks[i]);
+        if (!dirty) return ERR_NOMEMORY;
+
+        for (j = 0; j < count && status >= 0; j++) {
+            if (m->journalBlocks && tx_room(m) < 1) status = tx_commit(m);
+            if (status < 0) break;
+            il_lock(m, dirty[j], 1);
+            status = it_flush(m, dirty[j]);
+            il_unlock(m, dirty[j]);
+        }
+        free(dirty);
+    }
+    if (status < 0) return status;
+
+    // Finished successfully
+    return 0;
+}
+
+// Given an inode block number, forget its cached times (-1 for every inode)
+void it_drop(Mount *m, int inode) {
+    // Init variables
+    int i;
+    InodeTimes **link, *times;
+
+    for (i = 0; i < TIMES_BUCKETS; i++) {
+        if (inode >= 0 && i != inode % TIMES_BUCKETS) continue;
+        pthread_mutex_lock(&m->timesLocks[i]);
+        link = &m->inodeTimes[i];
+        while ((times = *link)) {
+            if (inode < 0 || times->inode == inode) {
+                *link = times->next;
+                free(times);
+            } else {
+                link = &times->next;
+            }
+        }
+        pthread_mutex_unlock(&m->timesLocks[i]);
+    }
+}
+
+// Given a disk name, find the mount it's mounted on. The caller holds mountLock
+// Return the mount or NULL if it isn't mounted
+Mount *mount_find(char *diskname) {
+    // Init variables
+    int i;
+
+    for (i = 0; i < MAX_MOUNTS && mounts[i]; i++) {
+        if (mounts[i]->disk >= 0 && !strcmp(findDiskNodeNumber(mounts[i]->disk)->fileName, diskname)) return mounts[i];
+    }
+    return NULL;
+}
+
+// Free everything cached about a mount's disk
+void mount_clear(Mount *m) {
+    ni_clear(m);
+    it_drop(m, -1);
+    free(m->blockMap);
+    m->blockMap = NULL;
+    free(m->pinMap);
+    m->pinMap = NULL;
+    free(m->txNums);
+    m->txNums = NULL;
+    free(m->txData);
+    m->txData = NULL;
+    free(m->txHash);
+    m->txHash = NULL;
+    m->txHashSize = 0;
+    m->txCapacity = 0;
+    __atomic_store_n(&m->txCount, 0, __ATOMIC_RELAXED);
+    m->txBitmap = 0;
+    m->txReserved = 0;
+    __atomic_store_n(&m->journalBlocks, 0, __ATOMIC_RELAXED);
+    free(m->openFiles);
+    m->openFiles = NULL;
+    m->openBuckets = 0;
+    m->openCount = 0;
+    pthread_mutex_lock(&m->dfStatsLock);
+    free(m->dfInodes);
+    m->dfInodes = NULL;
+    memset(&m->dfStats, 0, sizeof(DefragStats));
+    pthread_mutex_unlock(&m->dfStatsLock);
+    free(m->dfMap);
+    m->dfMap = NULL;
+    m->dfInode = 0;
+    m->dfFromCount = 0;
+    m->dfToCount = 0;
+    m->dfCopied = 0;
+    m->dfChanged = 0;
+    m->dfRestarts = 0;
+}
+
+// Body of tfs_mkfsOptions, run with mountLock held
+int make_fs(char *filename, off_t nBytes, int options) {
+    // PRINT TESTING
+    // printf("tfs_mkfs\n");
+
+    // Don't make a new filesystem under a mounted one
+    if (options & ~MKFS_CHECKSUMS) return ERR_OUTOFBOUNDS;
+    if (mount_find(filename)) return ERR_MOUNTMULTIPLE;
+
+    // Check that the block count fits the superblock and the bitmap
+    off_t blocks = (nBytes + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (nBytes < 0 || blocks > MAX_DISK_BLOCKS) return ERR_OUTOFBOUNDS;
+    int nBlocks = (int) blocks;
+
+    // Make a disk on the file
+    int diskNum = openDiskBackend(filename, nBytes, DISK_URING);
+    if (diskNum < 0) return diskNum;
+
+    // Size the file to nothing but zeros without writing them, blocks that were never written are free
+    int status = eraseDisk(diskNum);
+    if (status >= 0 && (options & MKFS_CHECKSUMS)) status = setChecksums(diskNum, CRC_ZEROED);
+    if (status < 0) {
+        closeDisk(diskNum);
+        return status;
+    }
+
+    // Init the disk blocks
+    status = initDisk(diskNum, nBlocks, JOURNAL_BLOCKS(nBlocks), options & MKFS_CHECKSUMS ? FS_CHECKSUMS : 0);
+    if (status < 0) {
+        closeDisk(diskNum);
+        return status;
+    }
+
+    // Close the disk
+    status = closeDisk(diskNum);
+    if (status < 0) return status;
+
+    // Return the disk number on success
+    return diskNum;
+}
+
+// Given a filename and number of bytes, create a filesystem of size nBytes on the filename
+// Return the disk number on success or error code on failure
+int tfs_mkfs(char *filename, off_t nBytes) {
+    return tfs_mkfsOptions(filename, nBytes, 0);
+}
+
+// Given a filename, number of bytes, and options (MKFS_CHECKSUMS), create a filesystem of size nBytes on the filename
+// Return the disk number on success or error code on failure
+int tfs_mkfsOptions(char *filename, off_t nBytes, int options) {
+    pthread_mutex_lock(&mountLock);
+    int status = make_fs(filename, nBytes, options);
+    pthread_mutex_unlock(&mountLock);
+    return status;
+}
+
+// Given a disk name that contains a file system, mount it in place of the disk the functions without a handle use
+// Return the mount handle on success or error code on failure
+mountHandle tfs_mount(char *diskname) {
+    return tfs_mountOptions(diskname, ATIME_STRICT, DEFAULT_ATIME_AGE);
+}
+
+// Body of tfsm_mount, run with mountLock held on a free mount
+// A disk that was unmounted cleanly gets its name index from its name table, unless verify is set. Any other disk has
+// every block read and checked
+int mount_disk(Mount *m, char *diskname, int atime, int age, int verify) {
+    // Init variables
+    int i, status;
+
+    // PRINT TESTING
+    // printf("tfs_mount\n");
+
+    // Check the options, and that the disk isn't mounted already
+    if (atime < ATIME_STRICT || atime > ATIME_NOATIME || age < 0) return ERR_OUTOFBOUNDS;
+    if (mount_find(diskname)) return ERR_MOUNTMULTIPLE;
+
+    // Read the superblock to find the disk's geometry
+    char superblock[BLOCKSIZE];
+    int diskNum = openDisk(diskname, 0);
+    if (diskNum < 0) return diskNum;
+    off_t fileSize = findDiskNodeNumber(diskNum)->diskSize;
+    status = readBlock(diskNum, 0, superblock);
+    closeDisk(diskNum);
+    if (status < 0) return status;
+    // Disks from before the bitmap chain their free blocks from byte 2 and have nothing after it
+    static const char zeros[BLOCKSIZE];
+    int chained = !memcmp(superblock + 3, zeros, BLOCKSIZE - 3);
+    if (superblock[0] != SUPERBLOCK || superblock[1] != MAGIC || (superblock[2] != 0x00 && !chained) || superblock[3] != 0x00) return ERR_BLOCKFORMAT;
+    uint32_t version = get_u32(superblock + SB_VERSION);
+    if (version > FS_VERSION || (version && get_u32(superblock + SB_CHECKSUM) != sb_checksum(superblock))) return ERR_BLOCKFORMAT;
+
+    // Disks made before the geometry was recorded all have the same one, and no journal
+    int nBlocks = get_u32(superblock + 12);
+    int journalStart = get_u32(superblock + 20), journalBlocks = get_u32(superblock + 24);
+    int oldSuperblock = !nBlocks;
+    if (oldSuperblock) {
+        if (!chained && (superblock[4] != BITMAPSTART || superblock[5] != BITMAP_BLOCKS(OLD_NUM_BLOCKS))) return ERR_BLOCKFORMAT;
+        nBlocks = OLD_NUM_BLOCKS;
+        journalBlocks = 0;
+    } else if (nBlocks < 0 || nBlocks > MAX_DISK_BLOCKS || get_u32(superblock + 4) != BITMAPSTART || get_u32(superblock + 8) != (uint32_t) BITMAP_BLOCKS(nBlocks) ||
+               get_u32(superblock + 16) != BLOCKSIZE) {
+        return ERR_BLOCKFORMAT;
+    } else if (journalBlocks && (journalStart != BITMAPSTART + BITMAP_BLOCKS(nBlocks) || journalBlocks < 2 ||
+                                 journalBlocks > JOURNAL_BLOCKS(nBlocks) || journalStart + journalBlocks >= nBlocks)) {
+        return ERR_BLOCKFORMAT;
+    }
+    if ((off_t) nBlocks * BLOCKSIZE > fileSize) return ERR_BLOCKFORMAT;
+    if (!version) superblock[SB_FLAGS] = 0;
+
+    // Open the disk for reading and writing at its size
+    diskNum = openDiskBackend(diskname, (off_t) nBlocks * BLOCKSIZE, DISK_URING);
+    if (diskNum < 0) return diskNum;
+
+    // Give disks from before the bitmap one
+    status = chained ? fbc_convert(diskNum) : 0;
+    superblock[2] = 0;
+
+    // Check blocks against their checksums from here on. The stored ones only hold if the disk was unmounted cleanly,
+    // and the superblock is written after them so it doesn't match if they didn't all make it
+    if (status >= 0 && (superblock[SB_FLAGS] & FS_CHECKSUMS)) {
+        status = setChecksums(diskNum, superblock[SB_CLEAN] == 1 ? CRC_ON : CRC_REBUILD);
+        if (status >= 0 && superblock[SB_CLEAN] == 1) status = readBlock(diskNum, 0, superblock);
+        if (status == ERR_CHECKSUM) status = setChecksums(diskNum, CRC_REBUILD);
+    }
+
+    // Finish the last commit if we crashed before all of it was in place
+    m->journalStart = journalStart;
+    __atomic_store_n(&m->journalBlocks, journalBlocks, __ATOMIC_RELAXED);
+    if (status >= 0 && journalBlocks) status = jn_replay(diskNum, journalStart, journalBlocks, nBlocks, &m->journalSeq);
+
+    // A journal made before it was sized to hold every bitmap block can't promise an operation fits in one commit, so
+    // the disk writes its metadata in place like one without a journal
+    m->journalCopies = jn_copies(journalBlocks);
+    if (journalBlocks && m->journalCopies - BITMAP_BLOCKS(nBlocks) < 1) __atomic_store_n(&m->journalBlocks, 0, __ATOMIC_RELAXED);
+
+    // Load the free space bitmap
+    if (status >= 0) status = bm_load(m, diskNum, nBlocks);
+    if (status < 0) {
+        mount_clear(m);
+        closeDisk(diskNum);
+        return status;
+    }
+
+    // Index every file from the name table if the disk was unmounted cleanly
+    int clean = version && superblock[SB_CLEAN] == 1 && !verify;
+    if (clean && nt_load(m, diskNum, get_u32(superblock + SB_NAMES), get_u32(superblock + SB_NAMESUM)) < 0) {
+        ni_clear(m);
+        clean = 0;
+    }
+
+    // Otherwise check every block a run at a time, upgrading inodes still in the old ASCII layout and indexing every file by name
+    int blockNums[MAX_RUN_BLOCKS];
+    char *blocks = clean ? NULL : malloc(MAX_RUN_BLOCKS * BLOCKSIZE);
+    if (!clean && !blocks) {
+        mount_clear(m);
+        closeDisk(diskNum);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; !clean && i < nBlocks && status >= 0; i += MAX_RUN_BLOCKS) {
+        int j, count = nBlocks - i < MAX_RUN_BLOCKS ? nBlocks - i : MAX_RUN_BLOCKS;
+        for (j = 0; j < count; j++) {
+            blockNums[j] = i + j;
+        }
+        status = readBlocks(diskNum, blockNums, count, blocks);
+
+        for (j = 0; j < count && status >= 0; j++) {
+            char *block = blocks + j * BLOCKSIZE;
+            // Check the magic number, blocks never written since the disk was made are all zeros
+            if (block[1] != MAGIC && !block_zero(block)) status = ERR_BLOCKFORMAT;
+            if (status < 0 || block[0] != INODE || !block_used(m, i + j)) continue;
+
+            if (block[3] > INODE_VERSION) {
+                status = ERR_BLOCKFORMAT;
+            } else if (block[3] < INODE_VERSION) {
+                upgrade_inode(block);
+                status = writeBlock(diskNum, i + j, block);
+            }
+            if (status >= 0) status = ni_add(m, block + 4, i + j);
+        }
+    }
+    free(blocks);
+
+    // Record the geometry in superblocks that don't have it yet, and mark the disk as in use until it's unmounted cleanly
+    if (status >= 0 && oldSuperblock) {
+        put_u32(superblock + 4, BITMAPSTART);
+        put_u32(superblock + 8, BITMAP_BLOCKS(nBlocks));
+        put_u32(superblock + 12, nBlocks);
+        put_u32(superblock + 16, BLOCKSIZE);
+    }
+    if (status >= 0) status = sb_write(diskNum, superblock, 0, NO_NAMETABLE, 0);
+    if (status < 0) {
+        mount_clear(m);
+        closeDisk(diskNum);
+        return status;
+    }
+
+    // Mount disk
+    m->atimePolicy = atime;
+    m->atimeAge = age;
+    __atomic_store_n(&m->disk, diskNum, __ATOMIC_RELEASE);
+
+    // Finished successfully
+    return 0;
+}
+
+// Given a diskname, an atime policy and age, and whether to check every block, mount the disk in a free slot
+// Return the mount handle on success or error code on failure
+mountHandle mount_open(char *diskname, int atime, int age, int verify) {
+    pthread_mutex_lock(&mountLock);
+    mountHandle mh = mount_alloc();
+    int status = mh < 0 ? mh : mount_disk(mounts[mh], diskname, atime, age, verify);
+    pthread_mutex_unlock(&mountLock);
+    if (status < 0) return status;
+
+    return mh;
+}
+
+// Mount a disk with an atime policy (ATIME_STRICT, ATIME_RELATIME, or ATIME_NOATIME), alongside any already mounted
+// With relatime, age is how many seconds old the access time can get before a read updates it anyway
+// Return the mount handle on success or error code on failure
+mountHandle tfsm_mount(char *diskname, int atime, int age) {
+    return mount_open(diskname, atime, age, 0);
+}
+
+// Mount a disk like tfsm_mount, reading and checking every block even if it was unmounted cleanly
+// Return the mount handle on success or error code on failure
+mountHandle tfsm_mountVerify(char *diskname, int atime, int age) {
+    return mount_open(diskname, atime, age, 1);
+}
+
+// Mount a disk with an atime policy in place of the disk the functions without a handle use
+// Return the mount handle on success or error code on failure
+mountHandle tfs_mountOptions(char *diskname, int atime, int age) {
+    // Unmount the old disk first so it can be mounted again
+    if (__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE) >= 0) tfs_unmount();
+
+    mountHandle mh = tfsm_mount(diskname, atime, age);
+    if (mh >= 0) __atomic_store_n(&defaultMount, mh, __ATOMIC_RELEASE);
+    return mh;
+}
+
+// Mount a disk in place of the disk the functions without a handle use, reading and checking every block
+// Return the mount handle on success or error code on failure
+mountHandle tfs_mountVerify(char *diskname) {
+    // Unmount the old disk first so it can be mounted again
+    if (__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE) >= 0) tfs_unmount();
+
+    mountHandle mh = tfsm_mountVerify(diskname, ATIME_STRICT, DEFAULT_ATIME_AGE);
+    if (mh >= 0) __atomic_store_n(&defaultMount, mh, __ATOMIC_RELEASE);
+    return mh;
+}
+
+// Body of tfsm_unmount, run with mountLock and the filesystem lock held exclusively
+int unmount_disk(Mount *m) {
+    // Init variables
+    int i;
+    FileDetails *file;
+
+    // PRINT TESTING
+    // printf("tfs_unmount\n");
+
+    // Write back any cached times, commit, and write back cached blocks. The journal is left with nothing to replay
+    int status = it_flushAll(m);
+    if (status >= 0) status = tx_commit(m);
+    if (status >= 0 && m->journalBlocks) status = syncDisk(m->disk);
+    if (status >= 0 && m->journalBlocks) status = jn_clear(m->disk, m->journalStart, m->journalSeq);
+    if (status >= 0) status = flushDisk(m->disk);
+
+    // Leave the name index in the empty journal and then mark the disk clean, so mounting it again reads neither every block
+    uint32_t names, nameSum;
+    char superblock[BLOCKSIZE];
+    if (status >= 0) status = nt_write(m, &names, &nameSum);
+    if (status >= 0) status = syncDisk(m->disk);
+    if (status >= 0) status = readBlock(m->disk, 0, superblock);
+    if (status >= 0) status = sb_write(m->disk, superblock, 1, names, nameSum);
+    if (status < 0) return status;
+
+    // Close disk
+    status = closeDisk(m->disk);
+    if (status < 0) return status;
+
+    // Close every file still open on it, their descriptors can't be used once the slot is reused
+    pthread_mutex_lock(&openLock);
+    for (i = 0; i < rtUsed; i++) {
+        if ((file = fd_get(i)) && file->mount == m) {
+            fd_release(i);
+            fd_free(file);
+        }
+    }
+    pthread_mutex_unlock(&openLock);
+
+    // Unmount disk
+    mount_clear(m);
+    __atomic_store_n(&m->disk, -1, __ATOMIC_RELEASE);
+
+    // Finished successfully
+    return 0;
+}
+
+// Stop a mount's writeback thread if it has one. The caller holds mountLock and none of the mount's locks
+void wb_stop(Mount *m) {
+    if (!m->wbRunning) return;
+
+    pthread_mutex_lock(&m->wbLock);
+    m->wbStop = 1;
+    pthread_cond_signal(&m->wbCond);
+    pthread_mutex_unlock(&m->wbLock);
+    pthread_join(m->wbThread, NULL);
+    __atomic_store_n(&m->wbRunning, 0, __ATOMIC_RELEASE);
+    m->wbStop = 0;
+}
+
+// Stop a mount's defrag thread if it has one, leaving its pass where it got to. The caller holds mountLock and none of the
+// mount's locks
+void df_stop(Mount *m) {
+    if (!m->dfRunning) return;
+
+    pthread_mutex_lock(&m->dfLock);
+    m->dfStop = 1;
+    pthread_cond_signal(&m->dfCond);
+    pthread_mutex_unlock(&m->dfLock);
+    pthread_join(m->dfThread, NULL);
+    m->dfRunning = 0;
+    m->dfStop = 0;
+}
+
+// Given a mount handle, unmount its disk
+// Return 0 on success or error code on failure
+int tfsm_unmount(mountHandle mh) {
+    pthread_mutex_lock(&mountLock);
+    Mount *m = mount_get(mh);
+    int status = ERR_CANNOTFNDDISK;
+    if (m) {
+        wb_stop(m);
+        df_stop(m);
+        pthread_mutex_lock(&m->dfLock);
+        fs_enter(m, 1);
+        status = unmount_disk(m);
+        fs_leave(m);
+        pthread_mutex_unlock(&m->dfLock);
+    }
+    pthread_mutex_unlock(&mountLock);
+    return status;
+}
+
+// Unmount the disk tfs_mount mounted
+// Return 0 on success or error code on failure
+int tfs_unmount(void) {
+    mountHandle mh = __atomic_exchange_n(&defaultMount, -1, __ATOMIC_ACQ_REL);
+    int status = tfsm_unmount(mh);
+
+    // Keep it as the default if it's still mounted
+    if (status < 0 && mount_get(mh)) __atomic_store_n(&defaultMount, mh, __ATOMIC_RELEASE);
+    return status;
+}
+
+// Body of tfsm_flush, run with the filesystem lock held exclusively
+int flush_all(Mount *m) {
+    __atomic_store_n(&m->wbDirtySince, 0, __ATOMIC_RELAXED);
+    int status = it_flushAll(m);
+    if (status >= 0) status = tx_commit(m);
+    if (status < 0) return status;
+
+    return flushDisk(m->disk);
+}
+
+// Given a mount handle, write every file's cached times to its inode block, commit the open transaction, and write back
+// the disk's cached blocks
+// Return 0 on success or error code on failure
+int tfsm_flush(mountHandle mh) {
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
+    fs_enter(m, 1);
+    int status = m->disk >= 0 ? flush_all(m) : ERR_CANNOTFNDDISK;
+    fs_leave(m);
+    return status;
+}
+
+// Flush the disk tfs_mount mounted
+// Return 0 on success or error code on failure
+int tfs_flush(void) {
+    return tfsm_flush(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE));
+}
+
+// Given a mount handle, flush its disk right away and wait for everything to be on stable storage
+// Return 0 on success or error code on failure
+int tfsm_sync(mountHandle mh) {
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
+    fs_enter(m, 1);
+    int status = m->disk >= 0 ? flush_all(m) : ERR_CANNOTFNDDISK;
+    if (status >= 0) status = syncDisk(m->disk);
+    fs_leave(m);
+    return status;
+}
+
+// Sync the disk tfs_mount mounted
+// Return 0 on success or error code on failure
+int tfs_sync(void) {
+    return tfsm_sync(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE));
+}
+
+// Body of a mount's writeback thread. It sleeps until the oldest change is wbAge old or a caller says wbBytes are
+// waiting or the journal is filling up, then flushes the disk
+void *wb_thread(void *arg) {
+    Mount *m = arg;
+
+    pthread_mutex_lock(&m->wbLock);
+    while (!m->wbStop) {
+        int64_t age = (int64_t) m->wbAge * 1000000;
+        int64_t since = __atomic_load_n(&m->wbDirtySince, __ATOMIC_RELAXED);
+        int64_t due = (since ? since : wb_now()) + age;
+        struct timespec wake = {due / 1000000000, due % 1000000000};
+        pthread_cond_timedwait(&m->wbCond, &m->wbLock, &wake);
+        if (m->wbStop) break;
+
+        // Nothing's old enough and there isn't enough of it yet
+        since = __atomic_load_n(&m->wbDirtySince, __ATOMIC_RELAXED);
+        if (!since || (wb_now() < since + age && wb_dirtyBytes(m) < m->wbBytes && !wb_journalFull(m))) continue;
+
+        // Callers only wait on wbLock to wake us, so don't hold it while flushing
+        pthread_mutex_unlock(&m->wbLock);
+        fs_enter(m, 1);
+        flush_all(m);
+        fs_leave(m);
+        pthread_mutex_lock(&m->wbLock);
+    }
+    pthread_mutex_unlock(&m->wbLock);
+
+    return NULL;
+}
+
+// Given a mount handle, write its changes back from a background thread once the oldest is maxAge milliseconds old or
+// maxDirty bytes are waiting (0 for no limit), so writes only have to copy into memory. A maxAge of 0 stops the thread
+// and goes back to writing from the caller
+// Return 0 on success or error code on failure
+int tfsm_writeback(mountHandle mh, int maxAge, int maxDirty) {
+    if (maxAge < 0 || maxDirty < 0) return ERR_OUTOFBOUNDS;
+
+    pthread_mutex_lock(&mountLock);
+    Mount *m = mount_get(mh);
+    if (!m) {
+        pthread_mutex_unlock(&mountLock);
+        return ERR_CANNOTFNDDISK;
+    }
+
+    // Write back everything the old settings left, and grow the cache to room for twice the dirty blocks, up to the size
+    // of the disk or WB_MAX_CACHE. With the thread stopped and the filesystem held exclusively no I/O is running
+    wb_stop(m);
+    fs_enter(m, 1);
+    int status = flush_all(m);
+    int blocks = maxDirty / BLOCKSIZE * 2, oldBlocks = cacheSize(m->disk);
+    if (blocks > m->numBlocks) blocks = m->numBlocks;
+    if (blocks > WB_MAX_CACHE) blocks = WB_MAX_CACHE;
+    if (status >= 0 && maxAge && oldBlocks && blocks > oldBlocks) {
+        status = setCacheSize(m->disk, blocks);
+        if (status < 0) setCacheSize(m->disk, oldBlocks);
+    }
+    if (status >= 0) status = setWriteBack(m->disk, maxAge > 0);
+    m->wbAge = maxAge;
+    __atomic_store_n(&m->wbBytes, maxDirty ? maxDirty : INT_MAX, __ATOMIC_RELAXED);
+    fs_leave(m);
+
+    // Start the thread
+    if (status >= 0 && maxAge) {
+        if (pthread_create(&m->wbThread, NULL, wb_thread, m)) {
+            setWriteBack(m->disk, 0);
+            status = ERR_NOMEMORY;
+        } else {
+            __atomic_store_n(&m->wbRunning, 1, __ATOMIC_RELEASE);
         }
+    }
+    pthread_mutex_unlock(&mountLock);
+    return status;
+}
+
+// Write back the disk tfs_mount mounted from a background thread
+// Return 0 on success or error code on failure
+int tfs_writeback(int maxAge, int maxDirty) {
+    return tfsm_writeback(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), maxAge, maxDirty);
+}
+
+// Body of tfs_openFile, run with the name lock held, for writing if create is set
+// Return ERR_NOFILE without creating anything if the file doesn't exist and create isn't set
+fileDescriptor open_file(Mount *m, char *name, int create) {
+    // Init variables
+    int status, startBlock = 0, fileExists = 0;
+    int buffer[1];
+
+    // PRINT TESTING
+    // printf("tfs_openFile\n");
+
+    // Check that the length of the filename is within bounds
+    if (strlen(name) > 8) return ERR_FILENAMELIMIT;
+
+    // Check if file already exists
+    char curBlock[BLOCKSIZE];
+    status = ni_find(m, name);
+    if (status >= 0) {
+        fileExists = 1;
+        startBlock = status;
+
+        // Read its inode block and update the access time
+        il_lock(m, startBlock, 0);
+        status = md_read(m, startBlock, curBlock);
+        if (status >= 0) status = it_access(m, startBlock, curBlock);
+        il_unlock(m, startBlock);
+        if (status < 0) return status;
+    } else if (!create) {
+        return ERR_NOFILE;
+    }
+
+    // If the file doesn't exist, we need to create an inode block for it in the disk
+    if (!fileExists) {
+        // Update the file's time info
+        struct timespec curTime = clock_now();
+        if (curTime.tv_sec == -1) return ERR_TIMING;
+
+        // Get next free block
+        status = alloc_blocks(m, 1, buffer);
+        if (status < 0) return status;
 
         // Add inode block to disk
         char inodeBlock[BLOCKSIZE];
@@ -462,325 +2376,799 @@ fileDescriptor tfs_openFile(char *name) {
         memcpy(inodeData, name, strlen(name));
 
         // Create the inode block and write it to the disk
-        create_block(inodeBlock, INODE, 0, inodeData, ++i);
+        create_block(inodeBlock, INODE, inodeData, NAMELENGTH);
+        inodeBlock[3] = INODE_VERSION;
         // Write the times
-        status = setTime(inodeBlock, "creation", curTime);
-        if (status < 0) return status;
-        status = setTime(inodeBlock, "modification", curTime);
+        set_inodeTime(inodeBlock, INODE_CTIME, curTime);
+        set_inodeTime(inodeBlock, INODE_MTIME, curTime);
+        set_inodeTime(inodeBlock, INODE_ATIME, curTime);
+
+        // Write the inode block to the disk
+        status = md_write(m, buffer[0], inodeBlock);
         if (status < 0) return status;
-        status = setTime(inodeBlock, "access", curTime);
+        startBlock = buffer[0];
+        it_drop(m, startBlock);
+
+        // Index the new file
+        status = ni_add(m, name, startBlock);
         if (status < 0) return status;
+    }
 
-        // Write the inode block to the disk
-        status = writeBlock(curDisk, buffer[0], inodeBlock);
-        if (status < 0) {
-            free(file);
-            return (status);
-        }
+    // Create resource table entry
+    pthread_mutex_lock(&openLock);
+    int fd = fd_alloc();
+    FileDetails *file = fd < 0 ? NULL : fd_new();
+    if (!file) {
+        if (fd >= 0) fd_release(fd);
+        pthread_mutex_unlock(&openLock);
+        return fd < 0 ? fd : ERR_NOMEMORY;
+    }
+    __atomic_store_n(&file->mount, m, __ATOMIC_RELEASE);
+    file->inode = startBlock;
+    memset(file->name, 0, NAMELENGTH);
+    memcpy(file->name, name, strlen(name));
+    file->fd = fd;
+    file->filePointer = 0;
+    file->rw = 1;
+    file->curIdx = -1;
+    file->raNext = 0;
+    file->raWindow = RA_START;
+    file->raCount = 0;
 
-        // Set the file's block number in the resource table
-        file->inode = buffer[0];
+    // Add file to resource table and the open file hash
+    status = of_add(file);
+    if (status < 0) {
+        fd_free(file);
+        fd_release(fd);
+    } else {
+        fd_put(fd, file);
     }
+    pthread_mutex_unlock(&openLock);
+    if (status < 0) return status;
 
     // Return file descriptor
     return file->fd;
 }
 
+// Given a mount handle, create or open a file on its disk for "rw"
+// Return a file descriptor on success or error code on failure
+fileDescriptor tfsm_openFile(mountHandle mh, char *name) {
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
+    // Most opens find the file, so only lock the name index for writing when it has to be created
+    int fd, retried = 0;
+    do {
+        fs_enter(m, 0);
+        fd = m->disk < 0 ? ERR_CANNOTFNDDISK : tx_reserve(m);
+        if (fd < 0) {
+            fs_leave(m);
+            return fd;
+        }
+        pthread_rwlock_rdlock(&m->nameLock);
+        fd = open_file(m, name, 0);
+        if (fd == ERR_NOFILE) {
+            pthread_rwlock_unlock(&m->nameLock);
+            pthread_rwlock_wrlock(&m->nameLock);
+            fd = open_file(m, name, 1);
+        }
+        pthread_rwlock_unlock(&m->nameLock);
+        tx_release(m);
+        wb_note(m);
+        fs_leave(m);
+    } while (!retried++ && tx_retry(m, fd));
+    return fd;
+}
+
+// Create or open a file for "rw" on the disk tfs_mount mounted
+// Return a file descriptor on success or error code on failure
+fileDescriptor tfs_openFile(char *name) {
+    return tfsm_openFile(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), name);
+}
+
+// Body of tfs_closeFile, run with the file's inode lock held for writing
+int close_file(fileDescriptor FD) {
+    // PRINT TESTING
+    // printf("tfs_closeFile\n");
+
+    // Find the file
+    int i = get_file_idx(FD);
+    if (i < 0) return i;
+    FileDetails *file = fd_get(i);
+    Mount *m = file->mount;
+
+    // Write the file's cached times
+    int inode = file->inode;
+    int status = it_flush(m, inode);
+    if (status < 0) return status;
+
+    // Take the file out of the resource table and give back its descriptor and entry, noting if it was the last one open
+    // on the file
+    pthread_mutex_lock(&openLock);
+    of_remove(file);
+    fd_release(i);
+    fd_free(file);
+    FileDetails *other = of_bucket(m, inode);
+    while (other && other->inode != inode) other = other->inodeNext;
+    pthread_mutex_unlock(&openLock);
+
+    // The other descriptors still use the cached times, so only the last one forgets them
+    if (!other) it_drop(m, inode);
+
+    // Successfully closed file
+    return 0;
+}
+
 // Close a file and remove it from the resource table
 // Return 0 on success or error code on failure
 int tfs_closeFile(fileDescriptor FD) {
+    int inode;
+    Mount *m = file_enter(FD, 1, 0, &inode);
+    int status = m ? close_file(FD) : inode;
+    file_leave(m, inode, 1, 0);
+    return status;
+}
+
+// Body of tfs_writeFile, run with the file's inode lock held for writing
+int write_file(fileDescriptor FD, char *buffer, int size) {
     // Init variables
-    int i, status;
+    int curSize, i, j, k;
+    char inodeBlock[BLOCKSIZE] = {0};
 
     // PRINT TESTING
-    // printf("tfs_closeFile\n");
+    // printf("tfs_writeFile\n");
 
-    // Find the file
-    for (i = 0; i < NUM_BLOCKS - 1; i++) {
-        // File found
-        if (resourceTable[i] && resourceTable[i]->fd == FD) {
-            // Free the resource table entry and set it to null
-            free(resourceTable[i]);
-            resourceTable[i] = NULL;
-            // Update the resource table pointer
-            status = update_rt_pointer();
-            if (status < 0) return status;
+    // Get the resource table index of the open file
+    int idx = get_file_idx(FD);
+    if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
-            // Successfully closed file
-            return 0;
+    // Check that we have write permissions and a size
+    if (!file->rw) return ERR_READONLY;
+    if (size < 0) return ERR_OUTOFBOUNDS;
+
+    // Set the file pointer to 0
+    file->filePointer = 0;
+
+    // Get the file's inode block and initialize the current block
+    int status = md_read(m, file->inode, inodeBlock);
+    if (status < 0) return status;
+
+    // Update the inode block's data size
+    set_inodeSize(inodeBlock, size);
+    // Update the inode block's modification and access time
+    struct timespec curTime = clock_now();
+    if (curTime.tv_sec == -1) return ERR_TIMING;
+    set_inodeTime(inodeBlock, INODE_MTIME, curTime);
+    set_inodeTime(inodeBlock, INODE_ATIME, curTime);
+
+    // The file's blocks are about to move, so drop every cursor on it, and the inode is about to get new times
+    cursor_invalidate(m, file->inode);
+    it_drop(m, file->inode);
+
+    // Remember the file's current data blocks, they're only freed once the inode points at the new ones
+    Extent oldExtents[MAXEXTENTS], extents[MAXEXTENTS];
+    int numOld = get_extents(inodeBlock, oldExtents);
+
+    // Number of blocks needed
+    int numBlocks = (size + DATASIZE - 1) / DATASIZE;
+
+    // Get next free blocks in as few runs as possible, so a failure here leaves the file as it was
+    int numExtents = alloc_extents(m, numBlocks, extents);
+    if (numExtents < 0) return numExtents;
+
+    // List the blocks and create all file extent blocks
+    int *freeBlocks = malloc((size_t) (numBlocks ? numBlocks : 1) * sizeof(int));
+    char *extentBlocks = malloc((size_t) (numBlocks ? numBlocks : 1) * BLOCKSIZE);
+    if (!freeBlocks || !extentBlocks) {
+        free(freeBlocks);
+        free(extentBlocks);
+        free_extents(m, extents, numExtents);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0, j = 0; i < numExtents; i++) {
+        for (k = 0; k < (int) extents[i].length; k++) {
+            freeBlocks[j++] = extents[i].start + k;
         }
     }
+    for (i = 0; i < numBlocks; i++) {
+        char *extentBlock = extentBlocks + (size_t) i * BLOCKSIZE;
 
-    // Couldn't find the file
-    return ERR_NOFILE;
+        // Get the size of the data to write to the block
+        if (i != numBlocks - 1) {
+            curSize = DATASIZE;
+        } else {
+            curSize = size - i * DATASIZE;
+        }
+
+        // Create the file extent block with data of the current size from the buffer
+        create_block(extentBlock, FILEEXTENT, buffer + (size_t) i * DATASIZE, curSize);
+    }
+
+    // Write all the file extent blocks, one call per extent
+    status = writeBlocks(m->disk, freeBlocks, numBlocks, extentBlocks);
+    free(freeBlocks);
+    free(extentBlocks);
+
+    // Update inode block's extents and write the new inode block
+    if (status >= 0) {
+        set_extents(inodeBlock, extents, numExtents);
+        status = md_write(m, file->inode, inodeBlock);
+    }
+    if (status < 0) {
+        free_extents(m, extents, numExtents);
+        return status;
+    }
+
+    // Only now free the file's old data blocks
+    status = free_extents(m, oldExtents, numOld);
+    if (status < 0) return status;
+
+    // Finished successfully
+    return 0;
 }
 
 // Write data of size from the buffer into a file, overwriting previous data and update the inode block
 // Returns 0 on success and error code on failure
 int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+    int inode, status, retried = 0;
+    Mount *m;
+    do {
+        m = file_enter(FD, 1, 0, &inode);
+        status = m ? write_file(FD, buffer, size) : inode;
+        file_leave(m, inode, 1, 0);
+    } while (!retried++ && tx_retry(m, status));
+    return status;
+}
+
+// Body of tfs_deleteFile, run with the name lock and the file's inode lock held for writing
+int delete_file(fileDescriptor FD) {
     // Init variables
-    int curSize, i = 0;
-    char curBlock[BLOCKSIZE] = {0}, superblock[BLOCKSIZE] = {0}, inodeBlock[BLOCKSIZE] = {0};
-    int curDataBlocks[NUM_BLOCKS - 2];
+    char curBlock[BLOCKSIZE];
 
     // PRINT TESTING
-    // printf("tfs_writeFile\n");
-
+    // printf("tfs_deleteFile\n");
+    
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
     // Check that we have write permissions
-    if (!resourceTable[idx]->rw) return ERR_READONLY;
+    if (!file->rw) return ERR_READONLY;
 
-    // Set the file pointer to 0
-    resourceTable[idx]->filePointer = 0;
+    // Get the inode block
+    int status = md_read(m, file->inode, curBlock);
+    if (status < 0) return status;
 
-    // Get the file's inode block and initialize the current block
-    int status = readBlock(curDisk, resourceTable[idx]->inode, inodeBlock);
+    // Drop the file from the name index
+    ni_remove(m, curBlock + 4);
+    cursor_invalidate(m, file->inode);
+    it_drop(m, file->inode);
+
+    // Free the file's data blocks and its inode block
+    Extent extents[MAXEXTENTS + 1];
+    int numExtents = get_extents(curBlock, extents);
+    extents[numExtents].start = file->inode;
+    extents[numExtents].length = 1;
+    status = free_extents(m, extents, numExtents + 1);
     if (status < 0) return status;
-    memcpy(curBlock, inodeBlock, BLOCKSIZE);
 
-    // Get the superblock
-    status = readBlock(curDisk, 0, superblock);
+    // Finished successfully
+    return 0;
+}
+
+// Set a file's blocks in the disk to free
+// Return 0 on success or error code on failure
+int tfs_deleteFile(fileDescriptor FD) {
+    int inode;
+    Mount *m = file_enter(FD, 1, 1, &inode);
+    int status = m ? delete_file(FD) : inode;
+    file_leave(m, inode, 1, 1);
+    return status;
+}
+
+// Body of tfs_readByte, run with the file's inode lock held for reading
+int read_byte(fileDescriptor FD, char *buffer) {
+    // PRINT TESTING
+    // printf("tfs_readByte\n");
+
+    // Get the resource table index of the open file
+    int idx = get_file_idx(FD);
+    if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
+
+    // Read inode block
+    char block[BLOCKSIZE];
+    int status = md_read(m, file->inode, block);
     if (status < 0) return status;
 
-    // Update inode block's link
-    inodeBlock[2] = superblock[2];
-    // Update the inode block's data size
-    char charSize[SIZELENGTH] = {0};
-    sprintf(charSize, "%d", size);
-    memcpy(inodeBlock + 13, charSize, SIZELENGTH);
-    // Update the inode block's modification and access time
-    time_t curTime;
-    if (time(&curTime) == -1) return ERR_TIMING;
-    status = setTime(inodeBlock, "modification", curTime);
+    // Update the file's access time
+    status = it_access(m, file->inode, block);
     if (status < 0) return status;
-    status = setTime(inodeBlock, "access", curTime);
+
+    // Get the size of the data
+    int size = get_inodeSize(block);
+
+    // Check that file pointer is within range
+    if (file->filePointer >= size || file->filePointer < 0) return ERR_RSEEKISSUE;
+
+    // Set the block number and offset
+    int blockNum = file->filePointer / DATASIZE;
+    int offset = file->filePointer % DATASIZE;
+
+    // Move the cursor to the right block
+    status = cursor_load(file, block, blockNum);
     if (status < 0) return status;
 
-    // Iterate through each data block to get their block numbers and total number of blocks
-    while (curBlock[2]) {
-        curDataBlocks[i++] = curBlock[2];
-        status = readBlock(curDisk, curBlock[2], curBlock);
-        if (status < 0) return status;
-    }
+    // Read byte based on offset
+    *buffer = file->curData[offset];
+
+    // Increment file pointer
+    file->filePointer++;
+
+    // Finished successfully
+    return 0;
+}
+
+// Read a byte into the given buffer from a file at its pointer and increment the pointer
+// Return 0 on success or error code on failure
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+    int inode;
+    Mount *m = file_enter(FD, 0, 0, &inode);
+    int status = m ? read_byte(FD, buffer) : inode;
+    file_leave(m, inode, 0, 0);
+    return status;
+}
+
+// Body of tfs_writeByte, run with the file's inode lock held for writing
+int write_byte(fileDescriptor FD, unsigned int data) {
+    // PRINT TESTING
+    // printf("tfs_readByte\n");
+
+    // Get the resource table index of the open file
+    int idx = get_file_idx(FD);
+    if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
+
+    // Check that we have write permissions
+    if (!file->rw) return ERR_READONLY;
 
-    // Free the file's current data blocks
-    fbc_set(curDisk, i, curDataBlocks);
+    // Read inode block
+    char block[BLOCKSIZE];
+    int status = md_read(m, file->inode, block);
+    if (status < 0) return status;
 
-    // Write the new inode block
-    status = writeBlock(curDisk, resourceTable[idx]->inode, inodeBlock);
+    // Update the file's modification and access time
+    status = it_modify(m, file->inode, block);
     if (status < 0) return status;
 
-    // Number of blocks needed
-    int numBlocks = ceil((float) size / (float) DATASIZE);
-    int freeBlocks[numBlocks];
+    // Get the size of the data
+    int size = get_inodeSize(block);
+
+    // Check that file pointer is within range
+    if (file->filePointer >= size || file->filePointer < 0) return ERR_RSEEKISSUE;
+
+    // Set the block number and offset
+    int blockNum = file->filePointer / DATASIZE;
+    int offset = file->filePointer % DATASIZE;
 
-    // Get next free blocks
-    status = fbc_get(numBlocks, freeBlocks);
+    // Move the cursor to the right block
+    status = cursor_load(file, block, blockNum);
     if (status < 0) return status;
 
-    // Create and write all file extent blocks
-    for (i = 0; i < numBlocks; i++) {
-        // Reset the cur block
-        memset(curBlock, 0, BLOCKSIZE);
+    // Write byte based on offset and write the block back to the disk
+    file->curData[offset] = data;
+    create_block(block, FILEEXTENT, file->curData, DATASIZE);
+    status = writeBlock(m->disk, file->curBlock, block);
+    df_touch(m, file->inode);
+    if (status < 0) return status;
 
-        // Get the size of the data to write to the block
-        if (i != numBlocks - 1) {
-            curSize = DATASIZE;
-        } else {
-            curSize = size % DATASIZE;
+    // Keep other descriptors' cursors and every descriptor's readahead of the same block in step
+    FileDetails *other;
+    int i;
+    pthread_mutex_lock(&openLock);
+    for (other = of_bucket(m, file->inode); other; other = other->inodeNext) {
+        if (other->inode != file->inode) continue;
+        if (other != file && other->curIdx >= 0 && other->curBlock == file->curBlock) {
+            other->curData[offset] = data;
         }
+        for (i = 0; i < other->raCount; i++) {
+            if (other->raNums[i] == file->curBlock) other->raData[i * DATASIZE + offset] = data;
+        }
+    }
+    pthread_mutex_unlock(&openLock);
 
-        // Copy data of the current size from the buffer to write to the block
-        char dataBuffer[curSize];
-        memcpy(dataBuffer, buffer + i * DATASIZE, curSize);
+    // Increment file pointer
+    file->filePointer++;
 
-        // Create the file extent block
-        if (i != numBlocks - 1) {
-            create_block(curBlock, FILEEXTENT, freeBlocks[i + 1], dataBuffer, curSize);
-        } else {
-            create_block(curBlock, FILEEXTENT, 0, dataBuffer, curSize);
-        }
+    // Finished successfully
+    return 0;
+}
+
+// Write a byte into a file at its pointer and increment the pointer
+// Return 0 on success or error code on failure
+int tfs_writeByte(fileDescriptor FD, unsigned int data) {
+    int inode;
+    Mount *m = file_enter(FD, 1, 0, &inode);
+    int status = m ? write_byte(FD, data) : inode;
+    file_leave(m, inode, 1, 0);
+    return status;
+}
+
+// Given a list of extents, how many there are, and the indexes of the first and last block wanted of the blocks they
+// hold in order, walk them once and store the number of every block in between in blockNums
+// Return 0 on success or error code on failure
+int run_blockNums(Extent *extents, int numExtents, int firstIdx, int lastIdx, int *blockNums) {
+    // Init variables
+    int i, k, numBlocks = 0, blockIdx = 0;
 
-        // Write the file extent block
-        writeBlock(curDisk, freeBlocks[i], curBlock);
+    for (i = 0; i < numExtents && blockIdx <= lastIdx; i++) {
+        for (k = 0; k < (int) extents[i].length && blockIdx <= lastIdx; k++, blockIdx++) {
+            if (blockIdx >= firstIdx) blockNums[numBlocks++] = extents[i].start + k;
+        }
     }
+    if (numBlocks != lastIdx - firstIdx + 1) return ERR_BLOCKFORMAT;
 
     // Finished successfully
     return 0;
 }
 
-// Set a file's blocks in the disk to free
+// Given an inode block and the indexes of a file's first and last block wanted, store the number of every block in
+// between in blockNums
 // Return 0 on success or error code on failure
-int tfs_deleteFile(fileDescriptor FD) {
+int get_blockNums(char *inodeBlock, int firstIdx, int lastIdx, int *blockNums) {
+    Extent extents[MAXEXTENTS];
+    int numExtents = get_extents(inodeBlock, extents);
+    return run_blockNums(extents, numExtents, firstIdx, lastIdx, blockNums);
+}
+
+// Given an inode block, a buffer, size, and offset, copy up to size bytes of the file starting at offset into the buffer
+// The extents are walked once and every block is read with one readBlocks call
+// Return the number of bytes read on success or error code on failure
+int read_data(Mount *m, char *inodeBlock, char *buffer, int size, int offset) {
     // Init variables
-    int i = 0;
-    int fileBlocks[NUM_BLOCKS - 1];
-    char curBlock[BLOCKSIZE];
+    int i, status;
 
-    // PRINT TESTING
-    // printf("tfs_deleteFile\n");
-    
+    // Check that the offset is within the file and trim the read to the end of the file
+    int fileSize = get_inodeSize(inodeBlock);
+    if (offset < 0 || size < 0) return ERR_OUTOFBOUNDS;
+    if (offset >= fileSize || !size) return 0;
+    if (size > fileSize - offset) size = fileSize - offset;
+
+    // Blocks of the file holding the first and last byte
+    int firstIdx = offset / DATASIZE;
+    int lastIdx = (offset + size - 1) / DATASIZE;
+
+    // Find every block's number
+    int numBlocks = lastIdx - firstIdx + 1;
+    int *blockNums = malloc((size_t) numBlocks * sizeof(int));
+    if (!blockNums) return ERR_NOMEMORY;
+    status = get_blockNums(inodeBlock, firstIdx, lastIdx, blockNums);
+    if (status < 0) {
+        free(blockNums);
+        return status;
+    }
+
+    // Read the blocks
+    char *blocks = malloc((size_t) numBlocks * BLOCKSIZE);
+    status = blocks ? readBlocks(m->disk, blockNums, numBlocks, blocks) : ERR_NOMEMORY;
+    free(blockNums);
+    if (status < 0) {
+        free(blocks);
+        return status;
+    }
+
+    // Copy each block's payload
+    int copied = 0;
+    for (i = 0; i < numBlocks; i++) {
+        char *block = blocks + (size_t) i * BLOCKSIZE;
+        if (block[0] != FILEEXTENT) {
+            free(blocks);
+            return ERR_BLOCKFORMAT;
+        }
+        int start = i == 0 ? offset % DATASIZE : 0;
+        int length = DATASIZE - start < size - copied ? DATASIZE - start : size - copied;
+        memcpy(buffer + copied, block + 4 + start, length);
+        copied += length;
+    }
+    free(blocks);
+
+    return copied;
+}
+
+// Body of tfs_readFile, run with the file's inode lock held for reading
+int read_file(fileDescriptor FD, char *buffer, int size) {
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
-    // Check that we have write permissions
-    if (!resourceTable[idx]->rw) return ERR_READONLY;
+    // Read inode block
+    char block[BLOCKSIZE];
+    int status = md_read(m, file->inode, block);
+    if (status < 0) return status;
 
-    // Add the inode block to the file blocks list
-    fileBlocks[i++] = resourceTable[idx]->inode;
+    // Read the data, small reads go through the cursor so reading in order reads ahead
+    int count = size <= RA_MAX * DATASIZE ? cursor_read(file, block, buffer, size) : read_data(m, block, buffer, size, file->filePointer);
+    if (count < 0) return count;
 
-    // Get the inode block
-    int status = readBlock(curDisk, resourceTable[idx]->inode, curBlock);
+    // Update the access time once for the whole read
+    status = it_access(m, file->inode, block);
     if (status < 0) return status;
 
-    // Get every data block
-    while (curBlock[2]) {
-        fileBlocks[i++] = curBlock[2];
-        status = readBlock(curDisk, curBlock[2], curBlock);
-    }
-
-    // Free file's blocks
-    fbc_set(curDisk, i, fileBlocks);
+    // Move the file pointer
+    file->filePointer += count;
 
-    // Finished successfully
-    return 0;
+    return count;
 }
 
-// Read a byte into the given buffer from a file at its pointer and increment the pointer
-// Return 0 on success or error code on failure
-int tfs_readByte(fileDescriptor FD, char *buffer) {
-    // Init variables
-    int i;
-
-    // PRINT TESTING
-    // printf("tfs_readByte\n");
+// Read up to size bytes from a file at its pointer into the buffer and move the pointer past them
+// Return the number of bytes read (0 at the end of the file) on success or error code on failure
+int tfs_readFile(fileDescriptor FD, char *buffer, int size) {
+    int inode;
+    Mount *m = file_enter(FD, 0, 0, &inode);
+    int status = m ? read_file(FD, buffer, size) : inode;
+    file_leave(m, inode, 0, 0);
+    return status;
+}
 
+// Body of tfs_pread, run with the file's inode lock held for reading
+int pread_file(fileDescriptor FD, char *buffer, int size, int offset) {
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
     // Read inode block
     char block[BLOCKSIZE];
-    int status = readBlock(curDisk, resourceTable[idx]->inode, block);
+    int status = md_read(m, file->inode, block);
     if (status < 0) return status;
 
-    // Update the inode block's access time
-    time_t curTime;
-    if (time(&curTime) == -1) return ERR_TIMING;
-    status = setTime(block, "access", curTime);
-    if (status < 0) return status;
+    // Read the data
+    int count = read_data(m, block, buffer, size, offset);
+    if (count < 0) return count;
 
-    // Write inode block
-    status = writeBlock(curDisk, resourceTable[idx]->inode, block);
+    // Update the access time once for the whole read
+    status = it_access(m, file->inode, block);
     if (status < 0) return status;
 
-    // Get the size of the data
-    int size = get_fileSize(idx);
-    if (size < 0) return size;
-
-    // Check that file pointer is within range
-    if (resourceTable[idx]->filePointer > size || resourceTable[idx]->filePointer < 0) return ERR_RSEEKISSUE;
+    return count;
+}
 
-    // Set the block number and offset
-    int blockNum = floor(resourceTable[idx]->filePointer / DATASIZE);
-    int offset = resourceTable[idx]->filePointer % DATASIZE;
+// Read up to size bytes from a file starting at offset into the buffer, leaving the file pointer alone
+// Return the number of bytes read (0 at the end of the file) on success or error code on failure
+int tfs_pread(fileDescriptor FD, char *buffer, int size, int offset) {
+    int inode;
+    Mount *m = file_enter(FD, 0, 0, &inode);
+    int status = m ? pread_file(FD, buffer, size, offset) : inode;
+    file_leave(m, inode, 0, 0);
+    return status;
+}
 
-    // Get to the right block
-    for (i = 0; i < blockNum + 1; i++) {
-        status = readBlock(curDisk, block[2], block);
-        if (status < 0) return status;
-        if (block[0] != FILEEXTENT) return ERR_BLOCKFORMAT;
+// Given an inode block, grow its file by num blocks, extending its last extent in place when the blocks after it are free
+// Return 0 on success or error code on failure
+int grow_extents(Mount *m, char *inodeBlock, int num) {
+    // Init variables
+    int i, status, grown = 0, end = 0;
+    Extent extents[MAXEXTENTS * 2];
+    int numExtents = get_extents(inodeBlock, extents);
+
+    // Take the free blocks right after the last extent
+    if (numExtents) {
+        end = extents[numExtents - 1].start + extents[numExtents - 1].length;
+        pthread_mutex_lock(&m->allocLock);
+        while (grown < num && end + grown < m->numBlocks && !(bm_taken(m, (end + grown) / 64, 1) >> ((end + grown) % 64) & 1)) grown++;
+        if (grown) {
+            int lastWord = bm_setRun(m->blockMap, end, grown, 1);
+            status = bm_write(m, end / 64, lastWord);
+        }
+        pthread_mutex_unlock(&m->allocLock);
+        if (grown) {
+            if (status < 0) return status;
+            extents[numExtents - 1].length += grown;
+        }
     }
 
-    // Read byte based on offset
-    *buffer = block[4 + offset];
+    // Allocate the rest in new extents, merging the first one if it happens to continue the last extent
+    if (grown < num) {
+        int numAdded = alloc_extents(m, num - grown, extents + numExtents);
+        int merge = numAdded > 0 && numExtents && extents[numExtents].start == extents[numExtents - 1].start + extents[numExtents - 1].length;
+
+        // Out of space or the inode can't hold that many extents, give back everything we took
+        if (numAdded < 0 || numExtents + numAdded - merge > MAXEXTENTS) {
+            if (numAdded > 0) free_extents(m, extents + numExtents, numAdded);
+            if (grown) {
+                extents[numExtents].start = end;
+                extents[numExtents].length = grown;
+                free_extents(m, extents + numExtents, 1);
+            }
+            return numAdded < 0 ? numAdded : ERR_FULLDISK;
+        }
 
-    // Increment file pointer
-    resourceTable[idx]->filePointer++;
+        if (merge) {
+            extents[numExtents - 1].length += extents[numExtents].length;
+            for (i = numExtents; i < numExtents + numAdded - 1; i++) extents[i] = extents[i + 1];
+            numAdded--;
+        }
+        numExtents += numAdded;
+    }
+
+    // Store the extents
+    set_extents(inodeBlock, extents, numExtents);
 
     // Finished successfully
     return 0;
 }
 
-// Write a byte into a file at its pointer and increment the pointer
-// Return 0 on success or error code on failure
-int tfs_writeByte(fileDescriptor FD, unsigned int data) {
+// Given an inode block, its extents before grow_extents added to them, and how many there were, free the blocks that
+// were added and put the old extents back
+void ungrow_extents(Mount *m, char *inodeBlock, Extent *oldExtents, int numOld) {
     // Init variables
-    int i;
+    Extent extents[MAXEXTENTS];
+    int numExtents = get_extents(inodeBlock, extents);
 
-    // PRINT TESTING
-    // printf("tfs_readByte\n");
+    // The blocks added to the old last extent, then every extent after it
+    if (numOld && extents[numOld - 1].length > oldExtents[numOld - 1].length) {
+        Extent tail = {oldExtents[numOld - 1].start + oldExtents[numOld - 1].length, extents[numOld - 1].length - oldExtents[numOld - 1].length};
+        free_extents(m, &tail, 1);
+    }
+    if (numExtents > numOld) free_extents(m, extents + numOld, numExtents - numOld);
+
+    set_extents(inodeBlock, oldExtents, numOld);
+}
+
+// Given an inode block, a buffer, size, offset, and the file's size before the write, write the bytes into the file's
+// blocks starting at offset, which already has blocks for all of them
+// Return the number of bytes written on success or error code on failure
+int pwrite_data(Mount *m, char *inodeBlock, char *buffer, int size, int offset, int fileSize) {
+    // Init variables
+    int i, status;
+    int oldBlocks = (fileSize + DATASIZE - 1) / DATASIZE;
+
+    // Blocks of the file holding the first and last byte
+    int firstIdx = offset / DATASIZE;
+    int lastIdx = (offset + size - 1) / DATASIZE;
+
+    // Find every block's number
+    int numBlocks = lastIdx - firstIdx + 1;
+    int *blockNums = malloc((size_t) numBlocks * sizeof(int));
+    if (!blockNums) return ERR_NOMEMORY;
+    status = get_blockNums(inodeBlock, firstIdx, lastIdx, blockNums);
+    if (status < 0) {
+        free(blockNums);
+        return status;
+    }
+
+    // Start every block empty, then read the old contents of the first and last block if they're only partly overwritten
+    char *blocks = malloc((size_t) numBlocks * BLOCKSIZE);
+    if (!blocks) {
+        free(blockNums);
+        return ERR_NOMEMORY;
+    }
+    for (i = 0; i < numBlocks; i++) {
+        create_block(blocks + (size_t) i * BLOCKSIZE, FILEEXTENT, NULL, 0);
+    }
+    int edgeNums[2], edgeIdx[2], numEdges = 0;
+    if (firstIdx < oldBlocks && (offset % DATASIZE || (firstIdx == lastIdx && (offset + size) % DATASIZE && offset + size < fileSize))) {
+        edgeIdx[numEdges] = 0;
+        edgeNums[numEdges++] = blockNums[0];
+    }
+    if (lastIdx != firstIdx && lastIdx < oldBlocks && (offset + size) % DATASIZE && offset + size < fileSize) {
+        edgeIdx[numEdges] = numBlocks - 1;
+        edgeNums[numEdges++] = blockNums[numBlocks - 1];
+    }
+    for (i = 0; i < numEdges; i++) {
+        status = readBlock(m->disk, edgeNums[i], blocks + (size_t) edgeIdx[i] * BLOCKSIZE);
+        if (status >= 0 && blocks[(size_t) edgeIdx[i] * BLOCKSIZE] != FILEEXTENT) status = ERR_BLOCKFORMAT;
+        if (status < 0) {
+            free(blockNums);
+            free(blocks);
+            return status;
+        }
+    }
+
+    // Copy the data into each block's payload and write the blocks
+    int copied = 0;
+    for (i = 0; i < numBlocks; i++) {
+        int start = i == 0 ? offset % DATASIZE : 0;
+        int length = DATASIZE - start < size - copied ? DATASIZE - start : size - copied;
+        memcpy(blocks + (size_t) i * BLOCKSIZE + 4 + start, buffer + copied, length);
+        copied += length;
+    }
+    status = writeBlocks(m->disk, blockNums, numBlocks, blocks);
+    free(blockNums);
+    free(blocks);
+    if (status < 0) return status;
+
+    return copied;
+}
 
+// Body of tfs_pwrite, run with the file's inode lock held for writing
+int pwrite_file(fileDescriptor FD, char *buffer, int size, int offset) {
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
     // Check that we have write permissions
-    if (!resourceTable[idx]->rw) return ERR_READONLY;
+    if (!file->rw) return ERR_READONLY;
+    int inode = file->inode;
 
     // Read inode block
-    char block[BLOCKSIZE];
-    int status = readBlock(curDisk, resourceTable[idx]->inode, block);
+    char inodeBlock[BLOCKSIZE];
+    int status = md_read(m, inode, inodeBlock);
     if (status < 0) return status;
 
-    // Update the inode block's modification and access time
-    time_t curTime;
-    if (time(&curTime) == -1) return ERR_TIMING;
-    status = setTime(block, "access", curTime);
-    if (status < 0) return status;
-    status = setTime(block, "access", curTime);
-    if (status < 0) return status;
-
-    // Write inode block
-    status = writeBlock(curDisk, resourceTable[idx]->inode, block);
-    if (status < 0) return status;
-
-    // Get the size of the data
-    int size = get_fileSize(idx);
-    if (size < 0) return size;
+    // Check that the write starts inside the file or right at its end, and that its end fits in an int
+    int fileSize = get_inodeSize(inodeBlock);
+    if (offset < 0 || size < 0 || offset > fileSize || size > INT_MAX - offset) return ERR_OUTOFBOUNDS;
+    if (!size) return 0;
+
+    // Add blocks if the write goes past the end of the file, remembering the old extents to give them back on failure
+    Extent oldExtents[MAXEXTENTS];
+    int numOld = get_extents(inodeBlock, oldExtents);
+    int oldBlocks = (fileSize + DATASIZE - 1) / DATASIZE;
+    int newSize = offset + size > fileSize ? offset + size : fileSize;
+    int newBlocks = (newSize + DATASIZE - 1) / DATASIZE;
+    if (newBlocks > oldBlocks) {
+        status = grow_extents(m, inodeBlock, newBlocks - oldBlocks);
+        if (status < 0) return status;
+    }
 
-    // Check that file pointer is within range
-    if (resourceTable[idx]->filePointer > size || resourceTable[idx]->filePointer < 0) return ERR_RSEEKISSUE;
+    // Write the data, then the inode block only if the file grew
+    int copied = pwrite_data(m, inodeBlock, buffer, size, offset, fileSize);
+    if (copied >= 0 && newSize != fileSize) {
+        set_inodeSize(inodeBlock, newSize);
+        status = md_write(m, inode, inodeBlock);
+        if (status < 0) copied = status;
+    }
 
-    // Set the block number and offset
-    int diskBlock = 0;
-    int blockNum = floor(resourceTable[idx]->filePointer / DATASIZE);
-    int offset = resourceTable[idx]->filePointer % DATASIZE;
-
-    // Get to the right block
-    for (i = 0; i < blockNum + 1; i++) {
-        diskBlock = block[2];
-        status = readBlock(curDisk, block[2], block);
-        if (status < 0) return status;
-        if (block[0] != FILEEXTENT) return ERR_BLOCKFORMAT;
+    // Cursors on the file, and a defrag copy of it, may hold blocks that just changed
+    cursor_invalidate(m, inode);
+    df_touch(m, inode);
+    if (copied < 0) {
+        if (newBlocks > oldBlocks) ungrow_extents(m, inodeBlock, oldExtents, numOld);
+        return copied;
     }
 
-    // Write byte based on offset
-    block[4 + offset] = data;
-    // Write block back to the disk
-    status = writeBlock(curDisk, diskBlock, block);
+    // Update the file's modification and access time
+    status = it_modify(m, inode, inodeBlock);
     if (status < 0) return status;
 
-    // Increment file pointer
-    resourceTable[idx]->filePointer++;
+    return copied;
+}
 
-    // Finished successfully
-    return 0;
+// Write size bytes from the buffer into a file starting at offset, leaving the file pointer alone
+// Only the blocks holding those bytes are written, and new blocks are added only when the write goes past the end of the file
+// Return the number of bytes written on success or error code on failure
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset) {
+    int inode, status, retried = 0;
+    Mount *m;
+    do {
+        m = file_enter(FD, 1, 0, &inode);
+        status = m ? pwrite_file(FD, buffer, size, offset) : inode;
+        file_leave(m, inode, 1, 0);
+    } while (!retried++ && tx_retry(m, status));
+    return status;
 }
 
-// Change the file pointer location to the offset (absolute)
-// Return 0 on success or error code on failure
-int tfs_seek(fileDescriptor FD, int offset) {
+// Body of tfs_seek, run with the file's inode lock held for reading
+int seek_file(fileDescriptor FD, int offset) {
     // PRINT TESTING
     // printf("tfs_seek\n");
 
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
 
     // Get the size of the data
     int size = get_fileSize(idx);
@@ -790,157 +3178,590 @@ int tfs_seek(fileDescriptor FD, int offset) {
     if (offset < 0 || offset >= size) return ERR_OUTOFBOUNDS;
 
     // Change the file pointer location
-    resourceTable[idx]->filePointer = offset;
+    file->filePointer = offset;
 
     // Finished successfully
     return 0;
 }
 
-// Display a map of the free and occupied blocks in the disk
+// Change the file pointer location to the offset (absolute)
+// Return 0 on success or error code on failure
+int tfs_seek(fileDescriptor FD, int offset) {
+    int inode;
+    Mount *m = file_enter(FD, 0, 0, &inode);
+    int status = m ? seek_file(FD, offset) : inode;
+    file_leave(m, inode, 0, 0);
+    return status;
+}
+
+// Given a mount handle, display a map of the free and occupied blocks in its disk
+void tfsm_displayFragments(mountHandle mh) {
+    Mount *m = mount_get(mh);
+    if (!m) return;
+
+    fs_enter(m, 0);
+    if (m->disk >= 0) {
+        pthread_mutex_lock(&m->allocLock);
+        print_disk(m, 0);
+        pthread_mutex_unlock(&m->allocLock);
+    }
+    fs_leave(m);
+}
+
+// Display a map of the free and occupied blocks in the disk tfs_mount mounted
 void tfs_displayFragments() {
-    print_disk(curDisk, NUM_BLOCKS, 0);
+    tfsm_displayFragments(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE));
+}
+
+// Compare two ints for qsort
+int int_cmp(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
 }
 
-// Move all the blocks so that the free blocks are continuous at the end of the disk
+// Given a mount, start a defrag pass over every file on its disk, in the order of their inode blocks
+// The caller holds dfLock
 // Return 0 on success or error code on failure
-int tfs_defrag() {
+int df_begin(Mount *m) {
+    // Init variables
+    int i, count = 0;
+    NameEntry *entry;
+
+    // Take the inode block of every file in the name index, and make the map of blocks copies are written to
+    fs_enter(m, 0);
+    pthread_rwlock_rdlock(&m->nameLock);
+    int *inodes = malloc((m->indexCount + 1) * sizeof(int));
+    for (i = 0; inodes && i < m->indexBuckets; i++) {
+        for (entry = m->nameIndex[i]; entry; entry = entry->next) {
+            inodes[count++] = entry->inode;
+        }
+    }
+    pthread_rwlock_unlock(&m->nameLock);
+    uint64_t *map = calloc(m->mapWords, sizeof(uint64_t));
+    if (inodes && map) {
+        pthread_mutex_lock(&m->allocLock);
+        m->dfMap = map;
+        pthread_mutex_unlock(&m->allocLock);
+    }
+    fs_leave(m);
+    if (!inodes || !map) {
+        free(inodes);
+        free(map);
+        return ERR_NOMEMORY;
+    }
+    qsort(inodes, count, sizeof(int), int_cmp);
+
+    m->dfCount = count;
+    m->dfNext = 0;
+    pthread_mutex_lock(&m->dfStatsLock);
+    m->dfInodes = inodes;
+    memset(&m->dfStats, 0, sizeof(DefragStats));
+    m->dfStats.files = count;
+    pthread_mutex_unlock(&m->dfStatsLock);
+
+    // Finished successfully
+    return 0;
+}
+
+// Given a mount, give back the runs of the file being copied and forget its copy
+// The caller holds dfLock and the file's inode lock for writing
+void df_drop(Mount *m) {
+    // Init variables
+    int i;
+
+    pthread_mutex_lock(&m->allocLock);
+    for (i = 0; i < m->dfToCount; i++) {
+        bm_setRun(m->dfMap, m->dfTo[i].start, m->dfTo[i].length, 0);
+    }
+    pthread_mutex_unlock(&m->allocLock);
+    m->dfFromCount = 0;
+    m->dfToCount = 0;
+    m->dfCopied = 0;
+    __atomic_store_n(&m->dfChanged, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->dfInode, 0, __ATOMIC_RELAXED);
+}
+
+// Given a mount, an inode block number, the file's extents, how many there are, and its number of blocks, start copying
+// the file into free runs, as few as possible and fewer than it has extents. The runs are only marked in dfMap, so the
+// bitmap on the disk never has them in use until the inode points at them
+// The caller holds dfLock and the file's inode lock for writing
+// Return 0 on success or error code on failure
+int df_reserve(Mount *m, int inode, Extent *extents, int numExtents, int total) {
+    pthread_mutex_lock(&m->allocLock);
+    int numRuns = take_runs(m, total, numExtents - 1, m->dfMap, m->dfTo);
+    pthread_mutex_unlock(&m->allocLock);
+    if (numRuns < 0) return numRuns;
+
+    memcpy(m->dfFrom, extents, numExtents * sizeof(Extent));
+    m->dfFromCount = numExtents;
+    m->dfToCount = numRuns;
+    m->dfCopied = 0;
+    __atomic_store_n(&m->dfChanged, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->dfInode, inode, __ATOMIC_RELAXED);
+
+    // Finished successfully
+    return 0;
+}
+
+// Given a mount whose file has been copied whole and the file's inode block, mark the runs it was copied into as used,
+// point the inode at them, and free its old extents, which stay pinned until the move is committed
+// The caller holds dfLock and the file's inode lock for writing
+// Return 0 on success or error code on failure
+int df_relink(Mount *m, char *inodeBlock) {
+    // Init variables
+    int i, status = 0;
+    int inode = m->dfInode;
+
+    pthread_mutex_lock(&m->allocLock);
+    for (i = 0; i < m->dfToCount && status >= 0; i++) {
+        bm_setRun(m->dfMap, m->dfTo[i].start, m->dfTo[i].length, 0);
+        int lastWord = bm_setRun(m->blockMap, m->dfTo[i].start, m->dfTo[i].length, 1);
+        status = bm_write(m, m->dfTo[i].start / 64, lastWord);
+    }
+    pthread_mutex_unlock(&m->allocLock);
+    if (status >= 0) {
+        set_extents(inodeBlock, m->dfTo, m->dfToCount);
+        status = md_write(m, inode, inodeBlock);
+    }
+
+    // Give the runs back if the inode couldn't be pointed at them, otherwise free the old extents
+    if (status < 0) {
+        free_extents(m, m->dfTo, i);
+        df_drop(m);
+        return status;
+    }
+    free_extents(m, m->dfFrom, m->dfFromCount);
+    cursor_invalidate(m, inode);
+    m->dfToCount = 0;
+    df_drop(m);
+
+    // Finished successfully
+    return 0;
+}
+
+// Given a mount, an inode block number, the most blocks to copy (at least 1), and a buffer of DEFRAG_CHUNK blocks, carry
+// on moving the file into fewer extents, copying at most one chunk with the file's lock held. The first call for a file
+// takes the runs it's copied into and the call that copies its last block points the inode at them, so in between the
+// file stays usable and the copy carries on across steps. Each call checks the file's extents against the ones the copy
+// started from, and a copy whose file was written, moved, or deleted starts over, up to DEFRAG_RESTARTS times. The
+// file's inode stays where it is, so descriptors open on it keep working
+// Sets *done once the file is moved or left alone
+// Return the number of blocks copied on success or error code on failure
+int defrag_chunk(Mount *m, int inode, int maxBlocks, char *buffer, int *done) {
     // Init variables
-    int i, status, pointer = 0;
-    char blockList[NUM_BLOCKS][256];
+    int i, n = 0, status, total = 0, leave = 0;
+    int oldNums[DEFRAG_CHUNK], newNums[DEFRAG_CHUNK];
+    Extent extents[MAXEXTENTS];
     char block[BLOCKSIZE];
 
-    // Iterate through every block and save the inode/file extent blocks
-    for (i = 0; i < NUM_BLOCKS; i++) {
-        // Read the block
-        status = readBlock(curDisk, i, block);
-        if (status < 0) return status;
+    fs_enter(m, 0);
+    status = m->disk < 0 ? ERR_CANNOTFNDDISK : tx_reserve(m);
+    if (status < 0) {
+        fs_leave(m);
+        return status;
+    }
 
-        // Check if an inode block
-        if (block[0] == INODE) {
-            // Add it to the block list
-            memcpy(blockList[pointer++], block, BLOCKSIZE);
+    // Check that the block is still the inode of a file, the name lock keeps it from being deleted until we have its lock
+    pthread_rwlock_rdlock(&m->nameLock);
+    il_lock(m, inode, 1);
+    status = md_read(m, inode, block);
+    int exists = status >= 0 && block[0] == INODE && block_used(m, inode) && ni_find(m, block + 4) == inode;
+    pthread_rwlock_unlock(&m->nameLock);
+    int numExtents = exists ? get_extents(block, extents) : 0;
+    for (i = 0; i < numExtents; i++) {
+        total += extents[i].length;
+    }
 
-            // Iterate through file extent blocks
-            while (block[2]) {
-                // Read file extent block
-                status = readBlock(curDisk, block[2], block);
-                if (status < 0) return status;
+    // Start the copy over if the file changed since it started
+    if (status >= 0 && m->dfInode == inode && (__atomic_load_n(&m->dfChanged, __ATOMIC_RELAXED) || numExtents != m->dfFromCount ||
+                                               memcmp(extents, m->dfFrom, numExtents * sizeof(Extent)))) {
+        df_drop(m);
+        m->dfRestarts++;
+    }
 
-                // Add it to the block list
-                memcpy(blockList[pointer++], block, BLOCKSIZE);
+    // Leave files that are gone, already in one extent, or keep changing, and take the runs for any other
+    if (status >= 0 && m->dfInode != inode) {
+        if (numExtents <= 1 || m->dfRestarts > DEFRAG_RESTARTS) {
+            pthread_mutex_lock(&m->dfStatsLock);
+            if (numExtents <= 1) {
+                m->dfStats.skipped++;
+            } else {
+                m->dfStats.busy++;
             }
+            pthread_mutex_unlock(&m->dfStatsLock);
+            *done = 1;
+            leave = 1;
+        } else {
+            status = df_reserve(m, inode, extents, numExtents, total);
         }
     }
 
-    // Reinit the disk
-    status = initDisk(curDisk);
-    if (status < 0) return status;
+    // Copy the next chunk
+    if (status >= 0 && !leave) {
+        n = total - m->dfCopied;
+        if (n > DEFRAG_CHUNK) n = DEFRAG_CHUNK;
+        if (n > maxBlocks) n = maxBlocks;
+        status = run_blockNums(m->dfFrom, m->dfFromCount, m->dfCopied, m->dfCopied + n - 1, oldNums);
+    }
+    if (status >= 0 && n) status = run_blockNums(m->dfTo, m->dfToCount, m->dfCopied, m->dfCopied + n - 1, newNums);
+    if (status >= 0 && n) status = readBlocks(m->disk, oldNums, n, buffer);
+    if (status >= 0 && n) status = writeBlocks(m->disk, newNums, n, buffer);
+    if (status >= 0 && n) {
+        m->dfCopied += n;
+        pthread_mutex_lock(&m->dfStatsLock);
+        m->dfStats.copied += n;
+        pthread_mutex_unlock(&m->dfStatsLock);
+    }
 
-    // Get the number of free blocks we need to set
-    int buffer[pointer];
-    status = fbc_get(pointer, buffer);
-    if (status < 0) return status;
+    // Once the whole file is copied, move it
+    if (status >= 0 && n && m->dfCopied == total) {
+        status = df_relink(m, block);
+        if (status >= 0) {
+            pthread_mutex_lock(&m->dfStatsLock);
+            m->dfStats.moved++;
+            m->dfStats.blocks += total;
+            pthread_mutex_unlock(&m->dfStatsLock);
+            *done = 1;
+        }
+    }
+    il_unlock(m, inode);
+    tx_release(m);
+    wb_note(m);
+    fs_leave(m);
 
-    // Create and write every inode/file extent block to the disk
-    for (i = 0; i < pointer; i++) {
-        // Next block is an inode block or it's the last file extent block, set the link to 0
-        if (blockList[i + 1][0] == INODE || i == pointer - 1) {
-            blockList[i][2] = 0;
-        } else {
-            blockList[i][2] = i + 2;
+    return status < 0 ? status : n;
+}
+
+// Given a mount, commit its open transaction so the blocks defragmenting freed can be handed out again
+// Return 0 on success or error code on failure
+int df_commit(Mount *m) {
+    fs_enter(m, 1);
+    int status = m->disk >= 0 ? tx_commit(m) : ERR_CANNOTFNDDISK;
+    fs_leave(m);
+    return status;
+}
+
+// Given a mount, the most blocks to copy (0 for no limit), and the most milliseconds to spend (0 for no limit), carry on
+// with its defrag pass, starting one if none is running. The budget is checked after every chunk, and a file whose copy
+// doesn't fit in it carries on in the next step from where this one stopped. The caller holds dfLock
+// Return 1 if the pass has more files to look at, 0 if it's finished, or error code on failure
+int defrag_step(Mount *m, int maxBlocks, int maxMs) {
+    // Init variables
+    int status = 0, copied = 0, chunks = 0, retried = 0, done;
+    int64_t until = wb_now() + (int64_t) maxMs * 1000000;
+
+    if (!m->dfInodes) status = df_begin(m);
+    char *buffer = status < 0 ? NULL : malloc(DEFRAG_CHUNK * BLOCKSIZE);
+    if (!buffer) return status < 0 ? status : ERR_NOMEMORY;
+
+    while (m->dfNext < m->dfCount) {
+        if ((maxBlocks && copied >= maxBlocks) || (maxMs && chunks && wb_now() >= until)) break;
+
+        done = 0;
+        status = defrag_chunk(m, m->dfInodes[m->dfNext], maxBlocks ? maxBlocks - copied : DEFRAG_CHUNK, buffer, &done);
+        chunks++;
+
+        // No runs can hold it, unless committing frees the blocks this pass has moved files out of
+        if (status == ERR_FULLDISK && !retried && m->pinMap) {
+            retried = 1;
+            status = df_commit(m);
+            if (status >= 0) continue;
         }
-        // Write the block to the disk
-        status = writeBlock(curDisk, i + 1, blockList[i]);
-        if (status < 0) return status;
+        if (status < 0 && status != ERR_FULLDISK) break;
+        if (status >= 0) copied += status;
+        if (status >= 0 && !done) continue;
+
+        // On to the next file
+        pthread_mutex_lock(&m->dfStatsLock);
+        if (status == ERR_FULLDISK) m->dfStats.noRoom++;
+        m->dfStats.done++;
+        pthread_mutex_unlock(&m->dfStatsLock);
+        status = 0;
+        retried = 0;
+        m->dfRestarts = 0;
+        m->dfNext++;
     }
+    free(buffer);
+    if (status < 0) return status;
+    if (m->dfNext < m->dfCount) return 1;
+
+    // Finished the pass, commit the moves so their old blocks can be used again
+    fs_enter(m, 0);
+    pthread_mutex_lock(&m->allocLock);
+    free(m->dfMap);
+    m->dfMap = NULL;
+    pthread_mutex_unlock(&m->allocLock);
+    fs_leave(m);
+    pthread_mutex_lock(&m->dfStatsLock);
+    free(m->dfInodes);
+    m->dfInodes = NULL;
+    pthread_mutex_unlock(&m->dfStatsLock);
+    status = df_commit(m);
+    if (status < 0) return status;
 
     // Finished successfully
     return 0;
 }
 
-// Given a filename, make it readonly
+// Given a mount handle, the most blocks to move (0 for no limit), and the most milliseconds to spend (0 for no limit),
+// carry on with its disk's defrag pass, starting one if none is running. Files are moved into fewer extents one at a time
+// while the rest of the disk stays usable, and files already in one extent are skipped
+// Return 1 if the pass has more files to look at, 0 if it's finished, or error code on failure
+int tfsm_defragStep(mountHandle mh, int maxBlocks, int maxMs) {
+    if (maxBlocks < 0 || maxMs < 0) return ERR_OUTOFBOUNDS;
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
+    pthread_mutex_lock(&m->dfLock);
+    int status = __atomic_load_n(&m->disk, __ATOMIC_ACQUIRE) >= 0 ? defrag_step(m, maxBlocks, maxMs) : ERR_CANNOTFNDDISK;
+    pthread_mutex_unlock(&m->dfLock);
+    return status;
+}
+
+// Carry on with the defrag pass of the disk tfs_mount mounted
+// Return 1 if the pass has more files to look at, 0 if it's finished, or error code on failure
+int tfs_defragStep(int maxBlocks, int maxMs) {
+    return tfsm_defragStep(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), maxBlocks, maxMs);
+}
+
+// Given a mount handle, move every file on its disk that's in more than one extent into as few as the free runs allow, finishing any pass
+// that's already running
 // Return 0 on success or error code on failure
-int tfs_makeRO(char *name) {
+int tfsm_defrag(mountHandle mh) {
+    int status = tfsm_defragStep(mh, 0, 0);
+    return status < 0 ? status : 0;
+}
+
+// Defragment the disk tfs_mount mounted
+// Return 0 on success or error code on failure
+int tfs_defrag() {
+    return tfsm_defrag(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE));
+}
+
+// Body of a mount's defrag thread. It runs steps of dfBlocks blocks dfPause milliseconds apart until the pass is done
+void *df_thread(void *arg) {
+    Mount *m = arg;
+
+    pthread_mutex_lock(&m->dfLock);
+    while (!m->dfStop && defrag_step(m, m->dfBlocks, 0) > 0) {
+        int64_t due = wb_now() + (int64_t) m->dfPause * 1000000;
+        struct timespec wake = {due / 1000000000, due % 1000000000};
+        while (!m->dfStop && wb_now() < due) pthread_cond_timedwait(&m->dfCond, &m->dfLock, &wake);
+    }
+    pthread_mutex_unlock(&m->dfLock);
+
+    return NULL;
+}
+
+// Given a mount handle, run its disk's defrag pass from a background thread, moving at most maxBlocks blocks at a time
+// and waiting pauseMs milliseconds in between so other I/O gets the disk. A maxBlocks of 0 stops the thread, leaving
+// the pass where it got to
+// Return 0 on success or error code on failure
+int tfsm_defragBackground(mountHandle mh, int maxBlocks, int pauseMs) {
+    if (maxBlocks < 0 || pauseMs < 0) return ERR_OUTOFBOUNDS;
+
+    pthread_mutex_lock(&mountLock);
+    Mount *m = mount_get(mh);
+    if (!m) {
+        pthread_mutex_unlock(&mountLock);
+        return ERR_CANNOTFNDDISK;
+    }
+
+    // Stop the old thread and start the new one
+    int status = 0;
+    df_stop(m);
+    m->dfBlocks = maxBlocks;
+    m->dfPause = pauseMs;
+    if (maxBlocks) {
+        if (pthread_create(&m->dfThread, NULL, df_thread, m)) {
+            status = ERR_NOMEMORY;
+        } else {
+            m->dfRunning = 1;
+        }
+    }
+    pthread_mutex_unlock(&mountLock);
+    return status;
+}
+
+// Defragment the disk tfs_mount mounted from a background thread
+// Return 0 on success or error code on failure
+int tfs_defragBackground(int maxBlocks, int pauseMs) {
+    return tfsm_defragBackground(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), maxBlocks, pauseMs);
+}
+
+// Given a mount handle and somewhere to put them, get the stats of its disk's running defrag pass, or of the last one
+// Return 1 if a pass is running, 0 if not, or error code on failure
+int tfsm_defragProgress(mountHandle mh, DefragStats *stats) {
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
+    pthread_mutex_lock(&m->dfStatsLock);
+    *stats = m->dfStats;
+    int running = m->dfInodes != NULL;
+    pthread_mutex_unlock(&m->dfStatsLock);
+    return running;
+}
+
+// Get the stats of the defrag pass of the disk tfs_mount mounted
+// Return 1 if a pass is running, 0 if not, or error code on failure
+int tfs_defragProgress(DefragStats *stats) {
+    return tfsm_defragProgress(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), stats);
+}
+
+// Given a mount handle and a filename on its disk, make the file readonly
+// Return 0 on success or error code on failure
+int tfsm_makeRO(mountHandle mh, char *name) {
     // Init variables
-    int i;
-    
+    int found = 0;
+    FileDetails *file;
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
     // Find the file
-    for (i = 0; i < NUM_BLOCKS - 1; i++) {
-        // Entry exists
-        if (resourceTable[i]) {
-            // Correct file
-            if (!strcmp(resourceTable[i]->name, name)) {
-                // Set the bit to readonly
-                resourceTable[i]->rw = 0;
-                return 0;
+    fs_enter(m, 0);
+    pthread_rwlock_rdlock(&m->nameLock);
+    int inode = m->disk >= 0 ? ni_find(m, name) : ERR_NOFILE;
+
+    // Set the bit to readonly on every descriptor open on it, holding off writes to it meanwhile
+    if (inode >= 0) {
+        il_lock(m, inode, 1);
+        pthread_mutex_lock(&openLock);
+        for (file = of_bucket(m, inode); file; file = file->inodeNext) {
+            if (file->inode == inode) {
+                file->rw = 0;
+                found = 1;
             }
         }
+        pthread_mutex_unlock(&openLock);
+        il_unlock(m, inode);
     }
+    pthread_rwlock_unlock(&m->nameLock);
+    fs_leave(m);
 
     // Couldn't find file
-    return ERR_NOFILE;
+    if (!found) return ERR_NOFILE;
+
+    // Finished successfully
+    return 0;
 }
 
-// Given a filename, make it readwrite
+// Given a filename on the disk tfs_mount mounted, make it readonly
 // Return 0 on success or error code on failure
-int tfs_makeRW(char *name) {
+int tfs_makeRO(char *name) {
+    return tfsm_makeRO(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), name);
+}
+
+// Given a mount handle and a filename on its disk, make the file readwrite
+// Return 0 on success or error code on failure
+int tfsm_makeRW(mountHandle mh, char *name) {
     // Init variables
-    int i;
-    
+    int found = 0;
+    FileDetails *file;
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
+
     // Find the file
-    for (i = 0; i < NUM_BLOCKS - 1; i++) {
-        // Entry exists
-        if (resourceTable[i]) {
-            // Correct file
-            if (!strcmp(resourceTable[i]->name, name)) {
-                // Set the bit to readwrite
-                resourceTable[i]->rw = 1;
-                return 0;
+    fs_enter(m, 0);
+    pthread_rwlock_rdlock(&m->nameLock);
+    int inode = m->disk >= 0 ? ni_find(m, name) : ERR_NOFILE;
+
+    // Set the bit to readwrite on every descriptor open on it, holding off writes to it meanwhile
+    if (inode >= 0) {
+        il_lock(m, inode, 1);
+        pthread_mutex_lock(&openLock);
+        for (file = of_bucket(m, inode); file; file = file->inodeNext) {
+            if (file->inode == inode) {
+                file->rw = 1;
+                found = 1;
             }
         }
+        pthread_mutex_unlock(&openLock);
+        il_unlock(m, inode);
     }
+    pthread_rwlock_unlock(&m->nameLock);
+    fs_leave(m);
 
     // Couldn't find file
-    return ERR_NOFILE;
+    if (!found) return ERR_NOFILE;
+
+    // Finished successfully
+    return 0;
 }
 
-// Given a file descriptor and new name, set the name of the file to that new name
+// Given a filename on the disk tfs_mount mounted, make it readwrite
 // Return 0 on success or error code on failure
-int tfs_rename(fileDescriptor FD, char *newName) {
+int tfs_makeRW(char *name) {
+    return tfsm_makeRW(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE), name);
+}
+
+// Body of tfs_rename, run with the name lock and the file's inode lock held for writing
+int rename_file(fileDescriptor FD, char *newName) {
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
     // Check that we have write permissions
-    if (!resourceTable[idx]->rw) return ERR_READONLY;
+    if (!file->rw) return ERR_READONLY;
 
     // Check that the name is has the correct length
     if (strlen(newName) > 8) return ERR_FILENAMELIMIT;
 
+    // Check that no other file has the name already
+    int existing = ni_find(m, newName);
+    if (existing >= 0 && existing != file->inode) return ERR_FILEEXISTS;
+
     // Read the inode block
     char block[BLOCKSIZE] = {0};
-    int status = readBlock(curDisk, resourceTable[idx]->inode, block);
+    int status = md_read(m, file->inode, block);
     if (status < 0) return status;
 
     // Write the name to the block
-    memcpy(block + 4, newName, NAMELENGTH);
+    char oldName[NAMELENGTH];
+    memcpy(oldName, block + 4, NAMELENGTH);
+    memset(block + 4, 0, NAMELENGTH);
+    memcpy(block + 4, newName, strlen(newName));
 
     // Write the block to the disk
-    status = writeBlock(curDisk, resourceTable[idx]->inode, block);
+    status = md_write(m, file->inode, block);
     if (status < 0) return status;
 
+    // Move the file to its new name in the name index, adding it before taking the old name out so the file can always
+    // be found. If it can't be added, put the old name back in the inode
+    status = ni_add(m, newName, file->inode);
+    if (status < 0) {
+        memcpy(block + 4, oldName, NAMELENGTH);
+        md_write(m, file->inode, block);
+        return status;
+    }
+    ni_remove(m, oldName);
+
     // Change the name in the resource table
-    resourceTable[idx]->name = newName;
+    memset(file->name, 0, NAMELENGTH);
+    memcpy(file->name, newName, strlen(newName));
 
     // Finished successfully
     return 0;
 }
 
-// Print out every file in the disk
+// Given a file descriptor and new name, set the name of the file to that new name
 // Return 0 on success or error code on failure
-int tfs_readdir() {
+int tfs_rename(fileDescriptor FD, char *newName) {
+    int inode;
+    Mount *m = file_enter(FD, 1, 1, &inode);
+    int status = m ? rename_file(FD, newName) : inode;
+    file_leave(m, inode, 1, 1);
+    return status;
+}
+
+// Given a mount handle, print out every file in its disk
+// Return 0 on success or error code on failure
+int tfsm_readdir(mountHandle mh) {
     // Init variables
     int i, status;
+    Mount *m = mount_get(mh);
+    if (!m) return ERR_CANNOTFNDDISK;
 
     // Print header
     printf("\nFILES\n");
@@ -948,25 +3769,38 @@ int tfs_readdir() {
     
     // Iterate through every block
     char block[BLOCKSIZE] = {0};
-    for (i = 1; i < NUM_BLOCKS - 1; i++) {
+    fs_enter(m, 0);
+    for (i = 1, status = 0; m->disk >= 0 && i < m->numBlocks && status >= 0; i++) {
+        // Only used blocks can be inodes
+        pthread_mutex_lock(&m->allocLock);
+        int used = block_used(m, i);
+        pthread_mutex_unlock(&m->allocLock);
+        if (!used) continue;
+
         // Read the block
-        status = readBlock(curDisk, i, block);
-        if (status < 0) return status;
+        status = md_read(m, i, block);
 
         // Check if an inode block
-        if (block[0] == INODE) {
+        if (status >= 0 && block[0] == INODE) {
             printf("%s\n", block + 4);
         }
     }
+    fs_leave(m);
+    if (status < 0) return status;
     printf("\n");
 
     // Finished successfully
     return 0;
 }
 
-// Given a file descriptor, print out the data of that file
+// Print out every file in the disk tfs_mount mounted
 // Return 0 on success or error code on failure
-int tfs_readFileInfo(fileDescriptor FD) {
+int tfs_readdir() {
+    return tfsm_readdir(__atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE));
+}
+
+// Body of tfs_readFileInfo, run with the file's inode lock held for reading
+int print_fileInfo(fileDescriptor FD) {
     // Init variables
     char timeStr[MAXTIMESTRING] = {0};
     time_t t;
@@ -974,38 +3808,35 @@ int tfs_readFileInfo(fileDescriptor FD) {
     // Get the resource table index of the open file
     int idx = get_file_idx(FD);
     if (idx < 0) return idx;
+    FileDetails *file = fd_get(idx);
+    Mount *m = file->mount;
 
     // Get the inode block of the file
     char block[BLOCKSIZE] = {0};
-    int status = readBlock(curDisk, resourceTable[idx]->inode, block);
+    int status = md_read(m, file->inode, block);
     if (status < 0) return status;
+    it_apply(m, file->inode, block);
 
     // Print out the data of the file
     printf("\nFILE INFORMATION\n");
     printf("-------------------------\n");
-    printf("Link: %d\n", block[2]);
+    printf("Extents:");
+    print_extents(block);
+    printf("\n");
 
     printf("Name: %s\n", block + 4);
     
-    printf("Size: ");
-    if (!block[13]) {
-        printf("0\n");
-    } else {
-        printf("%s\n", block + 13);
-    }
+    printf("Size: %llu\n", (unsigned long long) get_inodeSize(block));
 
-    t = getTime(block, "creation");
-    if (t < 0) return t;
+    t = get_inodeTime(block, INODE_CTIME).tv_sec;
     strftime(timeStr, MAXTIMESTRING, "%c", localtime(&t));
     printf("Creation Time:     %s\n", timeStr);
 
-    t = getTime(block, "modification");
-    if (t < 0) return t;
+    t = get_inodeTime(block, INODE_MTIME).tv_sec;
     strftime(timeStr, MAXTIMESTRING, "%c", localtime(&t));
     printf("Modification Time: %s\n", timeStr);
 
-    t = getTime(block, "access");
-    if (t < 0) return t;
+    t = get_inodeTime(block, INODE_ATIME).tv_sec;
     strftime(timeStr, MAXTIMESTRING, "%c", localtime(&t));
     printf("Access Time:       %s\n", timeStr);
     printf("-------------------------\n\n");
@@ -1013,3 +3844,13 @@ int tfs_readFileInfo(fileDescriptor FD) {
     // Finished successfully
     return 0;
 }
+
+// Given a file descriptor, print out the data of that file
+// Return 0 on success or error code on failure
+int tfs_readFileInfo(fileDescriptor FD) {
+    int inode;
+    Mount *m = file_enter(FD, 0, 0, &inode);
+    int status = m ? print_fileInfo(FD) : inode;
+    file_leave(m, inode, 0, 0);
+    return status;
+}
@@ -1,57 +1,310 @@
 #include "tinyFS.h"
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 
 #define SUPERBLOCK 1
 #define INODE 2
 #define FILEEXTENT 3
 #define FREEBLOCK 4
+#define BITMAP 5
+#define JOURNAL 6
 #define MAGIC 0x44
 #define DATASIZE 252
 #define READ 1
 #define WRITE 2
 #define READWRITE 3
-#define NUM_BLOCKS 40
 #define NAMELENGTH 9
 #define TIMELENGTH 11
 #define SIZELENGTH 6
 #define MAXTIMESTRING 26
+#define INODE_VERSION 1         /* layout of inode blocks, 0 is the old ASCII layout that mounting upgrades */
+#define FS_VERSION 1            /* layout of the superblock, 0 is from before it had a version, clean flag, and checksum */
+#define SB_VERSION 28           /* where the superblock keeps its version, clean flag, name table, and checksum */
+#define SB_CLEAN 32
+#define SB_FLAGS 33
+#define SB_NAMES 36
+#define SB_NAMESUM 40
+#define SB_CHECKSUM (BLOCKSIZE - 4)
+#define NO_NAMETABLE 0xFFFFFFFFu /* number of names when the disk was unmounted without a name table */
+#define FS_CHECKSUMS 0x01       /* superblock flag: the disk keeps a CRC32C of every block after its last block */
+#define NAMETABLE_ENTRIES (DATASIZE / 12)   /* files each name table block holds */
+#define INODE_SIZE 16
+#define INODE_CTIME 24
+#define INODE_MTIME 32
+#define INODE_ATIME 40
+#define OLD_SIZE 13
+#define OLD_CTIME 19
+#define OLD_MTIME 30
+#define OLD_ATIME 41
+#define BITMAPSTART 1
+#define BITMAP_BLOCKS(numBlocks) (((numBlocks) + DATASIZE * 8 - 1) / (DATASIZE * 8))
+#define MAP_WORDS(numBlocks) (((numBlocks) + 63) / 64)
+#define MAX_DISK_BLOCKS (INT_MAX / 64 * 64)    /* most blocks a file system can have, block numbers are ints in memory */
+#define OLD_NUM_BLOCKS 40       /* size of disks made before the superblock recorded it */
+#define JOURNAL_NUMS 20         /* where the block numbers start in the journal header */
+#define JOURNAL_ENTRIES ((BLOCKSIZE - JOURNAL_NUMS) / 4)    /* block numbers the journal header holds */
+#define JOURNAL_MORE (DATASIZE / 4)                         /* block numbers each journal block after a full header holds */
+#define JOURNAL_NUMBLOCKS(count) ((count) <= JOURNAL_ENTRIES ? 0 : ((count) - JOURNAL_ENTRIES + JOURNAL_MORE - 1) / JOURNAL_MORE)
+#define JOURNAL_COPIES(numBlocks) (BITMAP_BLOCKS(numBlocks) + JOURNAL_ENTRIES)  /* every bitmap block and JOURNAL_ENTRIES inodes */
+#define JOURNAL_BLOCKS(numBlocks) ((numBlocks) / 8 < 3 ? 0 : (numBlocks) / 8 < JOURNAL_ENTRIES + 1 ? (numBlocks) / 8 : \
+                                   1 + JOURNAL_NUMBLOCKS(JOURNAL_COPIES(numBlocks)) + JOURNAL_COPIES(numBlocks))
+#define TIMES_BUCKETS 64
+#define RT_CHUNK 1024           /* resource table slots added at a time */
+#define RT_CHUNKS 1024          /* most chunks the resource table can have */
+#define FILE_SLAB 64            /* resource table entries allocated at a time */
+#define RA_START 4              /* blocks a descriptor reads ahead the first time it reads sequentially */
+#define RA_MAX 32               /* most blocks a descriptor reads ahead */
+#define WB_MAX_CACHE 65536      /* most blocks tfsm_writeback grows a disk's cache to */
+#define DEFRAG_CHUNK 64         /* blocks defragmenting copies at a time */
+#define DEFRAG_RESTARTS 3       /* times a file's copy can start over because the file changed before it's left alone */
+#define OPEN_BUCKETS 64
+#define INODE_LOCKS 256         /* reader/writer locks shared out to inodes by block number */
+#define MAX_MOUNTS 256          /* most disks mounted at once */
+#define EXTENTCOUNT 52
+#define EXTENTSTART 56
+#define EXTENTLENGTH 8
+#define MAXEXTENTS ((BLOCKSIZE - EXTENTSTART) / EXTENTLENGTH)
+#define NAME_BUCKETS 64
+#define ATIME_STRICT 0          /* update the access time on every read */
+#define ATIME_RELATIME 1        /* only update it if it isn't newer than the modification time or is older than the atime age */
+#define ATIME_NOATIME 2         /* never update it on reads */
+#define DEFAULT_ATIME_AGE 86400
+#define MKFS_CHECKSUMS 0x01     /* tfs_mkfsOptions: check every block read against a checksum kept when it was written */
 
+/* A run of contiguous blocks holding part of a file */
+typedef struct Extent {
+    uint32_t start;
+    uint32_t length;
+} Extent;
+
+/* A filename in the in-memory name index and the inode block it lives at */
+typedef struct NameEntry {
+    char name[NAMELENGTH];
+    int inode;
+    struct NameEntry *next;
+} NameEntry;
+
+/* The times of an inode, cached so reads and writes only touch memory. Dirty times are written to the inode
+ * block when the file is closed, the disk is flushed, or it's unmounted */
+typedef struct InodeTimes {
+    int inode;
+    struct timespec access;
+    struct timespec modification;
+    int dirty;                  /* they're newer than the inode block on the disk */
+    struct InodeTimes *next;
+} InodeTimes;
+
+typedef int mountHandle;
+
+/* How far a defragmentation pass has got. A pass looks at every file that existed when it started */
+typedef struct DefragStats {
+    int files;                  /* files in the pass */
+    int done;                   /* files looked at so far */
+    int moved;                  /* files moved into fewer extents */
+    int skipped;                /* files that were already in one extent (or deleted before the pass got to them) */
+    int noRoom;                 /* files left alone because free runs couldn't hold them in fewer extents */
+    int busy;                   /* files left alone because they kept changing while they were copied */
+    int blocks;                 /* blocks of the files moved */
+    int copied;                 /* blocks copied, including copies that started over */
+} DefragStats;
+
+/* A mounted disk and everything cached about it. Slots are made the first time they're needed and reused after an
+ * unmount, never freed, so a descriptor's mount can always be looked at.
+ * Locks, always taken in this order: dfLock, fsLock, nameLock, an inode lock, then any of allocLock, the global openLock, or a times lock.
+ * dfStatsLock is only held while the defrag stats are read or changed, so tfsm_defragProgress never waits for a step.
+ * The dfInode copy is changed with dfLock and the file's inode lock held, dfMap with allocLock held */
+typedef struct Mount {
+    int disk;                   /* disk number, -1 while the slot is free */
+    int numBlocks;              /* geometry of the disk, from its superblock */
+    int mapWords;
+    uint64_t *blockMap;         /* in-memory copy of the disk's bitmap, bit set = block in use */
+    int allocHint;              /* map word the next allocation starts searching at */
+    NameEntry **nameIndex;      /* filename -> inode block of every file on the disk */
+    int indexBuckets;
+    int indexCount;
+    InodeTimes *inodeTimes[TIMES_BUCKETS];  /* cached times of inodes on the disk, hashed by inode block */
+    struct FileDetails **openFiles;         /* files open on the disk hashed by inode block, guarded by openLock */
+    int openBuckets;
+    int openCount;
+    int atimePolicy;
+    int atimeAge;
+    int journalStart;           /* first block of the disk's journal */
+    int journalBlocks;          /* 0 if the disk has no journal and metadata is written in place */
+    uint64_t journalSeq;        /* sequence number of the last commit */
+    int journalCopies;          /* most blocks one commit can hold */
+    int txCount;                /* metadata blocks changed since the last commit, waiting in txNums/txData */
+    int txBitmap;               /* how many of them are bitmap blocks */
+    int txReserved;             /* blocks other than bitmap blocks the operations running may still add, see tx_reserve */
+    int txCapacity;
+    int *txNums;
+    char *txData;
+    int *txHash;                /* index + 1 of each block in the transaction, hashed by block number */
+    int txHashSize;
+    uint64_t *pinMap;           /* blocks freed since the last commit, not handed out again until it's on the disk */
+    pthread_t wbThread;         /* writes everything back once it's wbAge old or wbBytes are waiting, if wbRunning */
+    int wbRunning;
+    int wbStop;
+    int wbAge;                  /* milliseconds */
+    int wbBytes;
+    int64_t wbDirtySince;       /* CLOCK_MONOTONIC nanoseconds of the first change since the last write back, 0 if none */
+    int *dfInodes;              /* inode blocks of the files in the running defrag pass in disk order, NULL if none is running */
+    int dfCount;
+    int dfNext;                 /* next of them to look at */
+    DefragStats dfStats;        /* of the running pass, or the last one */
+    pthread_t dfThread;         /* runs defrag steps of dfBlocks blocks dfPause milliseconds apart, if dfRunning */
+    int dfRunning;
+    int dfStop;
+    int dfBlocks;
+    int dfPause;
+    int dfInode;                /* inode block of the file being copied, 0 if none. Its copy carries on across steps */
+    Extent dfFrom[MAXEXTENTS];  /* its extents when the copy started */
+    int dfFromCount;
+    Extent dfTo[MAXEXTENTS];    /* the runs it's being copied into */
+    int dfToCount;
+    int dfCopied;               /* blocks of it copied so far */
+    int dfChanged;              /* set when its data changes during the copy, see df_touch */
+    int dfRestarts;             /* times its copy started over */
+    uint64_t *dfMap;            /* blocks of dfTo, never handed out but not in the bitmap, NULL if no pass is running */
+    pthread_rwlock_t fsLock;    /* shared by file operations, exclusive to unmount, flushes, and commits */
+    pthread_rwlock_t nameLock;  /* the name index */
+    pthread_rwlock_t inodeLocks[INODE_LOCKS];   /* file data and inode blocks, inode block % INODE_LOCKS */
+    pthread_mutex_t allocLock;  /* the block map and allocHint */
+    pthread_mutex_t timesLocks[TIMES_BUCKETS];  /* each bucket of cached inode times */
+    pthread_rwlock_t txLock;    /* the open transaction, taken after any other lock */
+    pthread_mutex_t wbLock;     /* wbStop and wbCond, never held while taking another lock */
+    pthread_cond_t wbCond;      /* wakes the writeback thread */
+    pthread_mutex_t dfLock;     /* the defrag pass, held for a whole step */
+    pthread_cond_t dfCond;      /* wakes the defrag thread to stop */
+    pthread_mutex_t dfStatsLock;    /* dfStats and dfInodes being set, never held while taking another lock */
+} Mount;
+
+/* An open file. The cursor caches the data block last touched by tfs_readByte/tfs_writeByte
+ * and the extent holding it, so sequential byte I/O doesn't walk the extents or reread the block.
+ * When the cursor moves to the block after the last one it loaded, the blocks after that are read
+ * ahead into raData with the same readBlocks call. The window doubles each time the reader uses all
+ * of it and halves when it uses less than half.
+ * A descriptor belongs to one thread at a time, threads that share a file each open their own */
 typedef struct FileDetails {
+    Mount *mount;               /* disk the file is on */
     int inode;
-    char *name;
+    char name[NAMELENGTH];
     fileDescriptor fd;
     int filePointer;
     int rw;
+    int curIdx;                 /* index within the file of the cached block, -1 if the cursor is invalid */
+    int curBlock;               /* disk block number of the cached block */
+    int extentIdx;              /* index within the file of the first block of curExtent */
+    Extent curExtent;           /* extent holding the cached block */
+    char curData[DATASIZE];     /* payload of the cached block */
+    int raNext;                 /* index within the file of the block a sequential reader loads next */
+    int raWindow;               /* blocks to read ahead on the next sequential miss, 1 to RA_MAX */
+    int raIdx;                  /* index within the file of the first block read ahead */
+    int raCount;                /* blocks read ahead, 0 if there are none */
+    int raUsed;                 /* how many of them the cursor has moved to */
+    int raNums[RA_MAX];         /* disk block number of each */
+    char *raData;               /* payload of each, RA_MAX blocks allocated the first time the file reads ahead */
+    struct FileDetails *inodeNext;  /* next open file in the same open file hash bucket, or next free entry in the pool */
 } FileDetails;
 
+/* Superblock:
+ * 0: Block Type
+ * 1: 0x44
+ * 4-7: First bitmap block
+ * 8-11: Number of bitmap blocks
+ * 12-15: Number of blocks on the disk
+ * 16-19: Block size
+ * 20-23: First journal block
+ * 24-27: Number of journal blocks, 0 if the disk has no journal
+ * 28-31: Format version (FS_VERSION)
+ * 32: 1 if the disk was unmounted cleanly
+ * 33: Flags (FS_CHECKSUMS)
+ * 36-39: Number of files in the name table, NO_NAMETABLE if there isn't one
+ * 40-43: Checksum of the name table's blocks
+ * 252-255: Checksum of bytes 0-251
+ *
+ * Bitmap Blocks: one bit per block from byte 4, set if the block is in use
+ *
+ * Journal header:
+ * 0: Block Type (JOURNAL)
+ * 4-11: Sequence number of the commit
+ * 12-15: Number of blocks in the commit, 0 once it doesn't need replaying
+ * 16-19: Checksum of bytes 4-15, the block numbers, and every block copy
+ * 20-255: Block numbers, continued in JOURNAL_NUMBLOCKS(count) blocks after the header, then the copies
+ *
+ * Note: All fields are little endian. The name table (NAMETABLE_ENTRIES of inode block and name per JOURNAL block)
+ * is written to the empty journal on a clean unmount. Disks made with MKFS_CHECKSUMS keep a CRC32C per block after
+ * the last block */
+
 /* Inode Block:
  * 0: Block Type
  * 1: 0x44
- * 2: Link
- * 3: Empty
+ * 2: Empty
+ * 3: Inode version
  * 4-12: Name
- * 13-18: Size
- * 19-29: Creation Time
- * 30-40: Modification Time
- * 41-51: Access Time
- * 
- * Note: The name, size, creation, modification, and access time end in null bytes */
-
-extern int tfs_mkfs(char *filename, int nBytes);
-extern int tfs_mount(char *diskname);
+ * 13-15: Empty
+ * 16-23: Size
+ * 24-31: Creation Time
+ * 32-39: Modification Time
+ * 40-47: Access Time
+ * 48-51: Empty
+ * 52: Number of extents
+ * 53-55: Empty
+ * 56-255: Extents, 8 bytes each: first block (4 bytes) then number of blocks (4 bytes), little endian
+ *
+ * Note: The name ends in a null byte. The size is an unsigned 64-bit integer and the times are signed 64-bit
+ * nanoseconds since the epoch, all little endian
+ * The file's data is the file extent blocks of each extent in order
+ *
+ * Version 0 inodes hold the size in ASCII at 13-18 and the times as ASCII seconds at 19-29, 30-40, and 41-51 */
+
+extern int tfs_mkfs(char *filename, off_t nBytes);
+extern int tfs_mkfsOptions(char *filename, off_t nBytes, int options);
+extern mountHandle tfs_mount(char *diskname);
+extern mountHandle tfs_mountOptions(char *diskname, int atime, int atimeAge);
+extern mountHandle tfs_mountVerify(char *diskname);
 extern int tfs_unmount(void);
+extern int tfs_flush(void);
+extern int tfs_sync(void);
+extern int tfs_writeback(int maxAge, int maxDirty);
 extern fileDescriptor tfs_openFile(char *name);
 extern int tfs_closeFile(fileDescriptor FD);
 extern int tfs_writeFile(fileDescriptor FD, char *buffer, int size);
 extern int tfs_deleteFile(fileDescriptor FD);
 extern int tfs_readByte(fileDescriptor FD, char *buffer);
 extern int tfs_writeByte(fileDescriptor FD, unsigned int data);
+extern int tfs_readFile(fileDescriptor FD, char *buffer, int size);
+extern int tfs_pread(fileDescriptor FD, char *buffer, int size, int offset);
+extern int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset);
 extern int tfs_seek(fileDescriptor FD, int offset);
 extern void tfs_displayFragments();
 extern int tfs_defrag();
+extern int tfs_defragStep(int maxBlocks, int maxMs);
+extern int tfs_defragBackground(int maxBlocks, int pauseMs);
+extern int tfs_defragProgress(DefragStats *stats);
 extern int tfs_makeRO(char *name);
 extern int tfs_makeRW(char *name);
 extern int tfs_rename(fileDescriptor FD, char *newName);
 extern int tfs_readdir();
 extern int tfs_readFileInfo(fileDescriptor FD);
+
+/* The same operations on a given mount. Any number of disks can be mounted this way alongside the one tfs_mount
+ * mounts, and descriptors from tfs_openFile/tfsm_openFile work with the functions above whichever disk they're on */
+extern mountHandle tfsm_mount(char *diskname, int atime, int atimeAge);
+extern mountHandle tfsm_mountVerify(char *diskname, int atime, int atimeAge);
+extern int tfsm_unmount(mountHandle mh);
+extern int tfsm_flush(mountHandle mh);
+extern int tfsm_sync(mountHandle mh);
+extern int tfsm_writeback(mountHandle mh, int maxAge, int maxDirty);
+extern fileDescriptor tfsm_openFile(mountHandle mh, char *name);
+extern void tfsm_displayFragments(mountHandle mh);
+extern int tfsm_defrag(mountHandle mh);
+extern int tfsm_defragStep(mountHandle mh, int maxBlocks, int maxMs);
+extern int tfsm_defragBackground(mountHandle mh, int maxBlocks, int pauseMs);
+extern int tfsm_defragProgress(mountHandle mh, DefragStats *stats);
+extern int tfsm_makeRO(mountHandle mh, char *name);
+extern int tfsm_makeRW(mountHandle mh, char *name);
+extern int tfsm_readdir(mountHandle mh);
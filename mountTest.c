@@ -0,0 +1,192 @@
+/* TinyFS multiple mount test
+ * Mounts many disks at once, with a thread working on each and every other disk written back by
+ * its writeback thread, then checks every disk is still right after they're all unmounted and
+ * mounted again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+
+#define NUM_DISKS 32
+#define FILES 4
+#define FILE_SIZE 1000
+#define ROUNDS 50
+#define DISK_SIZE (64 * 1024)
+#define WB_AGE 20           /* milliseconds */
+#define WB_DIRTY (8 * 1024)
+#define LAZY_OPS 500        /* operations on the disk written back rarely, many journals' worth */
+
+mountHandle handles[NUM_DISKS];
+int failed = 0;             /* set by any thread that sees something wrong */
+
+
+/* the byte file on disk should hold at offset */
+char expected(int disk, int file, int offset) {
+  return 'a' + (disk * 5 + file * 3 + offset) % 26;
+}
+
+void fail(char *what, int disk, int value) {
+  printf("] disk %d: %s (%d)\n", disk, what, value);
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+/* Each thread fills the files of its own disk and rewrites them in place a piece at a time */
+void *worker(void *arg) {
+  int disk = (int) (long) arg;
+  int i, j, round;
+  char name[9], buffer[FILE_SIZE];
+  fileDescriptor fds[FILES];
+
+  for (i = 0; i < FILES; i++) {
+    sprintf(name, "f%d", i);
+    fds[i] = tfsm_openFile(handles[disk], name);
+    for (j = 0; j < FILE_SIZE; j++)
+      buffer[j] = expected(disk, i, j);
+    if (fds[i] < 0 || tfs_writeFile(fds[i], buffer, FILE_SIZE) < 0)
+      fail("write", disk, i);
+  }
+
+  for (round = 0; round < ROUNDS && !failed; round++) {
+    i = round % FILES;
+    int offset = round * 37 % (FILE_SIZE - 100);
+    if (tfs_pread(fds[i], buffer, 100, offset) != 100)
+      fail("pread", disk, round);
+    if (tfs_pwrite(fds[i], buffer, 100, offset) != 100)
+      fail("pwrite", disk, round);
+  }
+
+  for (i = 0; i < FILES; i++)
+    tfs_closeFile(fds[i]);
+  return NULL;
+}
+
+/* A disk whose writeback thread never comes due on its own still takes any number of operations: each one that
+ * wouldn't fit in the open commit commits it first */
+void lazyTest() {
+  char buffer[FILE_SIZE], name[9];
+  int i, j;
+  char *diskName = "mountTestLazyDisk";
+
+  remove(diskName);
+  mountHandle mh = 0;
+  if (tfs_mkfs(diskName, DISK_SIZE) < 0 || (mh = tfsm_mount(diskName, ATIME_RELATIME, DEFAULT_ATIME_AGE)) < 0 ||
+      tfsm_writeback(mh, 3600 * 1000, 1 << 30) < 0) {
+    fail("lazy disk", 0, mh);
+    return;
+  }
+  for (i = 0; i < LAZY_OPS; i++) {
+    sprintf(name, "l%d", i % FILES);
+    memset(buffer, 'a' + i % 26, FILE_SIZE);
+    fileDescriptor fd = tfsm_openFile(mh, name);
+    if (fd < 0 || tfs_writeFile(fd, buffer, FILE_SIZE) < 0 || (i % 3 == 0 && tfs_deleteFile(fd) < 0))
+      fail("lazy operation", 0, i);
+    else if (i % 3)
+      tfs_closeFile(fd);
+  }
+  if (tfsm_unmount(mh) < 0 || (mh = tfsm_mount(diskName, ATIME_RELATIME, DEFAULT_ATIME_AGE)) < 0)
+    fail("lazy remount", 0, mh);
+
+  /* each file holds what was last written to it, unless that was deleted */
+  for (i = LAZY_OPS - FILES; i < LAZY_OPS; i++) {
+    sprintf(name, "l%d", i % FILES);
+    fileDescriptor fd = tfsm_openFile(mh, name);
+    int size = tfs_pread(fd, buffer, FILE_SIZE, 0);
+    for (j = 0; j < size && buffer[j] == 'a' + i % 26; j++);
+    if (size != (i % 3 ? FILE_SIZE : 0) || j < size)
+      fail("lazy contents", 0, i);
+  }
+  tfsm_unmount(mh);
+  remove(diskName);
+}
+
+/* check every file on a disk */
+void checkDisk(int disk) {
+  int i, j;
+  char name[9], buffer[FILE_SIZE + 1];
+
+  for (i = 0; i < FILES; i++) {
+    sprintf(name, "f%d", i);
+    fileDescriptor fd = tfsm_openFile(handles[disk], name);
+    if (tfs_pread(fd, buffer, FILE_SIZE + 1, 0) != FILE_SIZE) {
+      fail("size", disk, i);
+    } else {
+      for (j = 0; j < FILE_SIZE && buffer[j] == expected(disk, i, j); j++);
+      if (j < FILE_SIZE)
+        fail("contents", disk, j);
+    }
+    tfs_closeFile(fd);
+  }
+}
+
+int main() {
+  pthread_t threads[NUM_DISKS];
+  char diskName[32];
+  long i;
+
+  /* make and mount every disk */
+  for (i = 0; i < NUM_DISKS; i++) {
+    sprintf(diskName, "mountTestDisk%ld", i);
+    remove(diskName);
+    if (tfs_mkfs(diskName, DISK_SIZE) < 0 || (handles[i] = tfsm_mount(diskName, ATIME_RELATIME, DEFAULT_ATIME_AGE)) < 0) {
+      printf("] failed to make disk %ld\n", i);
+      return 1;
+    }
+    if (i % 2 && tfsm_writeback(handles[i], WB_AGE, WB_DIRTY) < 0)
+      fail("writeback", i, 0);
+  }
+
+  /* a disk can't be mounted twice or remade while it's mounted */
+  if (tfsm_mount("mountTestDisk0", ATIME_RELATIME, DEFAULT_ATIME_AGE) != ERR_MOUNTMULTIPLE || tfs_mkfs("mountTestDisk0", DISK_SIZE) != ERR_MOUNTMULTIPLE)
+    fail("mounted twice", 0, 0);
+
+  for (i = 0; i < NUM_DISKS; i++)
+    pthread_create(&threads[i], NULL, worker, (void *) i);
+  for (i = 0; i < NUM_DISKS; i++)
+    pthread_join(threads[i], NULL);
+  printf("] %d disks mounted at once\n", NUM_DISKS);
+  for (i = 0; i < NUM_DISKS; i++)
+    if (tfsm_sync(handles[i]) < 0)
+      fail("sync", i, 0);
+
+  /* the same name on each disk is a different file */
+  for (i = 0; i < NUM_DISKS; i++)
+    checkDisk(i);
+
+  /* descriptors go away with their disk */
+  fileDescriptor stale = tfsm_openFile(handles[1], "f0");
+  if (tfsm_unmount(handles[1]) < 0 || tfs_seek(stale, 0) >= 0 || tfsm_openFile(handles[1], "f0") >= 0)
+    fail("stale descriptor", 1, stale);
+
+  lazyTest();
+
+  /* unmount the rest and mount them all again */
+  for (i = 0; i < NUM_DISKS; i++) {
+    if (i != 1 && tfsm_unmount(handles[i]) < 0)
+      fail("unmount", i, 0);
+  }
+  for (i = 0; i < NUM_DISKS; i++) {
+    sprintf(diskName, "mountTestDisk%ld", i);
+    if ((handles[i] = tfsm_mount(diskName, ATIME_RELATIME, DEFAULT_ATIME_AGE)) < 0)
+      fail("remount", i, handles[i]);
+  }
+  for (i = 0; i < NUM_DISKS && !failed; i++)
+    checkDisk(i);
+  for (i = 0; i < NUM_DISKS; i++) {
+    tfsm_unmount(handles[i]);
+    sprintf(diskName, "mountTestDisk%ld", i);
+    remove(diskName);
+  }
+
+  if (failed) {
+    printf("] mountTest failed\n");
+    return 1;
+  }
+  printf("] mountTest passed\n");
+  return 0;
+}
@@ -5,11 +5,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #include "tinyFS.h"
 #include "libTinyFS.h"
+#include "libDisk.h"
 #include "TinyFS_errno.h"
 
+#define OLD_FILE_SIZE 600
+#define OLD_MTIME_SECONDS 1710901820
+#define RA_FILE_SIZE 20000      /* bytes in each file of the readahead test, many windows' worth */
+#define FM_FILES 50             /* files on the fast mount test's disk */
+#define ATIME_DISK_SIZE (DEFAULT_DISK_SIZE * 10)
+#define DF_CHUNKS 6             /* extents of each fragmented file in the defrag test */
+#define BIG_DISK_SIZE (((off_t) 1 << 31) + ((off_t) 1 << 20))  /* past what fits in an int */
+
 
 
 /* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
@@ -27,6 +40,752 @@ int fillBufferWithPhrase(char *inPhrase, char *Buffer, int size) {
   return 0;
 }
 
+/* a little endian field of a block, bytes long */
+uint64_t getField(char *field, int bytes) {
+  uint64_t value = 0;
+  int i;
+  for (i = bytes - 1; i >= 0; i--)
+    value = value << 8 | (unsigned char) field[i];
+  return value;
+}
+
+/* Make a disk the way the first TinyFS did: 40 blocks, free blocks and each file's data chained through byte 2, and
+ * inodes with ASCII sizes and times. "old" has its data in blocks 5, 3, then 7 and "empty" has none */
+int makeOldDisk(char *name) {
+  char block[BLOCKSIZE];
+  int i, next, status = 0;
+  int disk = openDisk(name, OLD_NUM_BLOCKS * BLOCKSIZE);
+  if (disk < 0)
+    return disk;
+
+  for (i = 0; i < OLD_NUM_BLOCKS && status >= 0; i++) {
+    memset(block, 0, BLOCKSIZE);
+    block[1] = MAGIC;
+    if (i == 0) {                           /* superblock, first free block */
+      block[0] = SUPERBLOCK;
+      block[2] = 2;
+    } else if (i == 1 || i == 9) {          /* inodes */
+      block[0] = INODE;
+      block[2] = i == 1 ? 5 : 0;
+      strcpy(block + 4, i == 1 ? "old" : "empty");
+      sprintf(block + OLD_SIZE, "%d", i == 1 ? OLD_FILE_SIZE : 0);
+      sprintf(block + OLD_CTIME, "%d", OLD_MTIME_SECONDS);
+      sprintf(block + OLD_MTIME, "%d", OLD_MTIME_SECONDS);
+      sprintf(block + OLD_ATIME, "%d", OLD_MTIME_SECONDS);
+    } else if (i == 3 || i == 5 || i == 7) { /* data of "old", 5 -> 3 -> 7 */
+      block[0] = FILEEXTENT;
+      block[2] = i == 5 ? 3 : i == 3 ? 7 : 0;
+      memset(block + 4, i == 5 ? 'x' : i == 3 ? 'y' : 'z', DATASIZE);
+    } else {                                /* free, chained to the next free block */
+      block[0] = FREEBLOCK;
+      for (next = i + 1; next == 3 || next == 5 || next == 7 || next == 9; next++);
+      block[2] = next < OLD_NUM_BLOCKS ? next : 0;
+    }
+    status = writeBlock(disk, i, block);
+  }
+  closeDisk(disk);
+  return status;
+}
+
+/* An old disk mounts, keeps its files, and has all of its free blocks to give out */
+int oldDiskTest() {
+  char buffer[OLD_FILE_SIZE + 1], block[BLOCKSIZE];
+  int i, failed = 0;
+  char *name = "tfsOldDisk";
+
+  remove(name);
+  if (makeOldDisk(name) < 0 || tfs_mount(name) < 0) {
+    printf("] old disk didn't mount\n");
+    return 1;
+  }
+  fileDescriptor fd = tfs_openFile("old");
+  if (tfs_pread(fd, buffer, OLD_FILE_SIZE + 1, 0) != OLD_FILE_SIZE)
+    failed = 1;
+  for (i = 0; i < OLD_FILE_SIZE && !failed; i++)
+    failed = buffer[i] != (i < DATASIZE ? 'x' : i < 2 * DATASIZE ? 'y' : 'z');
+  fd = tfs_openFile("empty");
+  if (tfs_pread(fd, buffer, 1, 0) != 0)
+    failed = 1;
+
+  /* 40 blocks less the superblock, bitmap, two inodes, three data blocks, and the new inode */
+  char *fill = calloc(32 * DATASIZE, 1);
+  fd = tfs_openFile("new");
+  if (tfs_writeFile(fd, fill, 32 * DATASIZE) < 0 || tfs_writeFile(fd, fill, 33 * DATASIZE) != ERR_FULLDISK)
+    failed = 1;
+  free(fill);
+  if (tfs_unmount() < 0)
+    failed = 1;
+
+  /* the inode was upgraded to binary fields with its times kept */
+  int disk = openDisk(name, 0);
+  for (i = 0; i < OLD_NUM_BLOCKS && readBlock(disk, i, block) >= 0; i++) {
+    if (block[0] == INODE && !strcmp(block + 4, "old"))
+      break;
+  }
+  if (i == OLD_NUM_BLOCKS || block[3] != INODE_VERSION ||
+      getField(block + INODE_SIZE, 8) != OLD_FILE_SIZE || getField(block + INODE_MTIME, 8) != (uint64_t) OLD_MTIME_SECONDS * 1000000000)
+    failed = 1;
+  closeDisk(disk);
+  remove(name);
+
+  printf(failed ? "] old disk test failed\n" : "] old disk test passed\n");
+  return failed;
+}
+
+/* A write that can't get its blocks, here because the free space is in more holes than an inode has extents, leaves
+ * the file as it was, even after other files take every free block */
+int failedWriteTest() {
+  char buffer[DATASIZE + 1], name[16];
+  int i, numFiles, failed = 0;
+  char *diskName = "tfsFullDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, 200 * BLOCKSIZE) < 0 || tfs_mount(diskName) < 0) {
+    printf("] failed write disk didn't mount\n");
+    return 1;
+  }
+  memset(buffer, 'k', DATASIZE);
+  fileDescriptor keep = tfs_openFile("keep");
+  if (tfs_writeFile(keep, buffer, DATASIZE) < 0)
+    failed = 1;
+
+  /* a write whose end doesn't fit in an int is refused before any block is taken */
+  if (tfs_pwrite(keep, buffer, INT_MAX, 1) != ERR_OUTOFBOUNDS)
+    failed = 1;
+
+  /* fill the disk with one block files, then delete every other one */
+  for (numFiles = 0; ; numFiles++) {
+    sprintf(name, "f%d", numFiles);
+    fileDescriptor fd = tfs_openFile(name);
+    if (fd < 0 || tfs_writeFile(fd, buffer, 1) < 0)
+      break;
+    tfs_closeFile(fd);
+  }
+  for (i = 0; i < numFiles; i += 2) {
+    sprintf(name, "f%d", i);
+    tfs_deleteFile(tfs_openFile(name));
+  }
+  tfs_flush();
+
+  char *big = calloc(numFiles * DATASIZE, 1);
+  if (tfs_writeFile(keep, big, numFiles * DATASIZE) != ERR_FULLDISK)
+    failed = 1;
+  free(big);
+  tfs_flush();
+  for (i = 0; i < numFiles; i += 2) {
+    sprintf(name, "f%d", i);
+    fileDescriptor fd = tfs_openFile(name);
+    tfs_writeFile(fd, "o", 1);
+  }
+
+  memset(buffer, 0, DATASIZE);
+  if (tfs_pread(keep, buffer, DATASIZE + 1, 0) != DATASIZE)
+    failed = 1;
+  for (i = 0; i < DATASIZE && !failed; i++)
+    failed = buffer[i] != 'k';
+  if (tfs_unmount() < 0)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] failed write test failed\n" : "] failed write test passed\n");
+  return failed;
+}
+
+/* Renaming a file to a name another file has fails and leaves both files where they were */
+int renameTest() {
+  char buffer[2];
+  int failed = 0;
+  char *diskName = "tfsRenameDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, DEFAULT_DISK_SIZE) < 0 || tfs_mount(diskName) < 0) {
+    printf("] rename disk didn't mount\n");
+    return 1;
+  }
+  fileDescriptor aFD = tfs_openFile("a"), bFD = tfs_openFile("b");
+  tfs_writeFile(aFD, "a", 1);
+  tfs_writeFile(bFD, "b", 1);
+  if (tfs_rename(bFD, "a") != ERR_FILEEXISTS || tfs_rename(bFD, "b") < 0)
+    failed = 1;
+  tfs_closeFile(aFD);
+  tfs_closeFile(bFD);
+  aFD = tfs_openFile("a");
+  bFD = tfs_openFile("b");
+  if (tfs_pread(aFD, buffer, 2, 0) != 1 || buffer[0] != 'a' || tfs_pread(bFD, buffer, 2, 0) != 1 || buffer[0] != 'b')
+    failed = 1;
+  if (tfs_unmount() < 0)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] rename test failed\n" : "] rename test passed\n");
+  return failed;
+}
+
+/* A disk that crashed after a commit reached the journal, but before its blocks reached their places, gets them back
+ * when it's mounted. The commit is made bigger than the journal header, so its block numbers carry on after it */
+int journalTest() {
+  char run[2 * BLOCKSIZE], block[BLOCKSIZE], buffer[DATASIZE + 1], name[16];
+  int i, count = 0, files = 0, failed = 0;
+  char *diskName = "tfsJournalDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, 1024 * BLOCKSIZE) < 0) {
+    printf("] journal disk wasn't made\n");
+    return 1;
+  }
+  if (fork() == 0) {
+    if (tfs_mount(diskName) < 0)
+      _exit(1);
+    memset(buffer, 'j', DATASIZE);
+    tfs_writeFile(tfs_openFile("keep"), buffer, DATASIZE);
+    tfs_flush();
+    for (i = 0; i < JOURNAL_ENTRIES; i++) {
+      sprintf(name, "j%d", i);
+      tfs_openFile(name);
+    }
+    tfs_flush();
+    _exit(0);                               /* crash without unmounting */
+  }
+  wait(NULL);
+
+  /* lose every block of the last commit from its place */
+  int disk = openDisk(diskName, 0);
+  readBlock(disk, 0, block);
+  int journalStart = getField(block + 20, 4);
+  readBlock(disk, journalStart, run);
+  readBlock(disk, journalStart + 1, run + BLOCKSIZE);
+  count = getField(run + 12, 4);
+  memset(block, 0, BLOCKSIZE);
+  for (i = 0; i < count; i++) {
+    char *num = i < JOURNAL_ENTRIES ? run + JOURNAL_NUMS + i * 4 : run + BLOCKSIZE + 4 + (i - JOURNAL_ENTRIES) * 4;
+    writeBlock(disk, getField(num, 4), block);
+  }
+  closeDisk(disk);
+  if (count <= JOURNAL_ENTRIES)
+    failed = 1;
+
+  /* mount it, check the file from the commit before, and use it so the bitmap has to be right too */
+  if (tfs_mount(diskName) < 0) {
+    printf("] journal disk didn't mount\n");
+    return 1;
+  }
+  fileDescriptor fd = tfs_openFile("keep");
+  if (tfs_pread(fd, buffer, DATASIZE + 1, 0) != DATASIZE || buffer[0] != 'j' || buffer[DATASIZE - 1] != 'j')
+    failed = 1;
+  memset(buffer, 'n', DATASIZE);
+  if (tfs_writeFile(tfs_openFile("new"), buffer, DATASIZE) < 0 || tfs_unmount() < 0)
+    failed = 1;
+
+  /* every file created in the lost commit is back */
+  disk = openDisk(diskName, 0);
+  for (i = 0; i < 1024; i++) {
+    if (readBlock(disk, i, block) >= 0 && block[0] == INODE && block[4] == 'j')
+      files++;
+  }
+  closeDisk(disk);
+  if (files != JOURNAL_ENTRIES)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] journal test failed\n" : "] journal test passed\n");
+  return failed;
+}
+
+/* the byte the readahead test's file holds at offset */
+char readaheadByte(int file, int offset) {
+  return 'a' + (offset * 7 + file) % 26;
+}
+
+/* Reading a file in many extents a byte at a time gets every byte right while the reader reads ahead, and a block
+ * already read ahead is read again after another descriptor or the reader itself writes to it */
+int readaheadTest() {
+  char buffer[RA_FILE_SIZE], other[RA_FILE_SIZE], c;
+  int i, failed = 0;
+  char *diskName = "tfsReadaheadDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, DEFAULT_DISK_SIZE * 100) < 0 || tfs_mount(diskName) < 0) {
+    printf("] readahead disk didn't mount\n");
+    return 1;
+  }
+
+  /* grow two files in turn so each is in many extents */
+  fileDescriptor aFD = tfs_openFile("a"), bFD = tfs_openFile("b");
+  for (i = 0; i < RA_FILE_SIZE; i++) {
+    buffer[i] = readaheadByte(0, i);
+    other[i] = readaheadByte(1, i);
+  }
+  for (i = 0; i < RA_FILE_SIZE; i += 1000) {
+    if (tfs_pwrite(aFD, buffer + i, 1000, i) != 1000 || tfs_pwrite(bFD, other + i, 1000, i) != 1000)
+      failed = 1;
+  }
+
+  tfs_seek(aFD, 0);
+  for (i = 0; i < RA_FILE_SIZE && !failed; i++) {
+    if (tfs_readByte(aFD, &c) < 0 || c != readaheadByte(0, i))
+      failed = 1;
+  }
+  if (tfs_readByte(aFD, &c) >= 0)
+    failed = 1;
+
+  /* another descriptor writes to the blocks just after where this one has read to, which it has read ahead */
+  fileDescriptor reader = tfs_openFile("a");
+  tfs_seek(reader, 0);
+  for (i = 0; i < 2 * DATASIZE; i++)
+    tfs_readByte(reader, &c);
+  tfs_seek(aFD, 2 * DATASIZE);
+  tfs_writeByte(aFD, 'Z');
+  if (tfs_readByte(reader, &c) < 0 || c != 'Z')
+    failed = 1;
+  for (i = 2 * DATASIZE + 1; i < 4 * DATASIZE; i++)
+    tfs_readByte(reader, &c);
+  tfs_pwrite(aFD, "QQ", 2, 4 * DATASIZE);
+  if (tfs_readByte(reader, &c) < 0 || c != 'Q')
+    failed = 1;
+
+  /* and so does the reader itself */
+  for (i = 4 * DATASIZE + 1; i < 6 * DATASIZE; i++)
+    tfs_readByte(reader, &c);
+  tfs_seek(reader, 6 * DATASIZE);
+  tfs_writeByte(reader, 'Y');
+  tfs_seek(reader, 5 * DATASIZE);
+  tfs_readByte(reader, &c);
+  tfs_seek(reader, 6 * DATASIZE);
+  if (tfs_readByte(reader, &c) < 0 || c != 'Y')
+    failed = 1;
+
+  /* the other file was never touched */
+  tfs_seek(bFD, 0);
+  for (i = 0; i < RA_FILE_SIZE && !failed; i++) {
+    if (tfs_readByte(bFD, &c) < 0 || c != readaheadByte(1, i))
+      failed = 1;
+  }
+  if (tfs_unmount() < 0)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] readahead test failed\n" : "] readahead test passed\n");
+  return failed;
+}
+
+/* Count how many of the fast mount test's files are on the mounted disk holding their own byte, skipping the first
+ * skip of them */
+int countMountFiles(int skip) {
+  char name[16], buffer[2];
+  int i, count = 0;
+
+  for (i = skip; i < FM_FILES; i++) {
+    sprintf(name, "m%d", i);
+    fileDescriptor fd = tfs_openFile(name);
+    if (tfs_pread(fd, buffer, 2, 0) == 1 && buffer[0] == 'a' + i % 26)
+      count++;
+    tfs_closeFile(fd);
+  }
+  return count;
+}
+
+/* Read the clean flag of a disk's superblock straight from its file, even while it's mounted */
+int cleanFlag(char *diskName) {
+  FILE *file = fopen(diskName, "rb");
+  int flag = -1;
+  if (file != NULL && fseek(file, SB_CLEAN, SEEK_SET) == 0)
+    flag = fgetc(file);
+  if (file != NULL)
+    fclose(file);
+  return flag;
+}
+
+/* A disk that was unmounted cleanly mounts from its name table, and one that wasn't is read whole, so it finds what
+ * changed after the table was written. A damaged name table is read around too */
+int fastMountTest() {
+  char name[16], buffer[2], block[BLOCKSIZE];
+  int i, failed = 0;
+  char *diskName = "tfsFastMountDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, DEFAULT_DISK_SIZE * 100) < 0 || tfs_mount(diskName) < 0) {
+    printf("] fast mount disk didn't mount\n");
+    return 1;
+  }
+  for (i = 0; i < FM_FILES; i++) {
+    sprintf(name, "m%d", i);
+    buffer[0] = 'a' + i % 26;
+    tfs_writeFile(tfs_openFile(name), buffer, 1);
+  }
+  if (cleanFlag(diskName) != 0 || tfs_unmount() < 0 || cleanFlag(diskName) != 1)
+    failed = 1;
+
+  /* clean: the name table has every file */
+  if (tfs_mount(diskName) < 0 || countMountFiles(0) != FM_FILES || tfs_unmount() < 0)
+    failed = 1;
+
+  /* crash after deleting a file and making another, which the name table doesn't know about */
+  if (fork() == 0) {
+    if (tfs_mount(diskName) < 0)
+      _exit(1);
+    tfs_deleteFile(tfs_openFile("m0"));
+    tfs_writeFile(tfs_openFile("late"), "L", 1);
+    tfs_flush();
+    _exit(0);
+  }
+  wait(NULL);
+  if (cleanFlag(diskName) != 0 || tfs_mount(diskName) < 0)
+    failed = 1;
+  fileDescriptor fd = tfs_openFile("late");
+  if (tfs_pread(fd, buffer, 2, 0) != 1 || buffer[0] != 'L' || countMountFiles(1) != FM_FILES - 1)
+    failed = 1;
+  fd = tfs_openFile("m0");
+  if (tfs_pread(fd, buffer, 2, 0) != 0)
+    failed = 1;
+  tfs_deleteFile(fd);
+  if (tfs_unmount() < 0)
+    failed = 1;
+
+  /* damage the name table, which starts in the block after the journal header */
+  int disk = openDisk(diskName, DEFAULT_DISK_SIZE * 100);
+  readBlock(disk, 0, block);
+  int tableBlock = getField(block + 20, 4) + 1;
+  readBlock(disk, tableBlock, block);
+  block[10] ^= 1;
+  writeBlock(disk, tableBlock, block);
+  closeDisk(disk);
+  if (tfs_mount(diskName) < 0 || countMountFiles(1) != FM_FILES - 1 || tfs_unmount() < 0)
+    failed = 1;
+  if (tfs_mountVerify(diskName) < 0 || countMountFiles(1) != FM_FILES - 1 || tfs_unmount() < 0)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] fast mount test failed\n" : "] fast mount test passed\n");
+  return failed;
+}
+
+/* Read a file's inode block straight from the disk's file, even while it's mounted, so it's only what has been written
+ * back. Returns 1 if the file was found */
+int diskInode(char *diskName, char *name, char *block) {
+  int found = 0;
+  FILE *file = fopen(diskName, "rb");
+
+  while (file != NULL && !found && fread(block, 1, BLOCKSIZE, file) == BLOCKSIZE)
+    found = block[0] == INODE && block[1] == MAGIC && !strcmp(block + 4, name);
+  if (file != NULL)
+    fclose(file);
+  return found;
+}
+
+/* The access and modification times of a file's inode block on the disk */
+void diskTimes(char *diskName, char *name, uint64_t *atime, uint64_t *mtime) {
+  char block[BLOCKSIZE];
+
+  *atime = *mtime = 0;
+  if (diskInode(diskName, name, block)) {
+    *atime = getField(block + INODE_ATIME, 8);
+    *mtime = getField(block + INODE_MTIME, 8);
+  }
+}
+
+/* The number of extents of a file's inode block on the disk, and the first block of the first one */
+int diskExtents(char *diskName, char *name, int *first) {
+  char block[BLOCKSIZE];
+
+  if (!diskInode(diskName, name, block))
+    return -1;
+  *first = getField(block + EXTENTSTART, 4);
+  return (unsigned char) block[EXTENTCOUNT];
+}
+
+/* Wait long enough for the coarse clock the file system uses to move past the last time recorded */
+void tick(int ms) {
+  struct timespec wait = {ms / 1000, (ms % 1000) * 1000000};
+  nanosleep(&wait, NULL);
+}
+
+/* tfs_mount updates the access time on every read, relatime only when it isn't newer than the modification time or is
+ * older than the atime age, and noatime never. Cached times reach the disk on close, flush, and unmount */
+int atimeTest() {
+  char c;
+  uint64_t atime, mtime, last;
+  int failed = 0;
+  char *diskName = "tfsAtimeDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, ATIME_DISK_SIZE) < 0 || tfs_mount(diskName) < 0) {
+    printf("] atime disk didn't mount\n");
+    return 1;
+  }
+  fileDescriptor fd = tfs_openFile("t");
+  tfs_writeFile(fd, "abc", 3);
+  tfs_flush();
+  diskTimes(diskName, "t", &last, &mtime);
+
+  /* strict: a read changes it, and flushing writes it */
+  tick(20);
+  tfs_seek(fd, 0);
+  tfs_readByte(fd, &c);
+  tfs_flush();
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime <= last)
+    failed = 1;
+  last = atime;
+
+  /* closing the last descriptor writes it, a second one open on the file doesn't lose what the first read */
+  fileDescriptor other = tfs_openFile("t");
+  tick(20);
+  tfs_readByte(fd, &c);
+  tfs_closeFile(other);
+  tfs_closeFile(fd);
+  tfs_flush();
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime <= last)
+    failed = 1;
+  last = atime;
+
+  /* and so does unmounting */
+  fd = tfs_openFile("t");
+  tick(20);
+  tfs_readByte(fd, &c);
+  if (tfs_unmount() < 0)
+    failed = 1;
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime <= last)
+    failed = 1;
+  last = atime;
+
+  /* relatime: the access time is newer than the modification time and younger than a second, so a read leaves it */
+  if (tfs_mountOptions(diskName, ATIME_RELATIME, 1) < 0)
+    failed = 1;
+  fd = tfs_openFile("t");
+  tick(20);
+  tfs_readByte(fd, &c);
+  tfs_flush();
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime != last)
+    failed = 1;
+
+  /* once it's older than the age a read changes it */
+  tick(1100);
+  tfs_seek(fd, 0);
+  tfs_readByte(fd, &c);
+  tfs_flush();
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime <= last)
+    failed = 1;
+
+  /* and after a write, the first read does */
+  tfs_pwrite(fd, "x", 1, 0);
+  tick(20);
+  tfs_seek(fd, 0);
+  tfs_readByte(fd, &c);
+  tfs_flush();
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime <= mtime)
+    failed = 1;
+  last = atime;
+  if (tfs_unmount() < 0)
+    failed = 1;
+
+  /* noatime: reads never change it */
+  if (tfs_mountOptions(diskName, ATIME_NOATIME, 0) < 0)
+    failed = 1;
+  fd = tfs_openFile("t");
+  tick(20);
+  tfs_readByte(fd, &c);
+  tfs_closeFile(fd);
+  if (tfs_unmount() < 0)
+    failed = 1;
+  diskTimes(diskName, "t", &atime, &mtime);
+  if (atime != last)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] atime test failed\n" : "] atime test passed\n");
+  return failed;
+}
+
+/* A file system bigger than 2 GiB formats, mounts, and keeps its files, and one with more blocks than fit in an int
+ * is refused */
+int bigDiskTest() {
+  char buffer[DATASIZE * 3];
+  struct stat info;
+  int i, failed = 0;
+  char *diskName = "tfsBigDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, ((off_t) MAX_DISK_BLOCKS + 1) * BLOCKSIZE) != ERR_OUTOFBOUNDS || !stat(diskName, &info))
+    failed = 1;
+  if (tfs_mkfs(diskName, BIG_DISK_SIZE) < 0 || stat(diskName, &info) || info.st_size < BIG_DISK_SIZE || tfs_mount(diskName) < 0) {
+    printf("] big disk didn't mount\n");
+    remove(diskName);
+    return 1;
+  }
+
+  for (i = 0; i < (int) sizeof(buffer); i++)
+    buffer[i] = i % 251;
+  fileDescriptor fd = tfs_openFile("big");
+  if (tfs_writeFile(fd, buffer, sizeof(buffer)) < 0)
+    failed = 1;
+  if (tfs_unmount() < 0 || tfs_mountVerify(diskName) < 0)
+    failed = 1;
+
+  memset(buffer, 0, sizeof(buffer));
+  fd = tfs_openFile("big");
+  if (tfs_readFile(fd, buffer, sizeof(buffer)) != sizeof(buffer))
+    failed = 1;
+  for (i = 0; i < (int) sizeof(buffer) && !failed; i++)
+    failed = buffer[i] != (char) (i % 251);
+  if (tfs_unmount() < 0)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] big disk test failed\n" : "] big disk test passed\n");
+  return failed;
+}
+
+/* Check every byte of the defrag test's files, which hold (file * 7 + offset) % 251 apart from what the test changed */
+int checkDefragFiles(char **names, int count, int size, char *changed) {
+  char *buffer = malloc(size + 1);
+  int i, f, failed = 0;
+
+  for (f = 0; f < count && !failed; f++) {
+    fileDescriptor fd = tfs_openFile(names[f]);
+    if (tfs_pread(fd, buffer, size + 1, 0) != size)
+      failed = 1;
+    for (i = 0; i < size && !failed; i++)
+      failed = buffer[i] != (f == 0 && i < (int) strlen(changed) ? changed[i] : (char) ((f * 7 + i) % 251));
+    tfs_closeFile(fd);
+  }
+  free(buffer);
+  return failed;
+}
+
+/* Defragmenting in steps of a few blocks carries a file's copy over from step to step, leaving its extents alone until
+ * it's copied whole, and starts over if the file is written in between. Files already in one extent are skipped, and
+ * a file no run can hold whole is moved into a few runs instead */
+int defragTest() {
+  char buffer[DATASIZE * DF_CHUNKS * 4];
+  char *names[] = {"a", "b", "c", "s"};
+  DefragStats stats;
+  int i, f, first, start, status, copied = 0, steps = 0, failed = 0;
+  int size = DATASIZE * DF_CHUNKS * 4;
+  char *diskName = "tfsDefragDisk";
+
+  remove(diskName);
+  if (tfs_mkfs(diskName, 400 * BLOCKSIZE) < 0 || tfs_mount(diskName) < 0) {
+    printf("] defrag disk didn't mount\n");
+    return 1;
+  }
+
+  /* a, b, and c written 4 blocks at a time in turn so each is in DF_CHUNKS extents, and s in one */
+  for (i = 0; i < DF_CHUNKS; i++) {
+    for (f = 0; f < 3; f++) {
+      int k, offset = i * DATASIZE * 4;
+      for (k = 0; k < DATASIZE * 4; k++)
+        buffer[k] = (f * 7 + offset + k) % 251;
+      fileDescriptor fd = tfs_openFile(names[f]);
+      tfs_pwrite(fd, buffer, DATASIZE * 4, offset);
+      tfs_closeFile(fd);
+    }
+  }
+  for (i = 0; i < size; i++)
+    buffer[i] = (3 * 7 + i) % 251;
+  fileDescriptor fd = tfs_openFile("s");
+  tfs_writeFile(fd, buffer, size);
+  tfs_closeFile(fd);
+  tfs_flush();
+  diskExtents(diskName, "s", &start);
+  for (f = 0; f < 3; f++)
+    if (diskExtents(diskName, names[f], &first) != DF_CHUNKS)
+      failed = 1;
+
+  /* 10 blocks a step: a step that stops early has copied exactly 10, and a file is in its old extents until it moves */
+  while ((status = tfs_defragStep(10, 0)) >= 0) {
+    steps++;
+    if (tfs_defragProgress(&stats) != status || stats.copied - copied > 10 || (status && stats.copied - copied != 10))
+      failed = 1;
+    copied = stats.copied;
+    tfs_flush();
+    int moved = 0;
+    for (f = 0; f < 3; f++) {
+      int count = diskExtents(diskName, names[f], &first);
+      if (count != 1 && count != DF_CHUNKS)
+        failed = 1;
+      moved += count == 1;
+    }
+    if (moved != stats.moved || diskExtents(diskName, "s", &first) != 1 || first != start)
+      failed = 1;
+    if (checkDefragFiles(names, 4, size, steps > 1 ? "changed" : ""))
+      failed = 1;
+
+    /* write to a after its first 10 blocks are copied, so its copy starts over */
+    if (steps == 1) {
+      fd = tfs_openFile("a");
+      tfs_pwrite(fd, "changed", 7, 0);
+      tfs_closeFile(fd);
+    }
+    if (!status)
+      break;
+  }
+  if (status < 0 || steps < 3 * DF_CHUNKS * 4 / 10)
+    failed = 1;
+  if (stats.files != 4 || stats.done != 4 || stats.moved != 3 || stats.skipped != 1 || stats.busy || stats.noRoom ||
+      stats.blocks != 3 * DF_CHUNKS * 4 || stats.copied != stats.blocks + 10)
+    failed = 1;
+  if (tfs_unmount() < 0)
+    failed = 1;
+
+  /* only the two gaps left by deleting files are free, neither holds a whole but together they do */
+  remove(diskName);
+  if (tfs_mkfs(diskName, 200 * BLOCKSIZE) < 0 || tfs_mount(diskName) < 0)
+    failed = 1;
+  memset(buffer, 'q', sizeof(buffer));
+  fileDescriptor a = tfs_openFile("a"), b = tfs_openFile("b");
+  for (i = 0; i < DF_CHUNKS; i++) {
+    tfs_pwrite(a, buffer, DATASIZE * 4, i * DATASIZE * 4);
+    tfs_pwrite(b, buffer, DATASIZE * 4, i * DATASIZE * 4);
+  }
+  fileDescriptor gap1 = tfs_openFile("gap1"), wall = tfs_openFile("wall"), gap2 = tfs_openFile("gap2");
+  tfs_writeFile(gap1, buffer, DATASIZE * 8 * DF_CHUNKS / 3);
+  tfs_writeFile(wall, buffer, 1);
+  tfs_writeFile(gap2, buffer, DATASIZE * 8 * DF_CHUNKS / 3);
+  for (i = 0; ; i++) {
+    char name[16];
+    sprintf(name, "p%d", i);
+    fd = tfs_openFile(name);
+    if (fd < 0 || tfs_writeFile(fd, buffer, 1) < 0)
+      break;
+  }
+  tfs_deleteFile(gap1);
+  tfs_deleteFile(gap2);
+  tfs_flush();
+
+  /* a millisecond a step still gets through the pass, every step doing something */
+  int done = 0;
+  copied = 0;
+  for (steps = 0; (status = tfs_defragStep(0, 1)) > 0 && steps < 1000; steps++) {
+    tfs_defragProgress(&stats);
+    if (stats.copied == copied && stats.done == done)
+      failed = 1;
+    copied = stats.copied;
+    done = stats.done;
+  }
+  tfs_defragProgress(&stats);
+  tfs_flush();
+  int count = diskExtents(diskName, "a", &first);
+  if (status || stats.moved < 1 || stats.moved + stats.noRoom != 2 || count < 2 || count >= DF_CHUNKS ||
+      diskExtents(diskName, "b", &first) > DF_CHUNKS)
+    failed = 1;
+  memset(buffer, 0, sizeof(buffer));
+  if (tfs_pread(a, buffer, sizeof(buffer), 0) != DATASIZE * 4 * DF_CHUNKS)
+    failed = 1;
+  for (i = 0; i < DATASIZE * 4 * DF_CHUNKS && !failed; i++)
+    failed = buffer[i] != 'q';
+  if (tfs_unmount() < 0)
+    failed = 1;
+  remove(diskName);
+
+  printf(failed ? "] defrag test failed\n" : "] defrag test passed\n");
+  return failed;
+}
+
 /* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system. */
 int main() {
   char readBuffer;
@@ -130,5 +889,6 @@ int main() {
     perror ("tfs_unmount failed");
 
   printf ("\nend of demo\n\n");
-  return 0;
+
+  return oldDiskTest() | failedWriteTest() | renameTest() | journalTest() | readaheadTest() | fastMountTest() | atimeTest() | bigDiskTest() | defragTest();
 }
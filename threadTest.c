@@ -0,0 +1,233 @@
+/* TinyFS multithreaded stress test
+ * Every thread works on its own file and a file they all share, while files are created and
+ * deleted around them. Afterwards every file is checked, before and after a remount.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+
+#define NUM_THREADS 8
+#define ROUNDS 300
+#define FILE_SIZE 3000      /* bytes in each thread's own file */
+#define SLICE 500           /* bytes of the shared file each thread owns */
+#define READ_PASSES 200
+#define DISK_SIZE (1024 * 1024)
+
+int failed = 0;             /* set by any thread that sees something wrong */
+
+
+/* the byte a thread's file should hold at offset after round */
+char expected(int thread, int round, int offset) {
+  return 'a' + (thread * 7 + round + offset) % 26;
+}
+
+void fail(char *what, int thread, int value) {
+  printf("] thread %d: %s (%d)\n", thread, what, value);
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+/* check that a file holds size bytes written by expected() for thread and round */
+int checkFile(fileDescriptor fd, int thread, int round, int size) {
+  char *buffer = malloc(size + 1);
+  int i, got = tfs_pread(fd, buffer, size + 1, 0);
+
+  if (got != size) {
+    free(buffer);
+    return -1;
+  }
+  for (i = 0; i < size; i++) {
+    if (buffer[i] != expected(thread, round, i)) {
+      free(buffer);
+      return -1;
+    }
+  }
+  free(buffer);
+  return 0;
+}
+
+/* Each thread rewrites its own file in place, reads it back byte by byte and in bulk,
+ * writes its slice of the shared file, and makes and deletes a scratch file every few rounds */
+void *worker(void *arg) {
+  int thread = (int) (long) arg;
+  int round, i;
+  char name[9], scratch[9], buffer[FILE_SIZE], c;
+
+  sprintf(name, "t%d", thread);
+  sprintf(scratch, "s%d", thread);
+
+  fileDescriptor own = tfs_openFile(name);
+  fileDescriptor shared = tfs_openFile("shared");
+  if (own < 0 || shared < 0) {
+    fail("open", thread, own < 0 ? own : shared);
+    return NULL;
+  }
+
+  for (i = 0; i < FILE_SIZE; i++)
+    buffer[i] = expected(thread, 0, i);
+  if (tfs_writeFile(own, buffer, FILE_SIZE) < 0)
+    fail("writeFile", thread, 0);
+
+  for (round = 1; round <= ROUNDS && !failed; round++) {
+    /* rewrite the file in pieces */
+    for (i = 0; i < FILE_SIZE; i++)
+      buffer[i] = expected(thread, round, i);
+    for (i = 0; i < FILE_SIZE; i += 700) {
+      int length = FILE_SIZE - i < 700 ? FILE_SIZE - i : 700;
+      if (tfs_pwrite(own, buffer + i, length, i) != length)
+        fail("pwrite", thread, round);
+    }
+    if (checkFile(own, thread, round, FILE_SIZE) < 0)
+      fail("pread", thread, round);
+
+    /* walk some of it with the cursor */
+    tfs_seek(own, round % FILE_SIZE);
+    for (i = round % FILE_SIZE; i < FILE_SIZE && i < round % FILE_SIZE + 300; i++) {
+      if (tfs_readByte(own, &c) < 0 || c != expected(thread, round, i)) {
+        fail("readByte", thread, i);
+        break;
+      }
+    }
+
+    /* own slice of the shared file */
+    memset(buffer, 'A' + thread, SLICE);
+    if (tfs_pwrite(shared, buffer, SLICE, thread * SLICE) != SLICE)
+      fail("shared pwrite", thread, round);
+    if (tfs_pread(shared, buffer, SLICE, thread * SLICE) != SLICE || buffer[0] != 'A' + thread || buffer[SLICE - 1] != 'A' + thread)
+      fail("shared pread", thread, round);
+
+    /* churn the allocator and the name index */
+    if (round % 10 == 0) {
+      fileDescriptor fd = tfs_openFile(scratch);
+      if (fd < 0 || tfs_writeFile(fd, buffer, 1 + round) < 0 || tfs_deleteFile(fd) < 0)
+        fail("scratch", thread, round);
+      tfs_closeFile(fd);
+    }
+  }
+
+  tfs_closeFile(own);
+  tfs_closeFile(shared);
+  return NULL;
+}
+
+/* Readers pread their own file over and over, to compare one thread with many */
+void *reader(void *arg) {
+  int thread = (int) (long) arg;
+  int i;
+  char name[9], buffer[FILE_SIZE];
+
+  sprintf(name, "t%d", thread);
+  fileDescriptor fd = tfs_openFile(name);
+  for (i = 0; i < READ_PASSES; i++) {
+    if (tfs_pread(fd, buffer, FILE_SIZE, 0) != FILE_SIZE) {
+      fail("reader", thread, i);
+      break;
+    }
+  }
+  tfs_closeFile(fd);
+  return NULL;
+}
+
+/* run count reader threads and return how long they took in seconds */
+double timeReaders(int count) {
+  pthread_t threads[NUM_THREADS];
+  struct timespec start, end;
+  long i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++)
+    pthread_create(&threads[i], NULL, reader, (void *) i);
+  for (i = 0; i < count; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* check every thread's file and the shared file from one thread */
+void checkAll() {
+  char name[9], buffer[NUM_THREADS * SLICE];
+  int i, j;
+
+  for (i = 0; i < NUM_THREADS; i++) {
+    sprintf(name, "t%d", i);
+    fileDescriptor fd = tfs_openFile(name);
+    if (checkFile(fd, i, ROUNDS, FILE_SIZE) < 0)
+      fail("final contents", i, 0);
+    tfs_closeFile(fd);
+  }
+
+  fileDescriptor fd = tfs_openFile("shared");
+  if (tfs_pread(fd, buffer, sizeof(buffer), 0) != sizeof(buffer))
+    fail("shared size", -1, 0);
+  for (i = 0; i < NUM_THREADS; i++) {
+    for (j = 0; j < SLICE; j++) {
+      if (buffer[i * SLICE + j] != 'A' + i) {
+        fail("shared contents", i, j);
+        break;
+      }
+    }
+  }
+  tfs_closeFile(fd);
+}
+
+int main() {
+  pthread_t threads[NUM_THREADS];
+  char zeros[NUM_THREADS * SLICE] = {0};
+  char *diskName = "threadTestDisk";
+  long i;
+
+  /* always start from a new disk */
+  remove(diskName);
+  if (tfs_mkfs(diskName, DISK_SIZE) < 0 || tfs_mount(diskName) < 0) {
+    perror("failed to make disk");
+    return 1;
+  }
+
+  /* the shared file needs its full size before threads write into it */
+  fileDescriptor fd = tfs_openFile("shared");
+  if (tfs_writeFile(fd, zeros, sizeof(zeros)) < 0) {
+    perror("tfs_writeFile failed");
+    return 1;
+  }
+  tfs_closeFile(fd);
+
+  /* run the workers while this thread keeps flushing */
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&threads[i], NULL, worker, (void *) i);
+  for (i = 0; i < 20; i++)
+    if (tfs_flush() < 0)
+      fail("flush", -1, i);
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  printf("] %d threads did %d rounds each\n", NUM_THREADS, ROUNDS);
+
+  checkAll();
+
+  /* how fast readers of different files go alone and together, only for comparing by hand. It says nothing about
+   * scaling unless the machine has several CPUs, so print how many it has */
+  double one = timeReaders(1);
+  double all = timeReaders(NUM_THREADS);
+  printf("] 1 reader: %.0f reads/s, %d readers: %.0f reads/s (%ld CPUs)\n", READ_PASSES / one, NUM_THREADS,
+         NUM_THREADS * READ_PASSES / all, sysconf(_SC_NPROCESSORS_ONLN));
+
+  /* and everything is still there after a remount */
+  if (tfs_unmount() < 0 || tfs_mount(diskName) < 0)
+    fail("remount", -1, 0);
+  checkAll();
+  tfs_unmount();
+
+  if (failed) {
+    printf("] threadTest failed\n");
+    return 1;
+  }
+  printf("] threadTest passed\n");
+  return 0;
+}
@@ -43,12 +43,14 @@ int main() {
   char *defaultDiskName = "tinyFSDemoDisk";
 
   /* try to mount the disk */
-  if (tfs_mount(defaultDiskName) < 0) {             /* if mount fails */
+  int status = tfs_mount(defaultDiskName);
+  if (status == ERR_NOFILE) {                       /* if there's no disk yet */
     tfs_mkfs(defaultDiskName, DEFAULT_DISK_SIZE);	  /* then make a new disk */
-    if (tfs_mount(defaultDiskName) < 0) {	          /* if we still can't open it... */
-	    perror("failed to open disk");	              /* then just exit */
-	    return 1;
-	  }
+    status = tfs_mount(defaultDiskName);
+  }
+  if (status < 0) {	                                /* if we still can't open it, don't touch what's there */
+    printf("failed to mount %s (%d)\n", defaultDiskName, status);
+    return 1;
   }
 
   afileContent = (char *) malloc(afileSize * sizeof(char));
@@ -187,7 +189,10 @@ int main() {
 
   /* rename bfile */
   printf("Renaming bfile to cfile\n");
-  if (tfs_rename(bFD, "cfile") < 0) {
+  status = tfs_rename(bFD, "cfile");
+  if (status == ERR_FILEEXISTS) {
+    printf("cfile already exists, so bfile keeps its name\n");
+  } else if (status < 0) {
     perror("tfs_rename failed");
   }
 